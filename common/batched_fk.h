@@ -0,0 +1,428 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include <Core/array.h>
+#include <Kin/kin.h>
+#include <Kin/frame.h>
+
+#include "config.h"
+
+// Forward kinematics of a set of frames for a whole joint path at once.
+// The kinematic chain from the active joints to the frames is extracted from
+// the configuration once, and then evaluated for all timesteps in tight
+// loops over the time (structure of arrays), which the compiler can
+// vectorize.
+// Only single dof hinge and prismatic joints are supported, the result is
+// validated against the configuration at a few timesteps, and compute()
+// returns false if anything does not match.
+// The chain only refers to frames by their ID, and can be evaluated on any
+// configuration with the same kinematic structure (e.g. a copy).
+class BatchedChainFK {
+public:
+  BatchedChainFK(rai::Configuration &C, const FrameL &frames)
+      : frame_ids(framesToIndices(frames)) {
+    const arr q = C.getJointState();
+
+    for (const auto j : C.activeJoints) {
+      active_joints[j->frame->ID] = j;
+    }
+
+    for (const auto f : frames) {
+      output_nodes.push_back(get_node(f, q));
+      if (!supported) {
+        return;
+      }
+    }
+  }
+
+  bool is_supported() const { return supported; }
+
+  // computes the poses of the frames for all timesteps of the path, X is of
+  // size T x frames x 7 (position and quaternion, as in getFrameState).
+  // Leaves the configuration at the last state of the path.
+  bool compute(rai::Configuration &C, const arr &path, arr &X) const {
+    if (!supported || path.d0 == 0) {
+      return false;
+    }
+
+    const uint T = path.d0;
+    const uint dof = path.d1;
+
+    // world poses of all nodes, structure of arrays over the time
+    std::vector<std::vector<double>> poses(nodes.size(),
+                                           std::vector<double>(7 * T));
+
+    std::vector<double> angle(T);
+    for (uint n = 0; n < nodes.size(); ++n) {
+      const Node &node = nodes[n];
+      double *out = poses[n].data();
+
+      if (node.parent < 0) {
+        for (uint k = 0; k < 7; ++k) {
+          std::fill(out + k * T, out + (k + 1) * T, node.local[k]);
+        }
+        continue;
+      }
+
+      // local transform of the node for all timesteps
+      std::vector<double> local(7 * T);
+      for (uint k = 0; k < 7; ++k) {
+        std::fill(local.begin() + k * T, local.begin() + (k + 1) * T,
+                  node.local[k]);
+      }
+
+      if (node.joint_type != JointKind::none) {
+        const uint qi = node.q_index;
+        if (qi >= dof) {
+          return false;
+        }
+        for (uint t = 0; t < T; ++t) {
+          angle[t] = path.p[t * dof + qi];
+        }
+
+        if (node.joint_type == JointKind::hinge) {
+          // local = base * rot(axis, q)
+          const double *b = node.local;
+          double *lw = &local[3 * T];
+          double *lx = &local[4 * T];
+          double *ly = &local[5 * T];
+          double *lz = &local[6 * T];
+          const double ax = node.axis[0];
+          const double ay = node.axis[1];
+          const double az = node.axis[2];
+          for (uint t = 0; t < T; ++t) {
+            const double c = std::cos(0.5 * angle[t]);
+            const double s = std::sin(0.5 * angle[t]);
+            quat_mul(b[3], b[4], b[5], b[6], c, s * ax, s * ay, s * az,
+                     lw[t], lx[t], ly[t], lz[t]);
+          }
+        } else {
+          // local = base * trans(axis * q)
+          double d[3];
+          rotate(node.local + 3, node.axis, d);
+          for (uint k = 0; k < 3; ++k) {
+            double *l = &local[k * T];
+            for (uint t = 0; t < T; ++t) {
+              l[t] += d[k] * angle[t];
+            }
+          }
+        }
+      }
+
+      // compose with the parent
+      const double *p = poses[node.parent].data();
+      const double *ppx = p, *ppy = p + T, *ppz = p + 2 * T;
+      const double *pqw = p + 3 * T, *pqx = p + 4 * T, *pqy = p + 5 * T,
+                   *pqz = p + 6 * T;
+      const double *lpx = &local[0], *lpy = &local[T], *lpz = &local[2 * T];
+      const double *lqw = &local[3 * T], *lqx = &local[4 * T],
+                   *lqy = &local[5 * T], *lqz = &local[6 * T];
+      double *opx = out, *opy = out + T, *opz = out + 2 * T;
+      double *oqw = out + 3 * T, *oqx = out + 4 * T, *oqy = out + 5 * T,
+             *oqz = out + 6 * T;
+
+      for (uint t = 0; t < T; ++t) {
+        double r[3];
+        const double v[3] = {lpx[t], lpy[t], lpz[t]};
+        const double q[4] = {pqw[t], pqx[t], pqy[t], pqz[t]};
+        rotate(q, v, r);
+        opx[t] = ppx[t] + r[0];
+        opy[t] = ppy[t] + r[1];
+        opz[t] = ppz[t] + r[2];
+        quat_mul(pqw[t], pqx[t], pqy[t], pqz[t], lqw[t], lqx[t], lqy[t],
+                 lqz[t], oqw[t], oqx[t], oqy[t], oqz[t]);
+      }
+    }
+
+    X.resize(T, frame_ids.N, 7);
+    for (uint t = 0; t < T; ++t) {
+      for (uint i = 0; i < frame_ids.N; ++i) {
+        const double *pose = poses[output_nodes[i]].data();
+        for (uint k = 0; k < 7; ++k) {
+          X(t, i, k) = pose[k * T + t];
+        }
+      }
+    }
+
+    return validate(C, path, X);
+  }
+
+private:
+  enum class JointKind { none, hinge, prismatic };
+
+  struct Node {
+    int parent;
+    // world pose for root nodes, relative pose (before the joint) otherwise
+    double local[7];
+
+    JointKind joint_type = JointKind::none;
+    uint q_index = 0;
+    double axis[3] = {0, 0, 0};
+  };
+
+  static void quat_mul(const double aw, const double ax, const double ay,
+                       const double az, const double bw, const double bx,
+                       const double by, const double bz, double &w, double &x,
+                       double &y, double &z) {
+    w = aw * bw - ax * bx - ay * by - az * bz;
+    x = aw * bx + ax * bw + ay * bz - az * by;
+    y = aw * by - ax * bz + ay * bw + az * bx;
+    z = aw * bz + ax * by - ay * bx + az * bw;
+  }
+
+  // rotates v by the quaternion q (w, x, y, z)
+  static void rotate(const double *q, const double *v, double *r) {
+    const double w = q[0], x = q[1], y = q[2], z = q[3];
+    // t = 2 * cross(q.xyz, v)
+    const double tx = 2 * (y * v[2] - z * v[1]);
+    const double ty = 2 * (z * v[0] - x * v[2]);
+    const double tz = 2 * (x * v[1] - y * v[0]);
+    r[0] = v[0] + w * tx + (y * tz - z * ty);
+    r[1] = v[1] + w * ty + (z * tx - x * tz);
+    r[2] = v[2] + w * tz + (x * ty - y * tx);
+  }
+
+  // returns the index of the node of the frame, and creates the nodes of the
+  // frame and all its ancestors that move with the active joints
+  int get_node(rai::Frame *f, const arr &q) {
+    const auto it = node_of_frame.find(f->ID);
+    if (it != node_of_frame.end()) {
+      return it->second;
+    }
+
+    int parent = -1;
+    if (f->parent && is_moving(f->parent)) {
+      parent = get_node(f->parent, q);
+    }
+
+    Node node;
+    node.parent = parent;
+
+    if (parent < 0 && !active_joints.count(f->ID)) {
+      // does not move along the path
+      const arr pose = f->getPose();
+      for (uint k = 0; k < 7; ++k) {
+        node.local[k] = pose(k);
+      }
+    } else {
+      const rai::Transformation &Q = f->get_Q();
+      node.local[0] = Q.pos.x;
+      node.local[1] = Q.pos.y;
+      node.local[2] = Q.pos.z;
+      node.local[3] = Q.rot.w;
+      node.local[4] = Q.rot.x;
+      node.local[5] = Q.rot.y;
+      node.local[6] = Q.rot.z;
+
+      if (parent < 0) {
+        // root of the moving part: the pose of the parent is constant
+        node.parent = add_fixed_node(f->parent);
+      }
+
+      if (active_joints.count(f->ID)) {
+        set_joint(node, active_joints.at(f->ID), q);
+      }
+    }
+
+    nodes.push_back(node);
+    node_of_frame[f->ID] = nodes.size() - 1;
+    return nodes.size() - 1;
+  }
+
+  int add_fixed_node(rai::Frame *f) {
+    Node node;
+    node.parent = -1;
+    if (f) {
+      const arr pose = f->getPose();
+      for (uint k = 0; k < 7; ++k) {
+        node.local[k] = pose(k);
+      }
+    } else {
+      const double identity[7] = {0, 0, 0, 1, 0, 0, 0};
+      std::copy(identity, identity + 7, node.local);
+    }
+    nodes.push_back(node);
+    return nodes.size() - 1;
+  }
+
+  // removes the current joint value from the relative transform, such that
+  // local = base * joint(q)
+  void set_joint(Node &node, rai::Joint *j, const arr &q) {
+    if (j->dim != 1) {
+      supported = false;
+      return;
+    }
+
+    node.q_index = j->qIndex;
+    const double value = q(j->qIndex);
+
+    if (j->type == rai::JT_hingeX || j->type == rai::JT_transX) {
+      node.axis[0] = 1;
+    } else if (j->type == rai::JT_hingeY || j->type == rai::JT_transY) {
+      node.axis[1] = 1;
+    } else if (j->type == rai::JT_hingeZ || j->type == rai::JT_transZ) {
+      node.axis[2] = 1;
+    } else {
+      supported = false;
+      return;
+    }
+
+    if (j->type == rai::JT_hingeX || j->type == rai::JT_hingeY ||
+        j->type == rai::JT_hingeZ) {
+      node.joint_type = JointKind::hinge;
+      const double c = std::cos(0.5 * value);
+      const double s = std::sin(0.5 * value);
+      double w, x, y, z;
+      quat_mul(node.local[3], node.local[4], node.local[5], node.local[6], c,
+               -s * node.axis[0], -s * node.axis[1], -s * node.axis[2], w, x,
+               y, z);
+      node.local[3] = w;
+      node.local[4] = x;
+      node.local[5] = y;
+      node.local[6] = z;
+    } else {
+      node.joint_type = JointKind::prismatic;
+      double d[3];
+      rotate(node.local + 3, node.axis, d);
+      for (uint k = 0; k < 3; ++k) {
+        node.local[k] -= d[k] * value;
+      }
+    }
+  }
+
+  bool is_moving(rai::Frame *f) {
+    const auto it = moving.find(f->ID);
+    if (it != moving.end()) {
+      return it->second;
+    }
+
+    const bool m =
+        active_joints.count(f->ID) > 0 || (f->parent && is_moving(f->parent));
+    moving[f->ID] = m;
+    return m;
+  }
+
+  // compares against the configuration at the first, middle and last step
+  bool validate(rai::Configuration &C, const arr &path, const arr &X) const {
+    const uint T = path.d0;
+    if (C.getJointStateDimension() != path.d1) {
+      return false;
+    }
+    const FrameL frames = C.getFrames(frame_ids);
+    for (const uint t : {0u, T / 2, T - 1}) {
+      C.setJointState(path[t]);
+      const arr expected = C.getFrameState(frames);
+      for (uint i = 0; i < frames.N; ++i) {
+        double pos_err = 0;
+        double quat_err = 0;
+        double quat_err_neg = 0;
+        for (uint k = 0; k < 3; ++k) {
+          pos_err = std::max(pos_err, std::abs(expected(i, k) - X(t, i, k)));
+        }
+        for (uint k = 3; k < 7; ++k) {
+          quat_err = std::max(quat_err, std::abs(expected(i, k) - X(t, i, k)));
+          quat_err_neg =
+              std::max(quat_err_neg, std::abs(expected(i, k) + X(t, i, k)));
+        }
+        if (pos_err > 1e-6 || std::min(quat_err, quat_err_neg) > 1e-6) {
+          static bool warned = false;
+          if (!warned) {
+            spdlog::warn("Batched fk does not match the configuration for "
+                         "frame {} (error {}, {}), falling back.",
+                         frames(i)->name.p, pos_err,
+                         std::min(quat_err, quat_err_neg));
+            warned = true;
+          }
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  const uintA frame_ids;
+
+  bool supported = true;
+
+  std::unordered_map<uint, rai::Joint *> active_joints;
+  std::unordered_map<uint, bool> moving;
+  std::unordered_map<uint, int> node_of_frame;
+
+  std::vector<Node> nodes;
+  std::vector<int> output_nodes;
+};
+
+// Extracting the chain walks the whole configuration, which costs about as
+// much as evaluating a short path. The chains are thus kept per set of active
+// joints (i.e. per robot) and frames, and only rebuilt if the kinematic
+// structure changed (e.g. an object was linked to a different frame).
+class BatchedChainFKCache {
+public:
+  bool compute(rai::Configuration &C, const FrameL &frames, const arr &path,
+               arr &X) {
+    const std::vector<uint> key = make_key(C, frames);
+
+    std::shared_ptr<const BatchedChainFK> fk;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      const auto it = chains.find(key);
+      if (it != chains.end()) {
+        fk = it->second;
+      }
+    }
+
+    if (fk && !fk->is_supported()) {
+      return false;
+    }
+    if (fk && fk->compute(C, path, X)) {
+      return true;
+    }
+
+    // the cached chain is stale, or there was none yet. Unsupported chains
+    // are cached as well, and fail right away the next time.
+    fk = std::make_shared<const BatchedChainFK>(C, frames);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (chains.size() >= max_size) {
+        chains.clear();
+      }
+      chains[key] = fk;
+    }
+
+    return fk->compute(C, path, X);
+  }
+
+private:
+  static std::vector<uint> make_key(const rai::Configuration &C,
+                                    const FrameL &frames) {
+    std::vector<uint> key;
+    key.reserve(C.activeJoints.N + 2 * frames.N + 1);
+    for (const auto j : C.activeJoints) {
+      key.push_back(j->frame->ID);
+    }
+    // separates the joints from the frames
+    key.push_back(UINT_MAX);
+    for (const auto f : frames) {
+      key.push_back(f->ID);
+      key.push_back(f->parent ? f->parent->ID : UINT_MAX);
+    }
+    return key;
+  }
+
+  static constexpr uint max_size = 256;
+
+  std::mutex mutex;
+  std::map<std::vector<uint>, std::shared_ptr<const BatchedChainFK>> chains;
+};
+
+BatchedChainFKCache batched_fk_cache;
@@ -0,0 +1,415 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <Core/array.h>
+
+#include "spdlog/spdlog.h"
+
+// Binary, column oriented alternative to trajectory.json.
+// All values are little endian. A file consists of
+// - a 64 byte header
+// - the column table, one 128 byte entry per column
+// - the action dictionary (uint16 length followed by the characters)
+// - the column data, every column starting at a multiple of 64 bytes
+// Every column is a dense row-major (num_steps x width) block, i.e., a loader
+// can mmap a single robot or object column from its offset and size without
+// touching the rest of the file.
+
+enum class TrajectoryQuantization : uint32_t {
+  none = 0,
+  fixed_point = 1,
+  delta = 2
+};
+
+TrajectoryQuantization string_to_quantization(const std::string &str) {
+  if (str == "none") {
+    return TrajectoryQuantization::none;
+  } else if (str == "fixed_point") {
+    return TrajectoryQuantization::fixed_point;
+  } else if (str == "delta") {
+    return TrajectoryQuantization::delta;
+  }
+
+  spdlog::warn("Unknown quantization mode '{}', storing float32.", str);
+  return TrajectoryQuantization::none;
+}
+
+// column encodings
+// - float32: num_steps x width float32 values
+// - int16_fixed: num_steps x width int16 values, value = q * scale
+// - int16_delta: width float32 values for the first step, followed by
+//   (num_steps - 1) x width int16 deltas, value_t = value_{t-1} + d_t * scale
+// - uint16_code: num_steps uint16 indices into the action dictionary
+enum class BinaryColumnType : uint32_t {
+  float32 = 0,
+  int16_fixed = 1,
+  int16_delta = 2,
+  uint16_code = 3
+};
+
+struct BinaryTrajectoryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_steps;
+  uint32_t num_columns;
+  uint32_t num_actions;
+  uint32_t quantization;
+  uint32_t reserved;
+  uint64_t column_table_offset;
+  uint64_t action_table_offset;
+  uint64_t data_offset;
+  char padding[8];
+};
+static_assert(sizeof(BinaryTrajectoryHeader) == 64,
+              "binary trajectory header has to be 64 bytes");
+
+struct BinaryTrajectoryColumn {
+  char name[64];
+  uint32_t type;
+  uint32_t num_rows;
+  uint32_t width;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t num_bytes;
+  double scale;
+  char padding[24];
+};
+static_assert(sizeof(BinaryTrajectoryColumn) == 128,
+              "binary trajectory column entry has to be 128 bytes");
+
+const char binary_trajectory_magic[8] = {'T', 'R', 'A', 'J',
+                                         'B', 'I', 'N', '\0'};
+const uint32_t binary_trajectory_version = 1;
+const uint64_t binary_trajectory_alignment = 64;
+
+uint64_t align_to_binary_trajectory_block(const uint64_t offset) {
+  return (offset + binary_trajectory_alignment - 1) /
+         binary_trajectory_alignment * binary_trajectory_alignment;
+}
+
+class BinaryTrajectoryWriter {
+public:
+  BinaryTrajectoryWriter(const uint _num_steps,
+                         const TrajectoryQuantization _quantization =
+                             TrajectoryQuantization::none)
+      : num_steps(_num_steps), quantization(_quantization){};
+
+  // data is expected to be of shape num_steps x width
+  void add_column(const std::string &name, const arr &data) {
+    if (data.d0 != num_steps) {
+      spdlog::error("Column {} has {} rows, expected {}.", name, data.d0,
+                    num_steps);
+      return;
+    }
+
+    const uint width = data.nd == 1 ? 1 : data.d1;
+
+    Column col;
+    col.name = name;
+    col.width = width;
+
+    if (quantization == TrajectoryQuantization::none) {
+      col.type = BinaryColumnType::float32;
+      col.bytes.resize(sizeof(float) * data.N);
+      float *dst = (float *)col.bytes.data();
+      for (uint i = 0; i < data.N; ++i) {
+        dst[i] = (float)data.elem(i);
+      }
+    } else if (quantization == TrajectoryQuantization::fixed_point) {
+      col.type = BinaryColumnType::int16_fixed;
+
+      double max_abs = 0.;
+      for (uint i = 0; i < data.N; ++i) {
+        max_abs = std::max(max_abs, std::fabs(data.elem(i)));
+      }
+      col.scale = max_abs > 0. ? max_abs / 32767. : 1.;
+
+      col.bytes.resize(sizeof(int16_t) * data.N);
+      int16_t *dst = (int16_t *)col.bytes.data();
+      for (uint i = 0; i < data.N; ++i) {
+        dst[i] = quantize(data.elem(i) / col.scale);
+      }
+    } else {
+      col.type = BinaryColumnType::int16_delta;
+
+      double max_delta = 0.;
+      for (uint t = 1; t < num_steps; ++t) {
+        for (uint j = 0; j < width; ++j) {
+          max_delta = std::max(max_delta, std::fabs(data.elem(t * width + j) -
+                                                    data.elem((t - 1) * width + j)));
+        }
+      }
+      // leave some headroom for the accumulated rounding error
+      col.scale = max_delta > 0. ? max_delta / 32000. : 1.;
+
+      const uint num_first = num_steps > 0 ? width : 0;
+      const uint num_deltas = num_steps > 0 ? (num_steps - 1) * width : 0;
+      col.bytes.resize(sizeof(float) * num_first +
+                       sizeof(int16_t) * num_deltas);
+
+      float *first = (float *)col.bytes.data();
+      int16_t *deltas =
+          (int16_t *)(col.bytes.data() + sizeof(float) * num_first);
+
+      // we quantize against the reconstructed value to avoid drift
+      std::vector<double> reconstructed(width);
+      for (uint j = 0; j < num_first; ++j) {
+        first[j] = (float)data.elem(j);
+        reconstructed[j] = first[j];
+      }
+      for (uint t = 1; t < num_steps; ++t) {
+        for (uint j = 0; j < width; ++j) {
+          const int16_t d =
+              quantize((data.elem(t * width + j) - reconstructed[j]) / col.scale);
+          deltas[(t - 1) * width + j] = d;
+          reconstructed[j] += d * col.scale;
+        }
+      }
+    }
+
+    columns.push_back(col);
+  }
+
+  void add_action_column(const std::string &name,
+                         const std::vector<std::string> &actions) {
+    if (actions.size() != num_steps) {
+      spdlog::error("Action column {} has {} rows, expected {}.", name,
+                    actions.size(), num_steps);
+      return;
+    }
+
+    Column col;
+    col.name = name;
+    col.type = BinaryColumnType::uint16_code;
+    col.width = 1;
+    col.bytes.resize(sizeof(uint16_t) * actions.size());
+
+    uint16_t *dst = (uint16_t *)col.bytes.data();
+    for (uint i = 0; i < actions.size(); ++i) {
+      const auto it = action_codes.find(actions[i]);
+      if (it != action_codes.end()) {
+        dst[i] = it->second;
+      } else {
+        const uint16_t code = action_names.size();
+        action_codes[actions[i]] = code;
+        action_names.push_back(actions[i]);
+        dst[i] = code;
+      }
+    }
+
+    columns.push_back(col);
+  }
+
+  bool write(const std::string &file_path) const {
+    spdlog::trace("Writing binary trajectory to {}", file_path);
+
+    BinaryTrajectoryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, binary_trajectory_magic, 8);
+    header.version = binary_trajectory_version;
+    header.num_steps = num_steps;
+    header.num_columns = columns.size();
+    header.num_actions = action_names.size();
+    header.quantization = (uint32_t)quantization;
+
+    header.column_table_offset = sizeof(BinaryTrajectoryHeader);
+    header.action_table_offset =
+        header.column_table_offset +
+        sizeof(BinaryTrajectoryColumn) * columns.size();
+
+    uint64_t action_table_size = 0;
+    for (const auto &name : action_names) {
+      action_table_size += sizeof(uint16_t) + name.size();
+    }
+    header.data_offset = align_to_binary_trajectory_block(
+        header.action_table_offset + action_table_size);
+
+    std::vector<BinaryTrajectoryColumn> table(columns.size());
+    uint64_t offset = header.data_offset;
+    for (uint i = 0; i < columns.size(); ++i) {
+      BinaryTrajectoryColumn &entry = table[i];
+      std::memset(&entry, 0, sizeof(entry));
+
+      if (columns[i].name.size() >= sizeof(entry.name)) {
+        spdlog::warn("Column name {} is too long and will be truncated.",
+                     columns[i].name);
+      }
+      std::strncpy(entry.name, columns[i].name.c_str(),
+                   sizeof(entry.name) - 1);
+
+      entry.type = (uint32_t)columns[i].type;
+      entry.num_rows = num_steps;
+      entry.width = columns[i].width;
+      entry.offset = offset;
+      entry.num_bytes = columns[i].bytes.size();
+      entry.scale = columns[i].scale;
+
+      offset = align_to_binary_trajectory_block(offset + entry.num_bytes);
+    }
+
+    std::ofstream os(file_path, std::ios::out | std::ios::binary);
+    if (!os.is_open()) {
+      spdlog::error("Could not open {} for writing.", file_path);
+      return false;
+    }
+
+    os.write((const char *)&header, sizeof(header));
+    os.write((const char *)table.data(),
+             sizeof(BinaryTrajectoryColumn) * table.size());
+
+    for (const auto &name : action_names) {
+      const uint16_t len = name.size();
+      os.write((const char *)&len, sizeof(len));
+      os.write(name.data(), len);
+    }
+
+    uint64_t pos = header.action_table_offset + action_table_size;
+    for (uint i = 0; i < columns.size(); ++i) {
+      write_padding(os, table[i].offset - pos);
+      os.write(columns[i].bytes.data(), columns[i].bytes.size());
+      pos = table[i].offset + table[i].num_bytes;
+    }
+    write_padding(os, align_to_binary_trajectory_block(pos) - pos);
+
+    os.close();
+    return true;
+  }
+
+private:
+  struct Column {
+    std::string name;
+    BinaryColumnType type = BinaryColumnType::float32;
+    uint width = 0;
+    double scale = 1.;
+    std::vector<char> bytes;
+  };
+
+  static int16_t quantize(const double v) {
+    const long q = std::lround(v);
+    return (int16_t)std::max(-32767l, std::min(32767l, q));
+  }
+
+  static void write_padding(std::ofstream &os, const uint64_t num_bytes) {
+    const char zeros[binary_trajectory_alignment] = {0};
+    os.write(zeros, num_bytes);
+  }
+
+  uint num_steps;
+  TrajectoryQuantization quantization;
+
+  std::vector<Column> columns;
+
+  std::vector<std::string> action_names;
+  std::unordered_map<std::string, uint16_t> action_codes;
+};
+
+// reads a single column back and decodes it to doubles.
+// action columns are returned as codes, the dictionary can be read with
+// read_binary_trajectory_actions.
+arr read_binary_trajectory_column(const std::string &file_path,
+                                  const std::string &name) {
+  std::ifstream is(file_path, std::ios::in | std::ios::binary);
+  if (!is.is_open()) {
+    spdlog::error("Could not open {}.", file_path);
+    return {};
+  }
+
+  BinaryTrajectoryHeader header;
+  is.read((char *)&header, sizeof(header));
+  if (!is || std::memcmp(header.magic, binary_trajectory_magic, 8) != 0) {
+    spdlog::error("{} is not a binary trajectory file.", file_path);
+    return {};
+  }
+
+  std::vector<BinaryTrajectoryColumn> table(header.num_columns);
+  is.seekg(header.column_table_offset);
+  is.read((char *)table.data(),
+          sizeof(BinaryTrajectoryColumn) * header.num_columns);
+
+  for (const auto &entry : table) {
+    if (name != entry.name) {
+      continue;
+    }
+
+    std::vector<char> bytes(entry.num_bytes);
+    is.seekg(entry.offset);
+    is.read(bytes.data(), entry.num_bytes);
+
+    arr data(entry.num_rows, entry.width);
+    const BinaryColumnType type = (BinaryColumnType)entry.type;
+    if (type == BinaryColumnType::float32) {
+      const float *src = (const float *)bytes.data();
+      for (uint i = 0; i < data.N; ++i) {
+        data.elem(i) = src[i];
+      }
+    } else if (type == BinaryColumnType::int16_fixed) {
+      const int16_t *src = (const int16_t *)bytes.data();
+      for (uint i = 0; i < data.N; ++i) {
+        data.elem(i) = src[i] * entry.scale;
+      }
+    } else if (type == BinaryColumnType::int16_delta) {
+      if (entry.num_rows == 0) {
+        return data;
+      }
+      const float *first = (const float *)bytes.data();
+      const int16_t *deltas =
+          (const int16_t *)(bytes.data() + sizeof(float) * entry.width);
+      for (uint j = 0; j < entry.width; ++j) {
+        data.elem(j) = first[j];
+      }
+      for (uint t = 1; t < entry.num_rows; ++t) {
+        for (uint j = 0; j < entry.width; ++j) {
+          data.elem(t * entry.width + j) =
+              data.elem((t - 1) * entry.width + j) +
+              deltas[(t - 1) * entry.width + j] * entry.scale;
+        }
+      }
+    } else {
+      const uint16_t *src = (const uint16_t *)bytes.data();
+      for (uint i = 0; i < data.N; ++i) {
+        data.elem(i) = src[i];
+      }
+    }
+
+    return data;
+  }
+
+  spdlog::error("Column {} not found in {}.", name, file_path);
+  return {};
+}
+
+std::vector<std::string>
+read_binary_trajectory_actions(const std::string &file_path) {
+  std::ifstream is(file_path, std::ios::in | std::ios::binary);
+  if (!is.is_open()) {
+    spdlog::error("Could not open {}.", file_path);
+    return {};
+  }
+
+  BinaryTrajectoryHeader header;
+  is.read((char *)&header, sizeof(header));
+  if (!is || std::memcmp(header.magic, binary_trajectory_magic, 8) != 0) {
+    spdlog::error("{} is not a binary trajectory file.", file_path);
+    return {};
+  }
+
+  std::vector<std::string> actions;
+  is.seekg(header.action_table_offset);
+  for (uint i = 0; i < header.num_actions; ++i) {
+    uint16_t len = 0;
+    is.read((char *)&len, sizeof(len));
+    std::string name(len, '\0');
+    is.read(&name[0], len);
+    actions.push_back(name);
+  }
+
+  return actions;
+}
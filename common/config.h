@@ -9,9 +9,88 @@ namespace manip{
     bool compress_data = false;
     bool export_txt_files = false;
 
+    // "json" or "binary"
+    std::string trajectory_format = "json";
+    // "none", "fixed_point" or "delta", only used for the binary format
+    std::string trajectory_quantization = "none";
+
     std::string output_path = "./out/";
 
     bool randomize_mod_switch_durations = false;
+
+    // plan single robot motions in a precomputed roadmap of the static scene
+    // before falling back to the rrt, see planners/roadmap.h
+    bool use_roadmap = false;
+    unsigned int roadmap_samples = 1000;
+
+    // skip collision checks between robots whose workspaces do not overlap,
+    // see get_out_of_reach_pairs
+    bool prune_out_of_reach_pairs = true;
+    double out_of_reach_margin = 0.2;
+
+    // skip exact collision checks in time windows where no other robot can
+    // be close, see planners/timed_collision.h
+    bool use_temporal_bvh = true;
+    // only update the animation parts that changed between two queries
+    bool incremental_animation = true;
+
+    // reject configurations inside of the static scene with a voxel sdf
+    // before running fcl, see common/static_sdf.h
+    bool use_static_sdf = false;
+    double sdf_resolution = 0.02;
+    std::string sdf_cache_path = "./in/cache/";
+
+    // compute the frame poses of animation parts for all timesteps at once,
+    // see common/batched_fk.h
+    bool batched_fk = true;
+
+    // smooth the paths of all robots jointly before exporting a plan, see
+    // reoptimize_plan in planners/postprocessing.h
+    bool reoptimize_plans = false;
+    unsigned int reoptimize_threads = 0;
+
+    // compress the timing of finished plans, see retime_plan in
+    // planners/postprocessing.h
+    bool retime_plans = false;
+
+    // check the single arm legs of repeated picks before the full problem,
+    // see samplers/repeated_pick_sampler.h
+    bool prune_pick_pick_legs = true;
+
+    // solve the restarts of keyframe problems concurrently, see
+    // samplers/multistart.h
+    unsigned int keyframe_threads = 1;
+    bool deterministic_keyframes = true;
+
+    // warm start the keyframe samplers with solutions of similar problems,
+    // see samplers/seed_bank.h
+    bool use_seed_bank = false;
+    std::string seed_bank_path = "./in/cache/seed_bank.json";
+
+    // skip keyframe problems that are out of reach of the robot, see
+    // samplers/reachability.h
+    bool use_reachability_maps = true;
+    std::string reachability_path = "./in/robots/reachability/";
+
+    // compute keyframes when the random search needs them, see
+    // samplers/keyframe_provider.h
+    bool lazy_keyframes = false;
+
+    // reuse the keyframes of the previous scene that are not affected by the
+    // changes, see samplers/keyframe_cache.h. Disabled if empty.
+    std::string keyframe_cache_path = "";
+
+    // set up the komo problems of the samplers once for all restarts and
+    // objects of the same shape, see samplers/komo_template.h
+    bool reuse_komo_templates = true;
+
+    // solve keyframe problems without collisions first, and refine converged
+    // solutions with collisions for a few iterations
+    bool staged_keyframes = false;
+    unsigned int keyframe_refine_iters = 50;
+
+    // stippling.h, 0 uses all cores
+    unsigned int ik_threads = 0;
   };
 };
 
@@ -3,6 +3,7 @@
 #include "json/json.h"
 #include <Kin/kin.h>
 
+#include "spatial_hash.h"
 #include "types.h"
 #include <PlanningSubroutines/ConfigurationProblem.h>
 
@@ -561,6 +562,10 @@ opposite_three_robot_configuration(rai::Configuration &C,
 
 void random_objects(rai::Configuration &C, const uint N,
                     const double width = .5) {
+  // objects and goals that were placed already. Candidates that overlap with
+  // them are rejected without setting up a collision query.
+  FootprintHash placed;
+
   for (uint i = 0; i < N; ++i) {
     auto *obj = C.addFrame(STRING("obj" << i + 1), "table");
 
@@ -580,8 +585,13 @@ void random_objects(rai::Configuration &C, const uint N,
 
       obj->setPosition({rnd(0), rnd(1), 0.66});
 
+      if (placed.collides(get_footprint(obj))) {
+        continue;
+      }
+
       ConfigurationProblem cp(C);
       if (cp.query({}, false)->isFeasible) {
+        placed.insert(get_footprint(obj));
         break;
       }
     }
@@ -604,8 +614,13 @@ void random_objects(rai::Configuration &C, const uint N,
 
       goal->setPosition({rnd(0), rnd(1), 0.66});
 
+      if (placed.collides(get_footprint(goal))) {
+        continue;
+      }
+
       ConfigurationProblem cp(C);
       if (cp.query({}, false)->isFeasible) {
+        placed.insert(get_footprint(goal));
         break;
       }
     }
@@ -656,6 +671,9 @@ arr get_random_axis_aligned_orientation() {
 
 void cubes_with_random_rotation(rai::Configuration &C, const uint N,
                                 const double width = .5) {
+  // objects and goals that were placed already, see random_objects
+  FootprintHash placed;
+
   for (uint i = 0; i < N; ++i) {
     auto *obj = C.addFrame(STRING("obj" << i + 1), "table");
 
@@ -676,8 +694,13 @@ void cubes_with_random_rotation(rai::Configuration &C, const uint N,
 
       obj->setRelativeQuaternion(get_random_axis_aligned_orientation());
 
+      if (placed.collides(get_footprint(obj))) {
+        continue;
+      }
+
       ConfigurationProblem cp(C);
       if (cp.query({}, false)->isFeasible) {
+        placed.insert(get_footprint(obj));
         break;
       }
     }
@@ -710,8 +733,13 @@ void cubes_with_random_rotation(rai::Configuration &C, const uint N,
       goal->setPosition({rnd(0), rnd(1), 0.66});
       goal->setRelativeQuaternion(get_random_axis_aligned_orientation());
 
+      if (placed.collides(get_footprint(goal))) {
+        continue;
+      }
+
       ConfigurationProblem cp(C);
       if (cp.query({}, false)->isFeasible) {
+        placed.insert(get_footprint(goal));
         break;
       }
     }
@@ -903,7 +931,7 @@ std::unordered_map<Robot, arr>
 get_robot_home_poses(const std::vector<Robot> &robots) {
   std::unordered_map<Robot, arr> poses;
   for (const auto &r : robots) {
-    poses[r] = r.home_pose;
+    poses[r] = r.home_pose.get();
   }
 
   return poses;
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+#include <Core/array.h>
+#include <Kin/kin.h>
+
+// Allocation free kernels on joint vectors and joint paths.
+// The loops are instantiated for the joint dimensions of the robots we use
+// (ur5: 6, kuka and panda: 7, and pairs of them for handovers), such that the
+// compiler can fully unroll and vectorize them. Other dimensions use the
+// generic version (D = 0).
+namespace joint_kernels {
+
+template <uint D> using Dof = std::integral_constant<uint, D>;
+
+template <uint D> inline uint dim(const uint n) { return D == 0 ? n : D; }
+
+// calls f with the compile time dimension that matches n
+template <typename F> auto dispatch(const uint n, F &&f) {
+  switch (n) {
+  case 6:
+    return f(Dof<6>());
+  case 7:
+    return f(Dof<7>());
+  case 12:
+    return f(Dof<12>());
+  case 14:
+    return f(Dof<14>());
+  default:
+    return f(Dof<0>());
+  }
+}
+
+inline double wrap_angle(const double d) {
+  return std::fmod(d + 3. * RAI_PI, 2 * RAI_PI) - RAI_PI;
+}
+
+template <uint D>
+double abs_max_diff(const double *a, const double *b, const uint n) {
+  double m = 0;
+  for (uint l = 0; l < dim<D>(n); ++l) {
+    m = std::max(m, std::abs(a[l] - b[l]));
+  }
+  return m;
+}
+
+template <uint D>
+double distance(const double *a, const double *b, const uint n) {
+  double sq = 0;
+  for (uint l = 0; l < dim<D>(n); ++l) {
+    sq += (a[l] - b[l]) * (a[l] - b[l]);
+  }
+  return std::sqrt(sq);
+}
+
+// length of the step from a to b, taking the shorter direction for the
+// periodic dimensions
+template <uint D>
+double step_length(const double *a, const double *b,
+                   const unsigned char *periodic, const uint n,
+                   const bool inf_norm) {
+  double res = 0;
+  for (uint l = 0; l < dim<D>(n); ++l) {
+    const double d = periodic[l] ? wrap_angle(a[l] - b[l]) : a[l] - b[l];
+    if (inf_norm) {
+      res = std::max(res, std::abs(d));
+    } else {
+      res += d * d;
+    }
+  }
+  return inf_norm ? res : std::sqrt(res);
+}
+
+template <uint D>
+double path_length(const double *path, const uint T, const uint n,
+                   const unsigned char *periodic, const bool inf_norm) {
+  double cost = 0;
+  for (uint i = 0; i + 1 < T; ++i) {
+    cost += step_length<D>(path + i * dim<D>(n), path + (i + 1) * dim<D>(n),
+                           periodic, n, inf_norm);
+  }
+  return cost;
+}
+
+template <uint D>
+double max_step(const double *path, const uint T, const uint n) {
+  double m = 0;
+  for (uint i = 0; i + 1 < T; ++i) {
+    m = std::max(m, abs_max_diff<D>(path + i * dim<D>(n),
+                                    path + (i + 1) * dim<D>(n), n));
+  }
+  return m;
+}
+
+// res = a + s * (b - a)
+template <uint D>
+void lerp(const double *a, const double *b, const double s, const uint n,
+          double *res) {
+  for (uint l = 0; l < dim<D>(n); ++l) {
+    res[l] = a[l] + s * (b[l] - a[l]);
+  }
+}
+
+} // namespace joint_kernels
+
+// marks the active joints that are angular, indexed like the joint state
+std::vector<unsigned char>
+get_periodic_dimensions(const rai::Configuration &C) {
+  std::vector<unsigned char> periodic(C.getJointState().N, 0);
+  for (auto *j : C.activeJoints) {
+    if (j->type == rai::JT_hingeX || j->type == rai::JT_hingeY ||
+        j->type == rai::JT_hingeZ) {
+      periodic[j->qIndex] = 1;
+    }
+  }
+  return periodic;
+}
+
+// absMax(a - b) without the temporary
+double abs_max_diff(const arr &a, const arr &b) {
+  return joint_kernels::dispatch(a.N, [&](auto D) {
+    return joint_kernels::abs_max_diff<decltype(D)::value>(a.p, b.p, a.N);
+  });
+}
+
+// largest step (in the max norm) between two consecutive states of the path
+double get_max_step(const arr &path) {
+  return joint_kernels::dispatch(path.d1, [&](auto D) {
+    return joint_kernels::max_step<decltype(D)::value>(path.p, path.d0,
+                                                       path.d1);
+  });
+}
+
+double get_path_length(const std::vector<unsigned char> &periodic,
+                       const arr &path, const bool inf_norm = true) {
+  return joint_kernels::dispatch(path.d1, [&](auto D) {
+    return joint_kernels::path_length<decltype(D)::value>(
+        path.p, path.d0, path.d1, periodic.data(), inf_norm);
+  });
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "json/json.h"
+
+using json = nlohmann::ordered_json;
+
+// Writes a json document piece by piece to a stream instead of building the
+// full tree first. Leaves are still passed as (small) json values, and are
+// serialized by nlohmann, which keeps the output byte-identical to dumping the
+// full document with `os << data`, respectively `json::to_cbor(data)`.
+// The number of entries of containers has to be known upfront since cbor
+// stores the size of arrays and maps before their content.
+class JsonStreamWriter {
+public:
+  JsonStreamWriter(std::ostream &_os, const bool _cbor)
+      : os(_os), cbor(_cbor){};
+
+  ~JsonStreamWriter() {
+    if (!stack.empty()) {
+      spdlog::error("JsonStreamWriter destroyed with {} open containers.",
+                    stack.size());
+    }
+  }
+
+  void begin_object(const std::size_t num_entries) {
+    begin_value();
+    if (cbor) {
+      write_cbor_header(0xA0, num_entries);
+    } else {
+      os.put('{');
+    }
+    stack.push_back({true, true, num_entries});
+  }
+
+  void end_object() {
+    end_container();
+    if (!cbor) {
+      os.put('}');
+    }
+  }
+
+  void begin_array(const std::size_t num_entries) {
+    begin_value();
+    if (cbor) {
+      write_cbor_header(0x80, num_entries);
+    } else {
+      os.put('[');
+    }
+    stack.push_back({false, true, num_entries});
+  }
+
+  void end_array() {
+    end_container();
+    if (!cbor) {
+      os.put(']');
+    }
+  }
+
+  void key(const std::string &k) {
+    if (stack.empty() || !stack.back().is_object) {
+      spdlog::error("Writing key {} outside of an object.", k);
+      return;
+    }
+
+    Container &c = stack.back();
+    if (!c.first && !cbor) {
+      os.put(',');
+    }
+    c.first = false;
+    if (c.remaining == 0) {
+      spdlog::error("Object has more entries than announced.");
+    } else {
+      --c.remaining;
+    }
+
+    if (cbor) {
+      write_cbor_header(0x60, k.size());
+      os.write(k.data(), k.size());
+    } else {
+      os << json(k) << ':';
+    }
+    after_key = true;
+  }
+
+  void value(const json &v) {
+    begin_value();
+    if (cbor) {
+      json::to_cbor(v, os);
+    } else {
+      os << v;
+    }
+  }
+
+private:
+  struct Container {
+    bool is_object;
+    bool first;
+    std::size_t remaining;
+  };
+
+  // handles separators and counting for values in arrays
+  void begin_value() {
+    if (after_key) {
+      after_key = false;
+      return;
+    }
+
+    if (stack.empty()) {
+      return;
+    }
+
+    Container &c = stack.back();
+    if (c.is_object) {
+      spdlog::error("Writing value without key in object.");
+      return;
+    }
+
+    if (!c.first && !cbor) {
+      os.put(',');
+    }
+    c.first = false;
+    if (c.remaining == 0) {
+      spdlog::error("Array has more entries than announced.");
+    } else {
+      --c.remaining;
+    }
+  }
+
+  void end_container() {
+    if (stack.empty()) {
+      spdlog::error("Closing container that was never opened.");
+      return;
+    }
+    if (stack.back().remaining != 0) {
+      spdlog::error("Container closed with {} missing entries.",
+                    stack.back().remaining);
+    }
+    stack.pop_back();
+  }
+
+  // same size encoding as nlohmann's cbor writer
+  void write_cbor_header(const uint8_t major, const std::size_t n) {
+    if (n <= 0x17) {
+      os.put(static_cast<char>(major + n));
+    } else if (n <= 0xFF) {
+      os.put(static_cast<char>(major + 0x18));
+      write_big_endian(n, 1);
+    } else if (n <= 0xFFFF) {
+      os.put(static_cast<char>(major + 0x19));
+      write_big_endian(n, 2);
+    } else if (n <= 0xFFFFFFFF) {
+      os.put(static_cast<char>(major + 0x1A));
+      write_big_endian(n, 4);
+    } else {
+      os.put(static_cast<char>(major + 0x1B));
+      write_big_endian(n, 8);
+    }
+  }
+
+  void write_big_endian(const uint64_t n, const unsigned int num_bytes) {
+    for (int i = num_bytes - 1; i >= 0; --i) {
+      os.put(static_cast<char>((n >> (8 * i)) & 0xFF));
+    }
+  }
+
+  std::ostream &os;
+  const bool cbor;
+
+  std::vector<Container> stack;
+  bool after_key = false;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+
+// Cheap, shareable read-only handle.
+// Copies of a handle refer to the same object, and access never copies.
+// Code that modifies the object makes an explicit copy of it, e.g.
+// rai::Configuration C; C.copy(handle.get()).
+// Constructing a handle from a plain object copies (or moves) it once.
+// Default constructed handles all share one empty object.
+template <typename T> class SharedHandle {
+public:
+  SharedHandle() : ptr(empty()) {}
+  SharedHandle(const T &obj) : ptr(std::make_shared<T>(obj)) {}
+  SharedHandle(T &&obj) : ptr(std::make_shared<T>(std::move(obj))) {}
+
+  const T &get() const { return *ptr; }
+  const T &operator*() const { return *ptr; }
+  const T *operator->() const { return ptr.get(); }
+  operator const T &() const { return *ptr; }
+
+private:
+  static const std::shared_ptr<const T> &empty() {
+    static const std::shared_ptr<const T> obj = std::make_shared<const T>();
+    return obj;
+  }
+
+  std::shared_ptr<const T> ptr;
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <Kin/kin.h>
+
+// Rectangle that an object covers on the table, given by its center, half
+// extents and rotation around the z-axis.
+struct Footprint {
+  double x;
+  double y;
+  double half_x;
+  double half_y;
+  double yaw = 0.;
+
+  // half extents of the axis aligned bounding box
+  double get_aabb_half_x() const {
+    return std::abs(std::cos(yaw)) * half_x + std::abs(std::sin(yaw)) * half_y;
+  }
+  double get_aabb_half_y() const {
+    return std::abs(std::sin(yaw)) * half_x + std::abs(std::cos(yaw)) * half_y;
+  }
+};
+
+// separating axis test of the two rectangles, both grown by margin.
+bool footprints_overlap(const Footprint &a, const Footprint &b,
+                        const double margin = 0.) {
+  const double dx = b.x - a.x;
+  const double dy = b.y - a.y;
+
+  for (const Footprint *f : {&a, &b}) {
+    for (uint k = 0; k < 2; ++k) {
+      // k = 0: x-axis of f, k = 1: y-axis of f
+      const double ax = k == 0 ? std::cos(f->yaw) : -std::sin(f->yaw);
+      const double ay = k == 0 ? std::sin(f->yaw) : std::cos(f->yaw);
+
+      double r = 2 * margin;
+      for (const Footprint *g : {&a, &b}) {
+        const double c = std::cos(g->yaw);
+        const double s = std::sin(g->yaw);
+        r += g->half_x * std::abs(ax * c + ay * s) +
+             g->half_y * std::abs(-ax * s + ay * c);
+      }
+
+      if (std::abs(dx * ax + dy * ay) > r) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// footprint of a box shaped frame. If the box is not upright, this is the
+// axis aligned bounding box of its projection onto the table.
+Footprint get_footprint(rai::Frame *f) {
+  const arr pos = f->getPosition();
+  const arr size = f->getShape().size;
+  const arr R = f->getRotationMatrix();
+
+  Footprint fp{pos(0), pos(1), size(0) / 2, size(1) / 2, 0.};
+  if (std::abs(R(2, 2)) > 1. - 1e-6) {
+    fp.yaw = std::atan2(R(1, 0), R(0, 0));
+    return fp;
+  }
+
+  fp.half_x = 0.;
+  fp.half_y = 0.;
+  for (uint j = 0; j < 3; ++j) {
+    fp.half_x += std::abs(R(0, j)) * size(j) / 2;
+    fp.half_y += std::abs(R(1, j)) * size(j) / 2;
+  }
+  return fp;
+}
+
+// 2D spatial hash of footprints on a uniform grid. Every footprint is stored
+// in all cells its bounding box overlaps, i.e. a query only needs to test the
+// footprints of the cells it overlaps itself.
+// The cell size should be in the order of the size of the footprints.
+class FootprintHash {
+public:
+  FootprintHash(const double _cell_size = 0.1) : cell_size(_cell_size) {}
+
+  void insert(const Footprint &f) {
+    const uint id = footprints.size();
+    footprints.push_back(f);
+    for_each_cell(f, 0., [&](const std::uint64_t key) {
+      cells[key].push_back(id);
+      return false;
+    });
+  }
+
+  // checks if the footprint overlaps with one of the stored ones, both grown
+  // by margin.
+  bool collides(const Footprint &f, const double margin = 0.) const {
+    return for_each_cell(f, margin, [&](const std::uint64_t key) {
+      const auto it = cells.find(key);
+      if (it == cells.end()) {
+        return false;
+      }
+      for (const uint id : it->second) {
+        if (footprints_overlap(f, footprints[id], margin)) {
+          return true;
+        }
+      }
+      return false;
+    });
+  }
+
+  uint size() const { return footprints.size(); }
+
+  void clear() {
+    footprints.clear();
+    cells.clear();
+  }
+
+private:
+  // calls f for the cells the bounding box of the footprint (grown by 2 *
+  // margin) overlaps. Stops as soon as f returns true.
+  template <typename F>
+  bool for_each_cell(const Footprint &fp, const double margin, F f) const {
+    const double hx = fp.get_aabb_half_x() + 2 * margin;
+    const double hy = fp.get_aabb_half_y() + 2 * margin;
+
+    const std::int64_t x0 = std::floor((fp.x - hx) / cell_size);
+    const std::int64_t x1 = std::floor((fp.x + hx) / cell_size);
+    const std::int64_t y0 = std::floor((fp.y - hy) / cell_size);
+    const std::int64_t y1 = std::floor((fp.y + hy) / cell_size);
+
+    for (std::int64_t i = x0; i <= x1; ++i) {
+      for (std::int64_t j = y0; j <= y1; ++j) {
+        if (f((std::uint64_t(i) << 32) ^ std::uint32_t(j))) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  double cell_size;
+  std::vector<Footprint> footprints;
+  std::unordered_map<std::uint64_t, std::vector<uint>> cells;
+};
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include <Core/array.h>
+#include <Kin/kin.h>
+
+#include "types.h"
+
+// frames of the static scene, i.e. everything collidable that is not part of
+// a robot, not an object and not a goal marker.
+FrameL get_static_frames(const rai::Configuration &C,
+                         const std::vector<Robot> &robots) {
+  FrameL frames;
+  for (const auto f : C.frames) {
+    if (!f->shape || f->getShape().cont == 0) {
+      continue;
+    }
+    if (f->name.contains("obj") || f->name.contains("goal")) {
+      continue;
+    }
+
+    bool is_robot_frame = false;
+    for (const auto &r : robots) {
+      if (std::string(f->name.p).rfind(r.prefix, 0) == 0) {
+        is_robot_frame = true;
+        break;
+      }
+    }
+
+    if (!is_robot_frame) {
+      frames.append(f);
+    }
+  }
+  return frames;
+}
+
+// signed distance of the point p (in world coordinates) to the shape of the
+// frame. Returns +inf for shapes that are not supported.
+double get_shape_signed_distance(rai::Frame *f, const double *p) {
+  rai::Shape &shape = f->getShape();
+  const arr &size = shape.size;
+
+  // transform the point into the frame
+  const arr pos = f->getPosition();
+  const arr R = f->getRotationMatrix();
+  double local[3];
+  for (uint i = 0; i < 3; ++i) {
+    local[i] = 0;
+    for (uint j = 0; j < 3; ++j) {
+      local[i] += R(j, i) * (p[j] - pos(j));
+    }
+  }
+
+  // rounded box with half extents h and radius r
+  const auto box_distance = [&](const double *h, const double r) {
+    double outside = 0;
+    double inside = -std::numeric_limits<double>::infinity();
+    for (uint i = 0; i < 3; ++i) {
+      const double d = std::abs(local[i]) - (h[i] - r);
+      outside += std::max(d, 0.) * std::max(d, 0.);
+      inside = std::max(inside, d);
+    }
+    return std::sqrt(outside) + std::min(inside, 0.) - r;
+  };
+
+  const rai::ShapeType type = shape.type();
+  if (type == rai::ST_box && size.N >= 3) {
+    const double h[3] = {size(0) / 2, size(1) / 2, size(2) / 2};
+    return box_distance(h, 0.);
+  }
+  if (type == rai::ST_ssBox && size.N >= 4) {
+    const double h[3] = {size(0) / 2, size(1) / 2, size(2) / 2};
+    return box_distance(h, size(3));
+  }
+  if (type == rai::ST_sphere && size.N >= 1) {
+    return std::sqrt(local[0] * local[0] + local[1] * local[1] +
+                     local[2] * local[2]) -
+           size(-1);
+  }
+  if ((type == rai::ST_capsule || type == rai::ST_cylinder) && size.N >= 2) {
+    const double half_height = size(0) / 2;
+    const double r = size(1);
+    const double radial = std::sqrt(local[0] * local[0] + local[1] * local[1]);
+    if (type == rai::ST_capsule) {
+      const double z = std::max(std::abs(local[2]) - half_height, 0.);
+      return std::sqrt(radial * radial + z * z) - r;
+    }
+    const double dr = radial - r;
+    const double dz = std::abs(local[2]) - half_height;
+    return std::sqrt(std::max(dr, 0.) * std::max(dr, 0.) +
+                     std::max(dz, 0.) * std::max(dz, 0.)) +
+           std::min(std::max(dr, dz), 0.);
+  }
+
+  return std::numeric_limits<double>::infinity();
+}
+
+// Voxel grid with the signed distance to the static scene. Shapes that are
+// not supported by get_shape_signed_distance are ignored, i.e. the grid can
+// only be used to prove collisions, not to rule them out.
+class StaticSceneSDF {
+public:
+  static StaticSceneSDF &instance() {
+    static StaticSceneSDF sdf;
+    return sdf;
+  }
+
+  // builds the grid on the box [lo, hi], or loads it from the cache folder
+  // if the same scene was built before.
+  void build(const FrameL &static_frames, const arr &lo, const arr &hi,
+             const double _resolution, const std::string &cache_folder = "") {
+    values.clear();
+    resolution = _resolution;
+    for (uint i = 0; i < 3; ++i) {
+      if (hi(i) <= lo(i)) {
+        spdlog::warn("Empty bounds, not building the static sdf.");
+        return;
+      }
+
+      origin[i] = lo(i);
+      dims[i] = std::max(1u, uint(std::ceil((hi(i) - lo(i)) / resolution)) + 1);
+    }
+
+    const uint64_t hash = compute_hash(static_frames);
+    const std::string cache_path =
+        cache_folder.empty()
+            ? ""
+            : cache_folder + "/sdf_" + std::to_string(hash) + ".bin";
+
+    if (!cache_path.empty() && load(cache_path, hash)) {
+      spdlog::info("Loaded static sdf from {}", cache_path);
+      return;
+    }
+
+    const auto start_time = std::chrono::high_resolution_clock::now();
+
+    values.assign(std::size_t(dims[0]) * dims[1] * dims[2],
+                  std::numeric_limits<float>::infinity());
+    double p[3];
+    for (uint i = 0; i < dims[0]; ++i) {
+      p[0] = origin[0] + i * resolution;
+      for (uint j = 0; j < dims[1]; ++j) {
+        p[1] = origin[1] + j * resolution;
+        for (uint k = 0; k < dims[2]; ++k) {
+          p[2] = origin[2] + k * resolution;
+
+          double d = std::numeric_limits<double>::infinity();
+          for (const auto f : static_frames) {
+            d = std::min(d, get_shape_signed_distance(f, p));
+          }
+          values[index(i, j, k)] = d;
+        }
+      }
+    }
+
+    const auto end_time = std::chrono::high_resolution_clock::now();
+    const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              end_time - start_time)
+                              .count();
+    spdlog::info("Built static sdf with {}x{}x{} voxels in {}ms", dims[0],
+                 dims[1], dims[2], duration);
+
+    if (!cache_path.empty()) {
+      save(cache_path, hash);
+    }
+  }
+
+  bool is_valid() const { return !values.empty(); }
+
+  void clear() { values.clear(); }
+
+  // upper bound on the signed distance at p, i.e. if this is negative, p is
+  // guaranteed to be inside of the static scene.
+  // uses that the sdf is 1-lipschitz: sdf(p) <= sdf(v) + |p - v|
+  double get_upper_bound(const double *p) const {
+    if (!is_valid()) {
+      return std::numeric_limits<double>::infinity();
+    }
+
+    uint ind[3];
+    double dist_sq = 0;
+    for (uint i = 0; i < 3; ++i) {
+      const double x = (p[i] - origin[i]) / resolution;
+      if (x < 0 || x > dims[i] - 1) {
+        return std::numeric_limits<double>::infinity();
+      }
+      ind[i] = uint(std::round(x));
+      const double d = (x - ind[i]) * resolution;
+      dist_sq += d * d;
+    }
+
+    return values[index(ind[0], ind[1], ind[2])] + std::sqrt(dist_sq);
+  }
+
+private:
+  std::size_t index(const uint i, const uint j, const uint k) const {
+    return (std::size_t(i) * dims[1] + j) * dims[2] + k;
+  }
+
+  uint64_t compute_hash(const FrameL &static_frames) const {
+    std::stringstream ss;
+    ss.precision(6);
+    ss << resolution << ";" << origin[0] << "," << origin[1] << ","
+       << origin[2] << ";" << dims[0] << "," << dims[1] << "," << dims[2];
+    for (const auto f : static_frames) {
+      ss << ";" << f->name << "," << int(f->getShape().type()) << ","
+         << f->getShape().size << "," << f->getPose();
+    }
+    return std::hash<std::string>()(ss.str());
+  }
+
+  bool load(const std::string &path, const uint64_t hash) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.good()) {
+      return false;
+    }
+
+    uint64_t file_hash;
+    uint file_dims[3];
+    ifs.read(reinterpret_cast<char *>(&file_hash), sizeof(file_hash));
+    ifs.read(reinterpret_cast<char *>(file_dims), sizeof(file_dims));
+    if (!ifs.good() || file_hash != hash || file_dims[0] != dims[0] ||
+        file_dims[1] != dims[1] || file_dims[2] != dims[2]) {
+      return false;
+    }
+
+    values.resize(std::size_t(dims[0]) * dims[1] * dims[2]);
+    ifs.read(reinterpret_cast<char *>(values.data()),
+             values.size() * sizeof(float));
+    if (!ifs.good()) {
+      values.clear();
+      return false;
+    }
+    return true;
+  }
+
+  void save(const std::string &path, const uint64_t hash) const {
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs.good()) {
+      spdlog::warn("Could not write static sdf to {}", path);
+      return;
+    }
+    ofs.write(reinterpret_cast<const char *>(&hash), sizeof(hash));
+    ofs.write(reinterpret_cast<const char *>(dims), sizeof(dims));
+    ofs.write(reinterpret_cast<const char *>(values.data()),
+              values.size() * sizeof(float));
+  }
+
+  double resolution = 0.02;
+  double origin[3]{0, 0, 0};
+  uint dims[3]{0, 0, 0};
+
+  std::vector<float> values;
+};
+
+// points on the surface of the collision shapes of a robot, in the frames
+// of the links. If any of them is inside the static scene, the robot is in
+// collision with it.
+// Robot frames whose collisions with a static frame are ignored by the
+// collision checks (see get_cant_collide_pairs), e.g. a base that is mounted
+// into the table, are not checked.
+class RobotSurfacePoints {
+public:
+  RobotSurfacePoints(const rai::Configuration &C, const Robot &r,
+                     const uint max_points_per_frame = 32) {
+    const FrameL static_frames = get_static_frames(C, {r});
+
+    for (const auto f : C.frames) {
+      if (!f->shape || f->getShape().cont == 0 ||
+          std::string(f->name.p).rfind(r.prefix, 0) != 0) {
+        continue;
+      }
+
+      bool has_deactivated_pair = false;
+      for (const auto s : static_frames) {
+        if (!f->getShape().canCollideWith(s) || s == f->parent ||
+            f == s->parent) {
+          has_deactivated_pair = true;
+          break;
+        }
+      }
+      if (has_deactivated_pair) {
+        continue;
+      }
+
+      arr pts = get_surface_points(f);
+      if (pts.d0 == 0) {
+        continue;
+      }
+
+      // subsample
+      if (pts.d0 > max_points_per_frame) {
+        arr sub(max_points_per_frame, 3);
+        for (uint i = 0; i < max_points_per_frame; ++i) {
+          sub[i] = pts[i * pts.d0 / max_points_per_frame];
+        }
+        pts = sub;
+      }
+
+      frame_ids.push_back(f->ID);
+      points.push_back(pts);
+    }
+  }
+
+  // expects the configuration to be at the pose that should be checked
+  bool is_inside_static_scene(const rai::Configuration &C,
+                              const StaticSceneSDF &sdf,
+                              const double margin = 0.005) const {
+    if (!sdf.is_valid()) {
+      return false;
+    }
+
+    double p[3];
+    for (uint k = 0; k < frame_ids.size(); ++k) {
+      rai::Frame *f = C.frames(frame_ids[k]);
+      const arr pos = f->getPosition();
+      const arr R = f->getRotationMatrix();
+
+      const arr &pts = points[k];
+      for (uint n = 0; n < pts.d0; ++n) {
+        for (uint i = 0; i < 3; ++i) {
+          p[i] = pos(i) + R(i, 0) * pts(n, 0) + R(i, 1) * pts(n, 1) +
+                 R(i, 2) * pts(n, 2);
+        }
+        if (sdf.get_upper_bound(p) < -margin) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+private:
+  arr get_surface_points(rai::Frame *f) const {
+    rai::Shape &shape = f->getShape();
+    const arr &V = shape.mesh().V;
+    if (V.d0 > 0) {
+      return V;
+    }
+
+    // face centers of boxes, and the poles of spheres
+    const arr &size = shape.size;
+    double h[3] = {0, 0, 0};
+    if ((shape.type() == rai::ST_box || shape.type() == rai::ST_ssBox) &&
+        size.N >= 3) {
+      h[0] = size(0) / 2;
+      h[1] = size(1) / 2;
+      h[2] = size(2) / 2;
+    } else if (shape.type() == rai::ST_sphere && size.N >= 1) {
+      h[0] = h[1] = h[2] = size(-1);
+    } else {
+      return {};
+    }
+
+    arr pts(6, 3);
+    pts.setZero();
+    for (uint i = 0; i < 3; ++i) {
+      pts(2 * i, i) = h[i];
+      pts(2 * i + 1, i) = -h[i];
+    }
+    return pts;
+  }
+
+  std::vector<uint> frame_ids;
+  std::vector<arr> points;
+};
+
+// bounding box of the reach of all robots, used as extent of the sdf
+void get_workspace_bounds(const rai::Configuration &C,
+                          const std::vector<Robot> &robots, arr &lo, arr &hi) {
+  lo = {1e10, 1e10, 1e10};
+  hi = {-1e10, -1e10, -1e10};
+  for (const auto &r : robots) {
+    rai::Frame *base = C.getFrame(STRING(r.prefix << "base"), false);
+    if (!base) {
+      continue;
+    }
+    const arr pos = base->getPosition();
+    const double reach = get_workspace_from_robot_type(r.type);
+    for (uint i = 0; i < 3; ++i) {
+      lo(i) = std::min(lo(i), pos(i) - reach);
+      hi(i) = std::max(hi(i), pos(i) + reach);
+    }
+  }
+}
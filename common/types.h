@@ -1,9 +1,15 @@
 #pragma once
 
+#include <limits>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <Core/array.h>
 
+#include "shared_handle.h"
+
 enum class PrimitiveType { pick, handover, go_to, joint_pick, pick_pick_1, pick_pick_2};
 
 // enum class ActionType { none, pick, place, handover, go_to };
@@ -126,26 +132,67 @@ std::string ee_type_to_string(EndEffectorType t){
   return "UNSPECIFIED EE";
 }
 
+// maps robot prefixes to small consecutive ids, which are used for hashing,
+// comparisons, and as index into the dense tables below.
+// the same prefix always gets the same id.
+class RobotIdRegistry {
+public:
+  static unsigned int get_id(const std::string &prefix) {
+    std::lock_guard<std::mutex> lock(mutex());
+    auto &ids = prefix_to_id();
+    const auto it = ids.find(prefix);
+    if (it != ids.end()) {
+      return it->second;
+    }
+
+    const unsigned int id = ids.size();
+    ids[prefix] = id;
+    return id;
+  }
+
+  static std::size_t size() {
+    std::lock_guard<std::mutex> lock(mutex());
+    return prefix_to_id().size();
+  }
+
+private:
+  static std::mutex &mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  static std::unordered_map<std::string, unsigned int> &prefix_to_id() {
+    static std::unordered_map<std::string, unsigned int> ids;
+    return ids;
+  }
+};
+
 class Robot {
 public:
+  static constexpr unsigned int invalid_id =
+      std::numeric_limits<unsigned int>::max();
+
   Robot(){};
   Robot(const std::string &_prefix, const RobotType _type = RobotType::ur5, const double _vmax=0.05)
-      : prefix(_prefix), type(_type), vmax(_vmax) {}
+      : prefix(_prefix), id(RobotIdRegistry::get_id(_prefix)), type(_type),
+        vmax(_vmax) {}
 
   bool operator==(const Robot &o) const {
-    return prefix == o.prefix && type == o.type;
+    return id == o.id && type == o.type;
   }
 
   bool operator!=(const Robot &o) const { return !(*this == o); }
 
   std::string prefix;
+  unsigned int id = invalid_id;
   std::string ee_frame_name{"pen_tip"};
 
   RobotType type;
   EndEffectorType ee_type;
 
-  arr start_pose;
-  arr home_pose;
+  // shared between copies of the robot, use .get() to read.
+  SharedHandle<arr> start_pose;
+  SharedHandle<arr> home_pose;
   double vmax = 0.05;
 };
 
@@ -155,9 +202,52 @@ std::ostream &operator<<(std::ostream &os, Robot const &r) {
 
 template <> struct std::hash<Robot> {
   std::size_t operator()(Robot const &r) const {
-    std::hash<std::string> hasher;
-    return hasher(r.prefix);
+    return r.id;
+  }
+};
+
+// flat table indexed by the robot id, used instead of an unordered_map in the
+// hot loops of the sequencing and the lower bound computation.
+template <typename T> class RobotTable {
+public:
+  RobotTable() : entries(RobotIdRegistry::size()), set(entries.size(), false) {}
+
+  T &operator[](const Robot &r) {
+    // resizing to id + 1 would wrap around for robots without an id
+    if (r.id == Robot::invalid_id) {
+      throw std::out_of_range("RobotTable: robot " + r.prefix +
+                              " has no id");
+    }
+    if (r.id >= entries.size()) {
+      entries.resize(r.id + 1);
+      set.resize(r.id + 1, false);
+    }
+    set[r.id] = true;
+    return entries[r.id];
   }
+
+  // like unordered_map::at, throws if the entry was never set
+  const T &at(const Robot &r) const {
+    if (!count(r)) {
+      throw std::out_of_range("RobotTable: no entry for robot " + r.prefix);
+    }
+    return entries[r.id];
+  }
+
+  bool count(const Robot &r) const { return r.id < set.size() && set[r.id]; }
+
+  // calls f(value) for all entries that were set
+  template <typename F> void for_each(F f) const {
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+      if (set[i]) {
+        f(entries[i]);
+      }
+    }
+  }
+
+private:
+  std::vector<T> entries;
+  std::vector<bool> set;
 };
 
 struct RobotTaskPair {
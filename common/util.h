@@ -1,34 +1,65 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <numeric>
+#include <thread>
 #include "types.h"
+#include "batched_fk.h"
 
 #include <KOMO/komo.h>
 
-rai::Animation::AnimationPart make_animation_part(rai::Configuration &C,
-                                                  const arr &path,
-                                                  const FrameL &frames,
-                                                  const uint t_start) {
-  rai::Animation::AnimationPart anim;
+// animation parts are never modified after creation, and are shared between
+// copies of a plan instead of being copied along with it.
+typedef std::shared_ptr<const rai::Animation::AnimationPart> AnimationPartPtr;
 
-  StringA frameNames;
+// only frames that take part in collision checking are stored in the
+// animation. Everything else (e.g. the pure joint frames) can be recomputed
+// from the joint path if it is needed.
+// Objects are always kept since the export reads their poses from here.
+FrameL get_animated_frames(const FrameL &frames) {
+  FrameL animated_frames;
   for (auto f : frames) {
+    if ((f->shape && f->getShape().cont != 0) || f->name.contains("obj")) {
+      animated_frames.append(f);
+    }
+  }
+  return animated_frames;
+}
+
+AnimationPartPtr make_animation_part(rai::Configuration &C, const arr &path,
+                                     const FrameL &frames,
+                                     const uint t_start) {
+  auto anim = std::make_shared<rai::Animation::AnimationPart>();
+
+  const FrameL animated_frames = get_animated_frames(frames);
+
+  StringA frameNames;
+  for (auto f : animated_frames) {
     frameNames.append(f->name);
   }
 
-  anim.start = t_start;
-  anim.frameIDs = framesToIndices(frames);
-  anim.frameNames = frameNames;
+  anim->start = t_start;
+  anim->frameIDs = framesToIndices(animated_frames);
+  anim->frameNames = frameNames;
 
   const uint dt = path.d0;
-  anim.X.resize(dt, frames.N, 7);
+  anim->X.resize(dt, animated_frames.N, 7);
+
+  if (global_params.batched_fk) {
+    if (batched_fk_cache.compute(C, animated_frames, path, anim->X)) {
+      return anim;
+    }
+    anim->X.resize(dt, animated_frames.N, 7);
+  }
 
   arr q;
   for (uint i = 0; i < path.d0; ++i) {
     q = path[i];
     C.setJointState(q);
     // C.watch(true);
-    anim.X[i] = C.getFrameState(frames);
+    anim->X[i] = C.getFrameState(animated_frames);
   }
   return anim;
 }
@@ -48,6 +79,36 @@ std::vector<uint> straightPerm(const std::vector<arr> &qs) {
 }
 
 
+// runs f(0), ..., f(num_tasks - 1) on up to num_threads threads (0 uses one
+// thread per core). f has to be safe to be called concurrently.
+void run_parallel(const uint num_tasks, uint num_threads,
+                  const std::function<void(const uint)> &f) {
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min(num_threads, num_tasks);
+
+  if (num_threads <= 1) {
+    for (uint i = 0; i < num_tasks; ++i) {
+      f(i);
+    }
+    return;
+  }
+
+  std::atomic<uint> next{0};
+  std::vector<std::thread> threads;
+  for (uint k = 0; k < num_threads; ++k) {
+    threads.emplace_back([&]() {
+      for (uint i = next++; i < num_tasks; i = next++) {
+        f(i);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
 void delete_unnecessary_frames(rai::Configuration &C){
   // collect all frames that are collidable
   std::vector<std::string> do_not_delete{"tip", "goal"};
@@ -121,6 +182,130 @@ uintA get_cant_collide_pairs(const rai::Configuration &C) {
   return cantCollidePairs;
 }
 
+// returns pairs of frames that can never collide, since they belong to robots
+// whose workspaces (given by get_workspace_from_robot_type, and enlarged by
+// the margin) do not overlap.
+// objects are treated as part of all robots that could ever hold them, i.e.
+// the robots that can reach the start or the goal of the object, and all
+// robots that could get it via handovers from those.
+uintA get_out_of_reach_pairs(const rai::Configuration &C,
+                             const std::vector<Robot> &robots,
+                             const double margin = 0.2) {
+  const uint n = robots.size();
+
+  std::vector<arr> base_positions;
+  std::vector<double> reach;
+  std::vector<FrameL> robot_frames(n);
+  for (const auto &r : robots) {
+    rai::Frame *base = C.getFrame(STRING(r.prefix << "base"), false);
+    if (!base) {
+      spdlog::warn("No base frame found for robot {}, not pruning any pairs.",
+                   r.prefix);
+      uintA pairs;
+      pairs.reshape(-1, 2);
+      return pairs;
+    }
+    base_positions.push_back(base->getPosition());
+    reach.push_back(get_workspace_from_robot_type(r.type) + margin);
+  }
+
+  FrameL objs;
+  for (const auto f : C.frames) {
+    if (!f->shape || f->getShape().cont == 0) {
+      continue;
+    }
+
+    if (f->name.contains("obj")) {
+      objs.append(f);
+      continue;
+    }
+
+    for (uint i = 0; i < n; ++i) {
+      if (std::string(f->name.p).rfind(robots[i].prefix, 0) == 0) {
+        robot_frames[i].append(f);
+        break;
+      }
+    }
+  }
+
+  // two robots can only touch if their reach spheres overlap
+  std::vector<std::vector<bool>> overlap(n, std::vector<bool>(n, true));
+  for (uint i = 0; i < n; ++i) {
+    for (uint j = i + 1; j < n; ++j) {
+      const double dist = euclideanDistance(base_positions[i], base_positions[j]);
+      overlap[i][j] = dist <= reach[i] + reach[j];
+      overlap[j][i] = overlap[i][j];
+    }
+  }
+
+  uintA pairs;
+  for (uint i = 0; i < n; ++i) {
+    for (uint j = i + 1; j < n; ++j) {
+      if (overlap[i][j]) {
+        continue;
+      }
+      for (const auto a : robot_frames[i]) {
+        for (const auto b : robot_frames[j]) {
+          pairs.append(TUP(a->ID, b->ID));
+        }
+      }
+    }
+  }
+
+  for (const auto obj : objs) {
+    std::vector<arr> rest_positions{obj->getPosition()};
+
+    // obj1 -> goal1
+    const std::string obj_name(obj->name.p);
+    if (obj_name.rfind("obj", 0) == 0) {
+      rai::Frame *goal =
+          C.getFrame(("goal" + obj_name.substr(3)).c_str(), false);
+      if (goal) {
+        rest_positions.push_back(goal->getPosition());
+      }
+    }
+
+    // robots that can touch the object at rest can pick it up
+    std::vector<bool> can_hold(n, false);
+    std::vector<uint> open;
+    for (uint i = 0; i < n; ++i) {
+      for (const auto &p : rest_positions) {
+        if (euclideanDistance(p, base_positions[i]) <= reach[i]) {
+          can_hold[i] = true;
+          open.push_back(i);
+          break;
+        }
+      }
+    }
+
+    // and hand it over to all robots they overlap with
+    while (!open.empty()) {
+      const uint i = open.back();
+      open.pop_back();
+      for (uint j = 0; j < n; ++j) {
+        if (!can_hold[j] && overlap[i][j]) {
+          can_hold[j] = true;
+          open.push_back(j);
+        }
+      }
+    }
+
+    // a robot that can not hold the object can neither reach it at rest, nor
+    // overlap with a robot that holds it.
+    for (uint i = 0; i < n; ++i) {
+      if (can_hold[i]) {
+        continue;
+      }
+      for (const auto f : robot_frames[i]) {
+        pairs.append(TUP(obj->ID, f->ID));
+      }
+    }
+  }
+  pairs.reshape(-1, 2);
+
+  return pairs;
+}
+
 void setKomoToAnimation(KOMO &komo, const rai::Configuration &C,
                         const rai::Animation &A, const arr &ts, int k = -1) {
   CHECK_EQ(ts.d0, komo.timeSlices.d0 - komo.k_order, "wrong komo-size");
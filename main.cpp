@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <chrono>
 #include <random>
+#include <set>
 
 #include <math.h>
 
@@ -27,8 +28,6 @@
 #include <PlanningSubroutines/Animation.h>
 #include <PlanningSubroutines/ConfigurationProblem.h>
 
-// #include "stippling.h"
-
 #include "searchers/annealing_searcher.h"
 #include "searchers/greedy_random_searcher.h"
 #include "searchers/random_searcher.h"
@@ -41,7 +40,14 @@
 #include "planners/postprocessing.h"
 #include "planners/prioritized_planner.h"
 
+#include "samplers/keyframe_cache.h"
+
+#include "stippling.h"
+#include "samplers/keyframe_provider.h"
 #include "samplers/sampler.h"
+#include "samplers/reachability.h"
+#include "samplers/scene_generator.h"
+#include "samplers/seed_bank.h"
 
 #include "tests/benchmark.h"
 #include "tests/perf_test.h"
@@ -241,6 +247,16 @@ compute_keyframes(rai::Configuration &C, const std::vector<Robot> &robots,
                   const bool attempt_all_grasp_directions = false) {
   RobotTaskPoseMap robot_task_pose_mapping;
 
+  load_keyframe_seeds();
+
+  if (global_params.keyframe_cache_path != "") {
+    robot_task_pose_mapping = compute_keyframes_incrementally(
+        C, robots, global_params.keyframe_cache_path, use_picks, use_handovers,
+        use_repeated_picks, attempt_all_grasp_directions);
+    save_keyframe_seeds();
+    return robot_task_pose_mapping;
+  }
+
   if (use_picks) {
     RobotTaskPoseMap pick_rtpm = compute_all_pick_and_place_positions(
         C, robots, attempt_all_grasp_directions);
@@ -259,10 +275,18 @@ compute_keyframes(rai::Configuration &C, const std::vector<Robot> &robots,
                                    pick_pick_rtpm.end());
   }
 
+  save_keyframe_seeds();
+
   return robot_task_pose_mapping;
 }
 
-void export_keyframes() {}
+void export_keyframes(const RobotTaskPoseMap &rtpm, const std::string &path) {
+  const int res = system(
+      STRING("mkdir -p " << path.substr(0, path.find_last_of('/') + 1)).p);
+  (void)res;
+
+  save_json(keyframes_to_json(rtpm), path, global_params.compress_data);
+}
 
 void set_to_mode_for_primitive(rai::Configuration &C, RobotTaskPair rtp,
                                TaskPoses poses, const uint phase) {
@@ -273,7 +297,7 @@ void set_to_mode_for_primitive(rai::Configuration &C, RobotTaskPair rtp,
       // set all robots to their home-pose
       for (const auto &r : rtp.robots) {
         setActive(C, r);
-        C.setJointState(r.home_pose);
+        C.setJointState(r.home_pose.get());
       }
 
       if (i == 0) {
@@ -330,7 +354,7 @@ void set_to_mode_for_primitive(rai::Configuration &C, RobotTaskPair rtp,
       // set all robots to their home-pose
       for (const auto &r : rtp.robots) {
         setActive(C, r);
-        C.setJointState(r.home_pose);
+        C.setJointState(r.home_pose.get());
       }
 
       if (i == 0) {
@@ -415,7 +439,7 @@ bool check_scene_validity(rai::Configuration C,
       return false;
     }
 
-    const bool is_home_pose_valid = cp.query(r.home_pose, true)->isFeasible;
+    const bool is_home_pose_valid = cp.query(r.home_pose.get(), true)->isFeasible;
     if (!is_home_pose_valid) {
       spdlog::info("The homepose of robot {} seems to be invalid", r.prefix);
       return false;
@@ -522,6 +546,112 @@ int main(int argc, char **argv) {
       rai::getParameter<bool>("export_txt_files", false);
   global_params.export_txt_files = export_txt_files;
 
+  const rai::String trajectory_format =
+      rai::getParameter<rai::String>("trajectory_format", "json");
+  global_params.trajectory_format = std::string(trajectory_format.p);
+
+  const rai::String trajectory_quantization =
+      rai::getParameter<rai::String>("trajectory_quantization", "none");
+  global_params.trajectory_quantization =
+      std::string(trajectory_quantization.p);
+
+  const bool use_roadmap = rai::getParameter<bool>("use_roadmap", false);
+  global_params.use_roadmap = use_roadmap;
+
+  const uint roadmap_samples =
+      rai::getParameter<double>("roadmap_samples", 1000);
+  global_params.roadmap_samples = roadmap_samples;
+
+  const bool prune_out_of_reach_pairs =
+      rai::getParameter<bool>("prune_out_of_reach_pairs", true);
+  global_params.prune_out_of_reach_pairs = prune_out_of_reach_pairs;
+
+  const double out_of_reach_margin =
+      rai::getParameter<double>("out_of_reach_margin", 0.2);
+  global_params.out_of_reach_margin = out_of_reach_margin;
+
+  const bool use_temporal_bvh =
+      rai::getParameter<bool>("use_temporal_bvh", true);
+  global_params.use_temporal_bvh = use_temporal_bvh;
+
+  const bool incremental_animation =
+      rai::getParameter<bool>("incremental_animation", true);
+  global_params.incremental_animation = incremental_animation;
+
+  const bool use_static_sdf = rai::getParameter<bool>("use_static_sdf", false);
+  global_params.use_static_sdf = use_static_sdf;
+
+  const double sdf_resolution =
+      rai::getParameter<double>("sdf_resolution", 0.02);
+  global_params.sdf_resolution = sdf_resolution;
+
+  const rai::String sdf_cache_path =
+      rai::getParameter<rai::String>("sdf_cache_path", "./in/cache/");
+  global_params.sdf_cache_path = std::string(sdf_cache_path.p);
+
+  const bool batched_fk = rai::getParameter<bool>("batched_fk", true);
+  global_params.batched_fk = batched_fk;
+
+  const bool reoptimize_plans =
+      rai::getParameter<bool>("reoptimize_plans", false);
+  global_params.reoptimize_plans = reoptimize_plans;
+
+  const uint reoptimize_threads =
+      rai::getParameter<double>("reoptimize_threads", 0);
+  global_params.reoptimize_threads = reoptimize_threads;
+
+  const bool retime_plans = rai::getParameter<bool>("retime_plans", false);
+  global_params.retime_plans = retime_plans;
+
+  const bool prune_pick_pick_legs =
+      rai::getParameter<bool>("prune_pick_pick_legs", true);
+  global_params.prune_pick_pick_legs = prune_pick_pick_legs;
+
+  const uint keyframe_threads =
+      rai::getParameter<double>("keyframe_threads", 1);
+  global_params.keyframe_threads = keyframe_threads;
+
+  const bool deterministic_keyframes =
+      rai::getParameter<bool>("deterministic_keyframes", true);
+  global_params.deterministic_keyframes = deterministic_keyframes;
+
+  const bool use_seed_bank = rai::getParameter<bool>("use_seed_bank", false);
+  global_params.use_seed_bank = use_seed_bank;
+
+  const rai::String seed_bank_path = rai::getParameter<rai::String>(
+      "seed_bank_path", "./in/cache/seed_bank.json");
+  global_params.seed_bank_path = std::string(seed_bank_path.p);
+
+  const bool use_reachability_maps =
+      rai::getParameter<bool>("use_reachability_maps", true);
+  global_params.use_reachability_maps = use_reachability_maps;
+
+  const rai::String reachability_path = rai::getParameter<rai::String>(
+      "reachability_path", "./in/robots/reachability/");
+  global_params.reachability_path = std::string(reachability_path.p);
+
+  const bool lazy_keyframes = rai::getParameter<bool>("lazy_keyframes", false);
+  global_params.lazy_keyframes = lazy_keyframes;
+
+  const rai::String keyframe_cache_path =
+      rai::getParameter<rai::String>("keyframe_cache_path", "");
+  global_params.keyframe_cache_path = std::string(keyframe_cache_path.p);
+
+  const bool reuse_komo_templates =
+      rai::getParameter<bool>("reuse_komo_templates", true);
+  global_params.reuse_komo_templates = reuse_komo_templates;
+
+  const bool staged_keyframes =
+      rai::getParameter<bool>("staged_keyframes", false);
+  global_params.staged_keyframes = staged_keyframes;
+
+  const uint keyframe_refine_iters =
+      rai::getParameter<double>("keyframe_refine_iters", 50);
+  global_params.keyframe_refine_iters = keyframe_refine_iters;
+
+  const uint ik_threads = rai::getParameter<double>("ik_threads", 0);
+  global_params.ik_threads = ik_threads;
+
   switch (verbosity) {
   case 0:
     spdlog::set_level(spdlog::level::off);
@@ -597,6 +727,37 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  if (mode == "generate_scenes") {
+    // only the robots and the obstacles of the environment, the objects are
+    // generated
+    rai::Configuration C;
+    const auto robots =
+        make_robot_environment_from_config(C, robot_path.p, scene_path.p);
+    add_obstacles_from_config(C, obstacle_path.p);
+
+    SceneGeneratorSettings settings;
+    settings.num_objects = num_objects_for_env;
+    settings.num_obstacles = rai::getParameter<double>("obstacles", 0);
+
+    const uint num_scenes = rai::getParameter<double>("num_scenes", 100);
+    const uint num_threads = rai::getParameter<double>("scene_threads", 0);
+
+    const auto start_time = std::chrono::high_resolution_clock::now();
+
+    const SceneGenerator generator(C, robots, settings);
+    const uint cnt = generator.generate_batch(
+        num_scenes, seed, global_params.output_path + "scenes/", num_threads);
+
+    const auto end_time = std::chrono::high_resolution_clock::now();
+    const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              end_time - start_time)
+                              .count();
+    spdlog::info("Generated {} of {} scenes in {} ms", cnt, num_scenes,
+                 duration);
+
+    return 0;
+  }
+
   rai::Configuration C;
   std::vector<Robot> robots;
 
@@ -627,6 +788,41 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (global_params.use_static_sdf) {
+    const int res =
+        system(STRING("mkdir -p " << global_params.sdf_cache_path).p);
+    (void)res;
+
+    arr lo, hi;
+    get_workspace_bounds(C, robots, lo, hi);
+    StaticSceneSDF::instance().build(get_static_frames(C, robots), lo, hi,
+                                     global_params.sdf_resolution,
+                                     global_params.sdf_cache_path);
+  }
+
+  if (mode == "build_reachability_maps") {
+    const uint num_samples =
+        rai::getParameter<double>("reachability_samples", 1000000);
+    const int res =
+        system(STRING("mkdir -p " << global_params.reachability_path).p);
+    (void)res;
+
+    // one map per robot and end effector type
+    std::set<std::string> built;
+    for (const auto &r : robots) {
+      const std::string path = ReachabilityMapRegistry::get_filename(r);
+      if (built.count(path) > 0) {
+        continue;
+      }
+      built.insert(path);
+
+      ReachabilityMap map;
+      map.build(C, r, num_samples);
+      map.save(path, r);
+    }
+    return 0;
+  }
+
   if (mode == "show_env") {
     C.watch(true);
     return 0;
@@ -636,7 +832,7 @@ int main(int argc, char **argv) {
     C.watch(true);
     for (const auto &r : robots) {
       setActive(C, r);
-      auto q = r.home_pose;
+      arr q = r.home_pose.get();
       C.setJointState(q);
     }
     C.watch(true);
@@ -708,7 +904,8 @@ int main(int argc, char **argv) {
     std::stringstream buffer;
     buffer << "repeated_pick_test_" << std::put_time(&tm, "%Y%m%d_%H%M%S");
 
-    export_plan(C, robots, home_poses, plan.plan,
+    export_plan(C, robots, home_poses,
+                postprocess_plan(C, plan.plan, home_poses),
                 test_sequence_for_repeated_manip, buffer.str(), 0, 0);
 
     if (global_params.export_images) {
@@ -745,8 +942,9 @@ int main(int argc, char **argv) {
     std::stringstream buffer;
     buffer << "handover_test_" << std::put_time(&tm, "%Y%m%d_%H%M%S");
 
-    export_plan(C, robots, home_poses, plan.plan, test_sequence_for_handover,
-                buffer.str(), 0, 0);
+    export_plan(C, robots, home_poses,
+                postprocess_plan(C, plan.plan, home_poses),
+                test_sequence_for_handover, buffer.str(), 0, 0);
 
     return 0;
   }
@@ -793,8 +991,9 @@ int main(int argc, char **argv) {
               .count();
 
       if (plan.status == PlanStatus::success) {
-        export_plan(C, robots, home_poses, plan.plan, seq, buffer.str(),
-                    seq_num, duration);
+        export_plan(C, robots, home_poses,
+                    postprocess_plan(C, plan.plan, home_poses), seq,
+                    buffer.str(), seq_num, duration);
 
         if (global_params.export_images) {
           const std::string image_path = global_params.output_path +
@@ -820,12 +1019,40 @@ int main(int argc, char **argv) {
                           use_repeated_picks, attempt_all_grasp_directions);
     spdlog::info("{} poses computed.", robot_task_pose_mapping.size());
 
-    // TODO: export?
+    export_keyframes(robot_task_pose_mapping,
+                     global_params.output_path + "keyframes.json");
     export_scene_at_keyframes(C, robots, robot_task_pose_mapping);
 
     return 0;
   }
 
+  if (mode == "compute_stippling_poses") {
+    const arr pts = get_stippling_scenario(stippling_scenario);
+    if (pts.N == 0) {
+      spdlog::error("Unknown stippling scenario {}", stippling_scenario.p);
+      return 0;
+    }
+
+    const RobotTaskPoseMap robot_task_pose_mapping =
+        compute_stippling_poses_for_arms(C, pts, robots);
+
+    for (const auto &entry : robot_task_pose_mapping) {
+      uint cnt = 0;
+      for (const auto &poses : entry.second) {
+        if (poses.size() > 0) {
+          ++cnt;
+        }
+      }
+      spdlog::info("{}: {} of {} points reachable", entry.first.robots[0].prefix,
+                   cnt, pts.d0);
+    }
+
+    export_keyframes(robot_task_pose_mapping,
+                     global_params.output_path + "stippling_poses.json");
+
+    return 0;
+  }
+
   if (mode == "generate_candidate_sequences") {
     // make foldername for current run
     std::time_t t = std::time(nullptr);
@@ -882,6 +1109,25 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  // random search can compute the keyframes when a sequence needs them
+  if (mode == "random_search" && global_params.lazy_keyframes) {
+    if (global_params.use_roadmap) {
+      spdlog::info("Building roadmaps");
+      RoadmapRegistry::instance().build(C, robots, {}, home_poses,
+                                        global_params.roadmap_samples);
+    }
+
+    load_keyframe_seeds();
+    KeyframeProvider provider(C, robots, use_picks, use_handovers,
+                              use_repeated_picks,
+                              attempt_all_grasp_directions);
+    const auto plan = plan_multiple_arms_random_search(
+        C, provider, home_poses, max_attempts, avoid_repeated_evaluations);
+    save_keyframe_seeds();
+
+    return 0;
+  }
+
   spdlog::info("Computing pick and place poses");
 
   // merge both maps
@@ -890,6 +1136,13 @@ int main(int argc, char **argv) {
                         attempt_all_grasp_directions);
   spdlog::info("{} poses computed.", robot_task_pose_mapping.size());
 
+  if (global_params.use_roadmap) {
+    spdlog::info("Building roadmaps");
+    RoadmapRegistry::instance().build(C, robots, robot_task_pose_mapping,
+                                      home_poses,
+                                      global_params.roadmap_samples);
+  }
+
   // initial test
   if (mode == "test") {
     const auto plan = plan_multiple_arms_unsynchronized(
@@ -909,9 +1162,10 @@ int main(int argc, char **argv) {
   } else if (mode == "optimization_benchmark") {
   } else if (mode == "random_search") {
     // random search
+    KeyframeProvider provider(C, robots);
+    provider.set_precomputed(robot_task_pose_mapping);
     const auto plan = plan_multiple_arms_random_search(
-        C, robot_task_pose_mapping, home_poses, max_attempts,
-        avoid_repeated_evaluations);
+        C, provider, home_poses, max_attempts, avoid_repeated_evaluations);
   } else if (mode == "greedy_random_search") {
     // greedy random search
     const auto plan = plan_multiple_arms_greedy_random_search(
@@ -6,7 +6,8 @@ from datetime import datetime
 def get_cmd_str_to_generate_sequences(relative_path_to_robot_file,
                                       relative_path_to_obj_file,
                                       output_path,
-                                      r_seed):
+                                      r_seed,
+                                      keyframe_cache_path=None):
     cmd_str = "echo $PWD && cd /home/tapas/multi-agent-tamp-solver/24-data-gen/ && echo $PWD && "
     cmd_str += "xvfb-run -a --server-args=\"-screen 0 480x480x24\" "
     cmd_str += "./x.exe -pnp true -mode generate_candidate_sequences -seed " + str(r_seed) + " "
@@ -17,13 +18,16 @@ def get_cmd_str_to_generate_sequences(relative_path_to_robot_file,
     cmd_str += "-scene_path 'in/scenes/floor.g' "
     # cmd_str += "-obstacle_path 'in/obstacles/shelf.json' "
     cmd_str += "-output_path " + output_path + " "
+    if keyframe_cache_path is not None:
+        cmd_str += "-keyframe_cache_path " + keyframe_cache_path + " "
     return cmd_str
 
 def get_cmd_str_to_plan_for_sequence(relative_path_to_robot_file,
                                      relative_path_to_obj_file,
                                      relative_path_to_seq_file,
                                      output_path,
-                                     r_seed):
+                                     r_seed,
+                                     keyframe_cache_path=None):
     cmd_str = "echo $PWD && cd /home/tapas/multi-agent-tamp-solver/24-data-gen/ && echo $PWD && "
     cmd_str += "xvfb-run -a --server-args=\"-screen 0 480x480x24\" "
     cmd_str += "./x.exe -pnp true -mode plan_for_sequence -seed " + str(r_seed) + " "
@@ -35,6 +39,8 @@ def get_cmd_str_to_plan_for_sequence(relative_path_to_robot_file,
     # cmd_str += "-obstacle_path 'in/obstacles/shelf.json' "
     cmd_str += "-sequence_path " + relative_path_to_seq_file + " "
     cmd_str += "-output_path " + output_path + " "
+    if keyframe_cache_path is not None:
+        cmd_str += "-keyframe_cache_path " + keyframe_cache_path + " "
     return cmd_str
 
 def latest_sequences(folder_path):
@@ -57,6 +63,10 @@ path_to_input_files = "replan_data/replan_ini_conveyor_5_20250225_201416/"
 with open(f"{path_to_input_files}part_hold_info_conveyor_5.json", "r") as file:
     part_hold_info = json.load(file)
 
+# shared by all hold steps, only the keyframes affected by the changes
+# between two steps are recomputed
+keyframe_cache_path = path_to_input_files + "keyframes.json"
+
 for i in range(len(part_hold_info)):
     subdir = part_hold_info[i]["hold_step"]
     path_to_robot_file =  path_to_input_files + f"{subdir}"+"/" + ROB_NAME + ".json" 
@@ -71,7 +81,8 @@ for i in range(len(part_hold_info)):
     cmd_str = get_cmd_str_to_generate_sequences(path_to_robot_file,
                                                 path_to_obj_file,
                                                 output_path,
-                                                r_seed)
+                                                r_seed,
+                                                keyframe_cache_path)
     exec_cmd(cmd_str)
 
     # plan for sequences
@@ -84,5 +95,6 @@ for i in range(len(part_hold_info)):
                                                         path_to_obj_file, 
                                                         relative_path_to_seq_file, 
                                                         output_path,
-                                                        r_seed)
+                                                        r_seed,
+                                                        keyframe_cache_path)
     exec_cmd(cmd_str)
@@ -3,14 +3,18 @@
 #include "spdlog/spdlog.h"
 
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "json/json.h"
 
 #include <Core/array.h>
 
+#include "common/binary_trajectory.h"
 #include "common/config.h"
+#include "common/shared_handle.h"
 #include "common/env_util.h"
+#include "common/json_stream.h"
 #include "common/types.h"
 #include "common/util.h"
 
@@ -131,7 +135,8 @@ struct TaskPart {
       : has_solution(true), t(_t), path(_path){};
   TaskPart(){};
 
-  rai::Animation::AnimationPart anim;
+  // shared between copies of the plan, see make_animation_part
+  AnimationPartPtr anim;
 
   arr t;
   arr path;
@@ -152,12 +157,17 @@ struct TaskPart {
 
 typedef std::unordered_map<Robot, std::vector<TaskPart>> Plan;
 
+// shared handles that are passed through the planning/search api instead of
+// copying configurations and plans, see common/shared_handle.h
+typedef SharedHandle<rai::Configuration> ConfigurationHandle;
+typedef SharedHandle<Plan> PlanHandle;
+
 json get_plan_as_json(const Plan &plan) {
   json data;
 
   for (const auto &per_robot_plan : plan) {
     const auto robot = per_robot_plan.first;
-    const auto tasks = per_robot_plan.second;
+    const auto &tasks = per_robot_plan.second;
 
     json tmp;
     tmp["robot"] = robot.prefix;
@@ -184,17 +194,17 @@ enum class PlanStatus { failed, aborted, success, unplanned };
 struct PlanResult {
   PlanResult() : status(PlanStatus::unplanned) {}
   PlanResult(PlanStatus _status) : status(_status){};
-  PlanResult(PlanStatus _status, const Plan &_plan)
+  PlanResult(PlanStatus _status, const PlanHandle &_plan)
       : status(_status), plan(_plan){};
 
   PlanStatus status;
-  Plan plan;
+  PlanHandle plan;
 };
 
 double get_makespan_from_plan(const Plan &plan) {
   double max_time = 0.;
   for (const auto &robot_plan : plan) {
-    const auto last_subpath = robot_plan.second.back();
+    const auto &last_subpath = robot_plan.second.back();
     max_time = std::max({last_subpath.t(-1), max_time});
   }
 
@@ -205,7 +215,9 @@ rai::Animation make_animation_from_plan(const Plan &plan) {
   rai::Animation A;
   for (const auto &p : plan) {
     for (const auto &path : p.second) {
-      A.A.append(path.anim);
+      if (path.anim) {
+        A.A.append(*path.anim);
+      }
     }
   }
 
@@ -216,7 +228,7 @@ arr get_robot_pose_at_time(const uint t, const Robot &r,
                            const std::unordered_map<Robot, arr> &home_poses,
                            const Plan &plan) {
   if (plan.count(r) == 0){
-    return r.start_pose;
+    return r.start_pose.get();
   }
   
   if (plan.count(r) > 0) {
@@ -227,7 +239,7 @@ arr get_robot_pose_at_time(const uint t, const Robot &r,
       }
     }
     if (all_plans_start_after_t){
-      return r.start_pose;
+      return r.start_pose.get();
     }
 
     for (const auto &part : plan.at(r)) {
@@ -264,9 +276,150 @@ std::string get_action_at_time_for_robot(const Plan &plan, const Robot &r,
   return "none";
 }
 
+// computes the poses of the frames for the time steps [0, num_steps) of the
+// plan at once with batched forward kinematics. The joint states of all robots
+// are assembled over time in the same way as set_configuration_to_time_step
+// sets them, and the objects are then overwritten with their poses from the
+// animations. covered(t) is false for the steps where no robot has a part.
+// Returns false if this is not possible (e.g. a frame is attached to an
+// object). Changes the active joints and state of the configuration.
+bool compute_plan_frame_poses(rai::Configuration &C, const Plan &plan,
+                              const uint num_steps, const FrameL &frames,
+                              arr &X, boolA &covered) {
+  std::unordered_map<std::string, uint> obj_index;
+  for (uint i = 0; i < frames.N; ++i) {
+    if (frames(i)->name.contains("obj")) {
+      obj_index[frames(i)->name.p] = i;
+    }
+    for (auto f = frames(i)->parent; f; f = f->parent) {
+      if (f->name.contains("obj")) {
+        // would move with the object, which we only know the pose of
+        return false;
+      }
+    }
+  }
+
+  // position of the dofs of each robot in the joint state of all robots
+  std::vector<Robot> robots;
+  std::unordered_map<Robot, std::vector<std::tuple<uint, uint, uint>>> joints;
+  for (const auto &tp : plan) {
+    const Robot &r = tp.first;
+    robots.push_back(r);
+    setActive(C, r);
+    for (const auto j : C.activeJoints) {
+      joints[r].push_back({j->frame->ID, j->qIndex, j->dim});
+    }
+  }
+
+  setActive(C, robots);
+  std::unordered_map<uint, uint> q_index;
+  for (const auto j : C.activeJoints) {
+    q_index[j->frame->ID] = j->qIndex;
+  }
+
+  std::unordered_map<Robot, uintA> robot_dofs;
+  for (const auto &r : robots) {
+    uintA &dofs = robot_dofs[r];
+    for (const auto &j : joints[r]) {
+      for (uint d = 0; d < std::get<2>(j); ++d) {
+        dofs.append(q_index[std::get<0>(j)] + d);
+      }
+    }
+  }
+
+  arr q = C.getJointState();
+  arr path(num_steps, q.N);
+  covered = boolA(num_steps);
+  covered = false;
+
+  std::unordered_map<std::string, arr> obj_poses;
+  std::vector<std::unordered_map<uint, arr>> obj_overrides(num_steps);
+
+  for (uint t = 0; t < num_steps; ++t) {
+    for (const auto &tp : plan) {
+      const uintA &dofs = robot_dofs[tp.first];
+      for (const auto &part : tp.second) {
+        if (part.t(0) > t || part.t(-1) < t) {
+          continue;
+        }
+
+        bool done = false;
+        for (uint i = 0; i < part.t.N; ++i) {
+          if ((i == part.t.N - 1 && t == part.t(-1)) ||
+              (i < part.t.N - 1 && (part.t(i) <= t && part.t(i + 1) > t))) {
+            if (part.path.d1 != dofs.N) {
+              return false;
+            }
+            for (uint k = 0; k < dofs.N; ++k) {
+              q(dofs(k)) = part.path(i, k);
+            }
+            done = true;
+
+            const auto obj_name = STRING("obj" << part.task_index + 1);
+            if (part.anim && part.anim->frameNames.contains(obj_name)) {
+              const auto pose =
+                  part.anim->X[uint(std::floor(t - part.anim->start))];
+              // the obj is always the last part of the pose
+              obj_poses[std::string(obj_name.p)] = pose[-1];
+            }
+            break;
+          }
+        }
+
+        if (done) {
+          covered(t) = true;
+          break;
+        }
+      }
+    }
+
+    path[t] = q;
+    for (const auto &obj_pose : obj_poses) {
+      const auto it = obj_index.find(obj_pose.first);
+      if (it != obj_index.end()) {
+        obj_overrides[t][it->second] = obj_pose.second;
+      }
+    }
+  }
+
+  if (!batched_fk_cache.compute(C, frames, path, X)) {
+    return false;
+  }
+
+  for (uint t = 0; t < num_steps; ++t) {
+    for (const auto &o : obj_overrides[t]) {
+      for (uint k = 0; k < 7; ++k) {
+        X(t, o.first, k) = o.second(k);
+      }
+    }
+  }
+
+  return true;
+}
+
 arr get_frame_trajectories(rai::Configuration &C, const Plan &plan){
   const double makespan = get_makespan_from_plan(plan);
 
+  if (global_params.batched_fk) {
+    arr framePath;
+    boolA covered;
+    if (compute_plan_frame_poses(C, plan, makespan, C.frames, framePath,
+                                 covered)) {
+      // the steps without any robot are left empty, as below
+      for (uint t = 0; t < covered.N; ++t) {
+        if (covered(t)) {
+          continue;
+        }
+        for (uint i = 0; i < framePath.d1; ++i) {
+          for (uint k = 0; k < 7; ++k) {
+            framePath(t, i, k) = 0.;
+          }
+        }
+      }
+      return framePath;
+    }
+  }
+
   arr framePath(makespan, C.frames.N, 7);
   // we can not simly use the animations that are in the path
   // since they do not contain all the frames.
@@ -279,7 +432,7 @@ arr get_frame_trajectories(rai::Configuration &C, const Plan &plan){
     // A.setToTime(C, t); // this does not work at all
     for (const auto &tp : plan) {
       const auto r = tp.first;
-      const auto parts = tp.second;
+      const auto &parts = tp.second;
       bool done = false;
       for (const auto &part : parts) {
         // std::cout <<part.t(0) << " " << part.t(-1) << std::endl;
@@ -296,9 +449,9 @@ arr get_frame_trajectories(rai::Configuration &C, const Plan &plan){
             // set bin picking things
             const auto task_index = part.task_index;
             const auto obj_name = STRING("obj" << task_index + 1);
-            if (part.anim.frameNames.contains(obj_name)) {
+            if (part.anim && part.anim->frameNames.contains(obj_name)) {
               const auto pose =
-                  part.anim.X[uint(std::floor(t - part.anim.start))];
+                  part.anim->X[uint(std::floor(t - part.anim->start))];
               arr tmp(1, 7);
               tmp[0] = pose[-1]; // the obj is always the last part of the pose
               C.setFrameState(tmp, {C[obj_name]});
@@ -321,59 +474,127 @@ arr get_frame_trajectories(rai::Configuration &C, const Plan &plan){
   return framePath;
 }
 
+// applies a single time step of the plan to the configuration.
+// obj_poses keeps track of the objects that were moved so far, and has to be
+// carried over from one step to the next.
+void set_configuration_to_time_step(
+    rai::Configuration &C, const Plan &plan, const uint t,
+    std::unordered_map<std::string, arr> &obj_poses) {
+  // set it to the pose in which the plan thinks it should be
+  // A.setToTime(C, t); // this does not work at all
+
+  for (const auto &tp : plan) {
+    const auto r = tp.first;
+    const auto &parts = tp.second;
+
+    bool done = false;
+    for (const auto &part : parts) {
+      // std::cout <<part.t(0) << " " << part.t(-1) << std::endl;
+      if (part.t(0) > t || part.t(-1) < t) {
+        continue;
+      }
+
+      for (uint i = 0; i < part.t.N; ++i) {
+        if ((i == part.t.N - 1 && t == part.t(-1)) ||
+            (i < part.t.N - 1 && (part.t(i) <= t && part.t(i + 1) > t))) {
+          setActive(C, r);
+          C.setJointState(part.path[i]);
+          // std::cout <<part.path[i] << std::endl;
+          done = true;
+
+          // set bin picking things
+          const auto task_index = part.task_index;
+          const auto obj_name = STRING("obj" << task_index + 1);
+
+          if (part.anim && part.anim->frameNames.contains(obj_name)) {
+            const auto pose =
+                part.anim->X[uint(std::floor(t - part.anim->start))];
+            arr tmp(1, 7);
+            tmp[0] = pose[-1]; // the obj is always the last part of the pose
+            C.setFrameState(tmp, {C[obj_name]});
+
+            obj_poses[std::string(obj_name.p)] = tmp;
+          }
+          break;
+        }
+      }
+
+      if (done) {
+        for (const auto &obj_pose: obj_poses){
+          C.setFrameState(obj_pose.second, {C[STRING(obj_pose.first)]});
+        }
+        // framePath[t] = C.getFrameState();
+        break;
+      }
+    }
+  }
+}
+
 void set_full_configuration_to_time(rai::Configuration &C, const Plan &plan,
                                     const uint time) {
   std::unordered_map<std::string, arr> obj_poses;
   for (uint t = 0; t <= time; ++t) {
-    // set it to the pose in which the plan thinks it should be
-    // A.setToTime(C, t); // this does not work at all
+    set_configuration_to_time_step(C, plan, t, obj_poses);
+  }
+}
 
-    for (const auto &tp : plan) {
-      const auto r = tp.first;
-      const auto parts = tp.second;
+// Steps through a plan one time step at a time on its own copy of the
+// configuration. Produces the same states as calling
+// set_full_configuration_to_time for t = 0, 1, 2, ... on the same
+// configuration, but is linear instead of quadratic in the plan length.
+class PlanPlayback {
+public:
+  PlanPlayback(const rai::Configuration &_C, const Plan &_plan)
+      : C(_C), plan(_plan){};
+
+  // advances the configuration to the next time step, starting at t=0
+  void step() {
+    set_configuration_to_time_step(C, plan, t, obj_poses);
+    ++t;
+  }
 
-      bool done = false;
-      for (const auto &part : parts) {
-        // std::cout <<part.t(0) << " " << part.t(-1) << std::endl;
-        if (part.t(0) > t || part.t(-1) < t) {
-          continue;
-        }
+  arr get_pose(const rai::String &name) { return C[name]->getPose(); }
 
-        for (uint i = 0; i < part.t.N; ++i) {
-          if ((i == part.t.N - 1 && t == part.t(-1)) ||
-              (i < part.t.N - 1 && (part.t(i) <= t && part.t(i + 1) > t))) {
-            setActive(C, r);
-            C.setJointState(part.path[i]);
-            // std::cout <<part.path[i] << std::endl;
-            done = true;
+private:
+  rai::Configuration C;
+  const Plan &plan;
 
-            // set bin picking things
-            const auto task_index = part.task_index;
-            const auto obj_name = STRING("obj" << task_index + 1);
+  uint t = 0;
+  std::unordered_map<std::string, arr> obj_poses;
+};
 
-            if (part.anim.frameNames.contains(obj_name)) {
-              const auto pose =
-                  part.anim.X[uint(std::floor(t - part.anim.start))];
-              arr tmp(1, 7);
-              tmp[0] = pose[-1]; // the obj is always the last part of the pose
-              C.setFrameState(tmp, {C[obj_name]});
+// poses of the named frames at the time steps [0, num_steps) of the plan, as
+// (num_steps x frames x 7). Uses batched fk where possible, and a single
+// playback of the plan otherwise.
+arr get_frame_poses_over_plan(const rai::Configuration &C, const Plan &plan,
+                              const uint num_steps,
+                              const std::vector<rai::String> &names) {
+  if (global_params.batched_fk) {
+    rai::Configuration Ccpy(C);
+    FrameL frames;
+    for (const auto &name : names) {
+      frames.append(Ccpy[name]);
+    }
 
-              obj_poses[std::string(obj_name.p)] = tmp;
-            }
-            break;
-          }
-        }
+    arr X;
+    boolA covered;
+    if (compute_plan_frame_poses(Ccpy, plan, num_steps, frames, X, covered)) {
+      return X;
+    }
+  }
 
-        if (done) {
-          for (const auto &obj_pose: obj_poses){
-            C.setFrameState(obj_pose.second, {C[STRING(obj_pose.first)]});
-          }
-          // framePath[t] = C.getFrameState();
-          break;
-        }
+  arr X(num_steps, names.size(), 7);
+  PlanPlayback playback(C, plan);
+  for (uint t = 0; t < num_steps; ++t) {
+    playback.step();
+    for (uint i = 0; i < names.size(); ++i) {
+      const arr pose = playback.get_pose(names[i]);
+      for (uint k = 0; k < 7; ++k) {
+        X(t, i, k) = pose(k);
       }
     }
   }
+  return X;
 }
 
 arr get_frame_pose_at_time(const rai::String &name, const Plan &plan,
@@ -416,7 +637,10 @@ std::vector<arr> get_frame_trajectory(const rai::String &name, const Plan &plan,
   return poses;
 }
 
-json make_scene_data(rai::Configuration C, const std::vector<Robot> &robots) {
+json make_scene_data(const ConfigurationHandle &C_handle,
+                     const std::vector<Robot> &robots) {
+  // we sort the frames and change the active joints below
+  rai::Configuration C = C_handle.get();
   C.sortFrames();
   
   json data;
@@ -475,7 +699,7 @@ json make_scene_data(rai::Configuration C, const std::vector<Robot> &robots) {
 
     setActive(C, r);
     robot_data["initial_pose"] = C.getJointState();
-    robot_data["home_pose"] = r.home_pose;
+    robot_data["home_pose"] = r.home_pose.get();
     robot_data["type"] = r.type;
     robot_data["end_effector_type"] = r.ee_type;
 
@@ -570,7 +794,174 @@ void save_json(const json &data, const std::string &file_path,
   }
 }
 
-void export_plan(rai::Configuration C, const std::vector<Robot> &robots,
+// writes trajectory.json step by step without building the whole document.
+// The output is identical to the json tree we used to assemble here.
+void save_trajectory_json(const std::string &file_path, const bool compressed,
+                          const uint num_steps, const rai::Configuration &C,
+                          const std::vector<Robot> &robots,
+                          const std::vector<rai::String> &obj_names,
+                          const std::unordered_map<Robot, arr> &home_poses,
+                          const Plan &plan) {
+  spdlog::trace("Streaming trajectory to {}", file_path);
+
+  std::ofstream f;
+  if (compressed) {
+    f.open(file_path, std::ios::out | std::ios::binary);
+  } else {
+    f.open(file_path, std::ios_base::trunc);
+  }
+
+  // all poses that are written below, from a single pass over the plan. This
+  // is small compared to the json document itself.
+  std::vector<rai::String> frame_names;
+  for (const auto &r : robots) {
+    frame_names.push_back(STRING("" << r.prefix << r.ee_frame_name));
+  }
+  frame_names.insert(frame_names.end(), obj_names.begin(), obj_names.end());
+  const arr frame_poses =
+      get_frame_poses_over_plan(C, plan, num_steps, frame_names);
+
+  JsonStreamWriter writer(f, compressed);
+  writer.begin_object(2);
+
+  writer.key("robots");
+  if (robots.empty()) {
+    writer.value(json());
+  } else {
+    writer.begin_array(robots.size());
+    for (uint i = 0; i < robots.size(); ++i) {
+      const Robot &r = robots[i];
+      writer.begin_object(num_steps > 0 ? 4 : 3);
+      writer.key("name");
+      writer.value(r.prefix);
+      writer.key("type");
+      writer.value(robot_type_to_string(r.type));
+      writer.key("ee_type");
+      writer.value(ee_type_to_string(r.ee_type));
+
+      if (num_steps > 0) {
+        writer.key("steps");
+        writer.begin_array(num_steps);
+
+        for (uint t = 0; t < num_steps; ++t) {
+          spdlog::trace("exporting traj step {}", t);
+
+          json step_data;
+
+          const arr pose = get_robot_pose_at_time(t, r, home_poses, plan)();
+          step_data["joint_state"] = pose;
+
+          const arr ee_pose = frame_poses[t][i];
+          step_data["ee_pos"] = ee_pose({0, 2});
+          step_data["ee_quat"] = ee_pose({3, 6});
+
+          // TODO: export action parameters
+          const std::string current_action =
+              get_action_at_time_for_robot(plan, r, t);
+          step_data["action"] = current_action;
+
+          writer.value(step_data);
+        }
+
+        writer.end_array();
+      }
+
+      writer.end_object();
+    }
+    writer.end_array();
+  }
+
+  writer.key("objs");
+  if (obj_names.empty()) {
+    writer.value(json());
+  } else {
+    writer.begin_array(obj_names.size());
+    for (uint i = 0; i < obj_names.size(); ++i) {
+      const rai::String &obj = obj_names[i];
+      writer.begin_object(num_steps > 0 ? 2 : 1);
+      writer.key("name");
+      writer.value(obj);
+
+      if (num_steps > 0) {
+        writer.key("steps");
+        writer.begin_array(num_steps);
+
+        for (uint t = 0; t < num_steps; ++t) {
+          const arr pose = frame_poses[t][robots.size() + i];
+
+          json step_data;
+          step_data["pos"] = pose({0, 2});
+          step_data["quat"] = pose({3, 6});
+          writer.value(step_data);
+        }
+
+        writer.end_array();
+      }
+
+      writer.end_object();
+    }
+    writer.end_array();
+  }
+
+  writer.end_object();
+  f.close();
+}
+
+void save_trajectory_binary(const std::string &file_path,
+                            const uint num_steps, const rai::Configuration &C,
+                            const std::vector<Robot> &robots,
+                            const std::vector<rai::String> &obj_names,
+                            const std::unordered_map<Robot, arr> &home_poses,
+                            const Plan &plan) {
+  BinaryTrajectoryWriter writer(
+      num_steps, string_to_quantization(global_params.trajectory_quantization));
+
+  // ee frames of the robots first, then the objects
+  std::vector<rai::String> frame_names;
+  std::vector<arr> joint_states;
+  std::vector<arr> ee_poses;
+  std::vector<std::vector<std::string>> actions(robots.size());
+  for (const auto &r : robots) {
+    frame_names.push_back(STRING("" << r.prefix << r.ee_frame_name));
+    joint_states.push_back(zeros(num_steps, home_poses.at(r).N));
+    ee_poses.push_back(zeros(num_steps, 7));
+  }
+  frame_names.insert(frame_names.end(), obj_names.begin(), obj_names.end());
+
+  std::vector<arr> obj_poses(obj_names.size(), zeros(num_steps, 7));
+
+  // the whole trajectory ends up in the columns anyways, so a single pass
+  // over the plan is enough here.
+  const arr frame_poses =
+      get_frame_poses_over_plan(C, plan, num_steps, frame_names);
+  for (uint t = 0; t < num_steps; ++t) {
+    for (uint i = 0; i < robots.size(); ++i) {
+      joint_states[i][t] =
+          get_robot_pose_at_time(t, robots[i], home_poses, plan);
+      ee_poses[i][t] = frame_poses[t][i];
+      actions[i].push_back(get_action_at_time_for_robot(plan, robots[i], t));
+    }
+
+    for (uint i = 0; i < obj_names.size(); ++i) {
+      obj_poses[i][t] = frame_poses[t][robots.size() + i];
+    }
+  }
+
+  for (uint i = 0; i < robots.size(); ++i) {
+    writer.add_column(robots[i].prefix + "/joint_state", joint_states[i]);
+    writer.add_column(robots[i].prefix + "/ee_pose", ee_poses[i]);
+    writer.add_action_column(robots[i].prefix + "/action", actions[i]);
+  }
+
+  for (uint i = 0; i < obj_names.size(); ++i) {
+    writer.add_column(std::string(obj_names[i].p) + "/pose", obj_poses[i]);
+  }
+
+  writer.write(file_path);
+}
+
+void export_plan(const ConfigurationHandle &C,
+                 const std::vector<Robot> &robots,
                  const std::unordered_map<Robot, arr> &home_poses,
                  const Plan &plan, const OrderedTaskSequence &seq,
                  const std::string base_folder, const uint iteration,
@@ -632,7 +1023,7 @@ void export_plan(rai::Configuration C, const std::vector<Robot> &robots,
 
     for (const auto &per_robot_plan : plan) {
       const auto robot = per_robot_plan.first;
-      const auto tasks = per_robot_plan.second;
+      const auto &tasks = per_robot_plan.second;
 
       f << robot << ": ";
       for (const auto &task : tasks) {
@@ -655,7 +1046,7 @@ void export_plan(rai::Configuration C, const std::vector<Robot> &robots,
     f.open(folder + "computation_times.txt", std::ios_base::trunc);
     for (const auto &per_robot_plan : plan) {
       const auto robot = per_robot_plan.first;
-      const auto tasks = per_robot_plan.second;
+      const auto &tasks = per_robot_plan.second;
 
       f << robot << ": ";
       for (const auto &task : tasks) {
@@ -691,93 +1082,21 @@ void export_plan(rai::Configuration C, const std::vector<Robot> &robots,
   }
 
   {
-    std::vector<rai::String> frame_names;
-    for (uint j = 0; j < robots.size(); ++j) {
-      const rai::String ee_frame_name =
-          STRING("" << robots[j].prefix << robots[j].ee_frame_name);
-      frame_names.push_back(ee_frame_name);
-    }
-
     std::vector<rai::String> obj_names;
-    for (const auto frame : C.frames) {
+    for (const auto frame : C->frames) {
       if (frame->name.contains("obj")) {
-        frame_names.push_back(frame->name);
         obj_names.push_back(frame->name);
       }
     }
 
-    std::unordered_map<std::string, std::vector<arr>> frame_poses;
-
-    const double makespan = get_makespan_from_plan(plan);
-    // TODO: this is the slow part for the export
-    for (uint t = 0; t < A.getT(); ++t) {
-      const auto poses = get_frame_pose_at_time(frame_names, plan, C, t);
-      for (const auto &name_pose : poses) {
-        frame_poses[name_pose.first].push_back(name_pose.second);
-      }
+    if (global_params.trajectory_format == "binary") {
+      save_trajectory_binary(folder + "trajectory.bin", A.getT(), C.get(),
+                             robots, obj_names, home_poses, plan);
+    } else {
+      save_trajectory_json(folder + "trajectory.json", write_compressed_json,
+                           A.getT(), C.get(), robots, obj_names, home_poses,
+                           plan);
     }
-
-    json all_robot_data;
-    // arr path(A.getT(), home_poses.at(robots[0]).d0 * robots.size());
-    for (const auto &r : robots) {
-      json robot_data;
-      robot_data["name"] = r.prefix;
-      robot_data["type"] = robot_type_to_string(r.type);
-      robot_data["ee_type"] = ee_type_to_string(r.ee_type);
-
-      for (uint t = 0; t < A.getT(); ++t) {
-        spdlog::trace("exporting traj step {}", t);
-        json step_data;
-
-        spdlog::trace("pose at time {}", t);
-        const arr pose = get_robot_pose_at_time(t, r, home_poses, plan)();
-        step_data["joint_state"] = pose;
-
-        spdlog::trace("ee at time {}", t);
-        const rai::String ee_frame_name = STRING("" << r.prefix << r.ee_frame_name);
-        const arr ee_pose = frame_poses[ee_frame_name.p][t]();
-        step_data["ee_pos"] = ee_pose({0, 2});
-        step_data["ee_quat"] = ee_pose({3, 6});
-
-        // TODO: export action parameters
-        spdlog::trace("action at time {}", t);
-        const std::string current_action =
-            get_action_at_time_for_robot(plan, r, t);
-        // const std::string current_primitive =
-        // get_primitive_at_time_for_robot(plan, robots[j], i); const
-        // std::string current_primitive = primitive_type_to_string(primitve);
-        // const std::string current_primitive = "pick";
-
-        step_data["action"] = current_action;
-        // step_data["primitive"] = current_action;
-
-        robot_data["steps"].push_back(step_data);
-      }
-
-      all_robot_data.push_back(robot_data);
-    }
-
-    // all objs
-    json all_obj_data;
-    for (const auto &obj : obj_names) {
-      json obj_data;
-      obj_data["name"] = obj;
-      const auto poses = frame_poses[obj.p];
-      for (uint i = 0; i < poses.size(); ++i) {
-        json step_data;
-        step_data["pos"] = poses[i]({0, 2});
-        step_data["quat"] = poses[i]({3, 6});
-        obj_data["steps"].push_back(step_data);
-      }
-
-      all_obj_data.push_back(obj_data);
-    }
-
-    json data;
-    data["robots"] = all_robot_data;
-    data["objs"] = all_obj_data;
-
-    save_json(data, folder + "trajectory.json", write_compressed_json);
   }
 
   {
@@ -785,7 +1104,7 @@ void export_plan(rai::Configuration C, const std::vector<Robot> &robots,
 
     const double makespan = get_makespan_from_plan(plan);
     std::vector<rai::String> obj_names;
-    for (const auto frame : C.frames) {
+    for (const auto frame : C->frames) {
       if (frame->name.contains("obj")) {
         obj_names.push_back(frame->name);
       }
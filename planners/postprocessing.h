@@ -1,5 +1,9 @@
 #pragma once
 
+#include <deque>
+#include <numeric>
+#include <tuple>
+
 #include "spdlog/spdlog.h"
 
 #include <Manip/timedPath.h>
@@ -11,46 +15,43 @@
 
 #include "common/util.h"
 #include "common/config.h"
+#include "common/joint_kernels.h"
 
-arr constructShortcutPath(const rai::Configuration &C, const arr &path,
-                          const uint i, const uint j,
-                          const std::vector<uint> short_ind) {
-  auto periodicDimensions = std::vector<bool>(C.getJointState().N, false);
+#include "timed_collision.h"
 
-  for (auto *j : C.activeJoints) {
-    if (j->type == rai::JT_hingeX || j->type == rai::JT_hingeY ||
-        j->type == rai::JT_hingeZ) {
-      periodicDimensions[j->qIndex] = true;
-    }
-  }
+arr constructShortcutPath(const std::vector<unsigned char> &periodic,
+                          const arr &path, const uint i, const uint j,
+                          const std::vector<uint> &short_ind) {
+  const uint dof = path.d1;
 
-  const arr p1 = path[i]();
-  const arr p2 = path[j]();
-  arr delta = p2 - p1;
-  for (uint l = 0; l < delta.N; ++l) {
-    if (periodicDimensions[l]) {
-      // this is an angular joint -> we need to check the other direction
-      const double start = p2(l);
-      const double end = p1(l);
-      delta(l) = std::fmod(start - end + 3. * RAI_PI, 2 * RAI_PI) - RAI_PI;
-      // delta(l) = start - end;
-    }
+  std::vector<unsigned char> is_short(dof, 0);
+  for (const uint k : short_ind) {
+    is_short[k] = 1;
   }
 
-  arr p(j - i + 1, path.d1);
+  // copy the segment, and interpolate the shortcut dimensions
+  arr p(j - i + 1, dof);
+  std::copy(&path(i, 0), &path(i, 0) + p.N, p.p);
+
+  std::vector<double> delta(dof);
+  const double *p1 = &path(i, 0);
+  const double *p2 = &path(j, 0);
+  for (uint l = 0; l < dof; ++l) {
+    // for angular joints we need to check the other direction
+    delta[l] = periodic[l] ? joint_kernels::wrap_angle(p2[l] - p1[l])
+                           : p2[l] - p1[l];
+  }
 
   for (uint l = 0; l < p.d0; ++l) {
-    for (uint k = 0; k < path.d1; ++k) {
-      if (std::find(short_ind.begin(), short_ind.end(), k) != short_ind.end()) {
-        const double a = 1. * l / (j - i);
-        p(l, k) = path(i, k) + a * (delta(k));
-
-        if (periodicDimensions[k]){
-          p(l, k) = std::fmod(p(l, k) + 3. * RAI_PI, 2 * RAI_PI) - RAI_PI;
-        }
-
-      } else {
-        p(l, k) = path(l + i, k);
+    const double a = 1. * l / (j - i);
+    double *row = &p(l, 0);
+    for (uint k = 0; k < dof; ++k) {
+      if (!is_short[k]) {
+        continue;
+      }
+      row[k] = p1[k] + a * delta[k];
+      if (periodic[k]) {
+        row[k] = joint_kernels::wrap_angle(row[k]);
       }
     }
   }
@@ -58,6 +59,13 @@ arr constructShortcutPath(const rai::Configuration &C, const arr &path,
   return p;
 }
 
+arr constructShortcutPath(const rai::Configuration &C, const arr &path,
+                          const uint i, const uint j,
+                          const std::vector<uint> short_ind) {
+  return constructShortcutPath(get_periodic_dimensions(C), path, i, j,
+                               short_ind);
+}
+
 double corput(int n, const int base = 2) {
   double q = 0, bk = (double)1 / base;
 
@@ -72,40 +80,11 @@ double corput(int n, const int base = 2) {
 
 // compute path length while considering periodic dimensions
 const double path_length(const rai::Configuration &C, const arr &path, const bool inf_norm=true) {
-  double cost = 0.;
-  auto periodicDimensions = std::vector<bool>(C.getJointState().N, false);
-
-  for (auto *j : C.activeJoints) {
-    if (j->type == rai::JT_hingeX || j->type == rai::JT_hingeY ||
-        j->type == rai::JT_hingeZ) {
-      periodicDimensions[j->qIndex] = true;
-    }
-  }
-
-  for (uint i = 0; i < path.d0 - 1; ++i) {
-    arr delta = path[i] - path[i+1];
-
-    for (uint l = 0; l < delta.N; ++l) {
-      if (periodicDimensions[l]) {
-        // this is an angular joint -> we need to check the other direction
-        const double start = path[i](l);
-        const double end = path[i+1](l);
-        delta(l) = std::fmod(start - end + 3. * RAI_PI, 2 * RAI_PI) - RAI_PI;
-      }
-    }
-
-    if (!inf_norm) {
-      cost += length(delta);
-    } else {
-      cost += absMax(delta);
-    }
-  }
-
-  return cost;
+  return get_path_length(get_periodic_dimensions(C), path, inf_norm);
 }
 
 arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initialPath,
-                     const uint t0) {
+                     const uint t0, TimedCollisionChecker *checker = nullptr) {
   spdlog::info("Starting shortcutting");
   // We do not currently support preplaned frames here
   // if (TP.A.prePlannedFrames.N != 0) {
@@ -115,6 +94,10 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
   TP.C.fcl()->stopEarly = global_params.use_early_coll_check_stopping;
 
   arr smoothedPath = initialPath;
+  if (initialPath.d0 < 3) {
+    return smoothedPath;
+  }
+
   /*for (uint i=0; i<smoothedPath.d0; i+=4){
     TP.query(smoothedPath[i], t0 + i);
     TP.C.watch(true);
@@ -123,31 +106,86 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
   // hack, since I didnt wanna move my projection method
   PathFinder_RRT_Time planner(TP);
 
+  const auto periodic = get_periodic_dimensions(TP.C);
+  const uint dof = smoothedPath.d1;
+
+  const auto segment_length = [&](const arr &path, const uint n) {
+    return joint_kernels::dispatch(dof, [&](auto D) {
+      return joint_kernels::step_length<decltype(D)::value>(
+          &path(n, 0), &path(n + 1, 0), periodic.data(), dof, true);
+    });
+  };
+
+  // cost of each segment of the smoothed path, updated when a shortcut is
+  // accepted instead of recomputing the length of the whole path
+  std::vector<double> segment_costs(initialPath.d0 - 1);
+  for (uint n = 0; n + 1 < initialPath.d0; ++n) {
+    segment_costs[n] = segment_length(smoothedPath, n);
+  }
+
   std::vector<double> costs;
-  costs.push_back(path_length(TP.C, initialPath));
+  costs.push_back(
+      std::accumulate(segment_costs.begin(), segment_costs.end(), 0.));
+
+  const auto is_valid_window = [&](const uint i, const uint j) {
+    return j - i > 1 &&
+           (TP.A.prePlannedFrames.N == 0 ||
+            (TP.A.prePlannedFrames.N > 0 &&
+             ((i >= TP.A.tPrePlanned - t0 && j >= TP.A.tPrePlanned - t0) ||
+              (i <= TP.A.tPrePlanned - t0 && j <= TP.A.tPrePlanned - t0))));
+  };
+
+  // windows are tried coarse to fine first (the whole path, then halves with
+  // overlap, ...), since long shortcuts remove the most cost if they are
+  // feasible. Afterwards, random windows are chosen.
+  std::deque<std::pair<uint, uint>> scheduled_windows;
+  for (uint w = initialPath.d0 - 1; w >= 2; w /= 2) {
+    for (uint i = 0; i + w < initialPath.d0; i += std::max(1u, w / 2)) {
+      if (is_valid_window(i, i + w)) {
+        scheduled_windows.push_back({i, i + w});
+      }
+    }
+    if (scheduled_windows.size() > 20) {
+      break;
+    }
+  }
 
+  // number of random windows. The scheduled windows are tried in addition,
+  // and do not count towards the convergence check.
   const uint max_iter = 100;
+  // stop if there was no improvement in this many consecutive iterations
+  const uint conv = 20;
+  uint iterations_without_improvement = 0;
+
   // const uint resolution = 2;
   const double resolution = 0.1;
   // const uint max_iter = 100;
   // const uint resolution = 5;
-  for (uint k = 0; k < max_iter; ++k) {
-    // choose random indices
+  const uint num_scheduled_windows = scheduled_windows.size();
+  for (uint k = 0; k < num_scheduled_windows + max_iter; ++k) {
+    if (iterations_without_improvement >= conv) {
+      spdlog::info("Converged after {}, iterations", k);
+      break;
+    }
+
+    // choose indices
     uint i, j;
-    while (true) {
-      i = rand() % initialPath.d0;
-      j = rand() % initialPath.d0; 
+    if (!scheduled_windows.empty()) {
+      std::tie(i, j) = scheduled_windows.front();
+      scheduled_windows.pop_front();
+    } else {
+      ++iterations_without_improvement;
+      while (true) {
+        i = rand() % initialPath.d0;
+        j = rand() % initialPath.d0;
 
-      if (i > j) {
-        std::swap(i, j);
-      }
-     
-      if (j-i > 1 &&
-          (TP.A.prePlannedFrames.N == 0 ||
-           (TP.A.prePlannedFrames.N > 0 &&
-            ((i >= TP.A.tPrePlanned - t0 && j >= TP.A.tPrePlanned - t0) ||
-             (i <= TP.A.tPrePlanned - t0 && j <= TP.A.tPrePlanned - t0))))) {
-        break;
+        if (i > j) {
+          std::swap(i, j);
+        }
+
+        if (is_valid_window(i, j)) {
+          break;
+        }
       }
     }
 
@@ -163,8 +201,7 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
     }
 
     // construct the new path
-    auto p = constructShortcutPath(TP.C, smoothedPath, i, j, {});
-    auto ps = constructShortcutPath(TP.C, smoothedPath, i, j, ind);
+    auto ps = constructShortcutPath(periodic, smoothedPath, i, j, ind);
     
     if (TP.A.prePlannedFrames.N > 0){
       for (uint n=0; n<ps.d0; ++n){
@@ -180,41 +217,66 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
       }
     }
 
-    const double len = path_length(TP.C, ps);
+    std::vector<double> shortcut_costs(j - i);
+    for (uint n = 0; n < j - i; ++n) {
+      shortcut_costs[n] = segment_length(ps, n);
+    }
+
+    const double len =
+        std::accumulate(shortcut_costs.begin(), shortcut_costs.end(), 0.);
+    const double current_len = std::accumulate(
+        segment_costs.begin() + i, segment_costs.begin() + j, 0.);
 
     // if the path length of the shortcut path is not shorter than the original one, don't consider it
-    if (path_length(TP.C, p) <= len){
+    if (current_len <= len + 1e-9){
       continue;
     }
 
     // check if the new path is feasible (interpolate)
-    // permute the indices that we check
+    // the points are checked in batches over all segments: first the start
+    // of every segment (in random order), then the midpoints, and so on,
+    // such that collisions anywhere on the shortcut are found early.
     uintA q;
     q.setStraightPerm(j - i);
     q.permuteRandomly();
 
-    // enable not checking everything here
+    std::vector<uint> num_pts(j - i);
+    uint max_pts = 0;
+    for (uint n = 0; n < j - i; ++n) {
+      const double dist = joint_kernels::dispatch(dof, [&](auto D) {
+        return joint_kernels::distance<decltype(D)::value>(
+            &ps(n, 0), &ps(n + 1, 0), dof);
+      });
+      num_pts[n] = uint(std::max(dist / resolution, 1.));
+      max_pts = std::max(max_pts, num_pts[n]);
+    }
+
     bool shortcutFeasible = true;
-    for (const uint n : q) {
-      const arr dir = ps[n + 1] - ps[n];
-      const double dist = length(dir);
-      const uint num_pts = uint(std::max(dist / resolution, 1.));
-      for (uint l = 0; l < num_pts; ++l) {
-        const double interp = corput(l);
-        const arr point = ps[n] + interp * 1. * dir;
+    arr point(dof);
+    for (uint l = 0; l < max_pts && shortcutFeasible; ++l) {
+      const double interp = corput(l);
+      for (const uint n : q) {
+        if (l >= num_pts[n]) {
+          continue;
+        }
+
+        joint_kernels::dispatch(dof, [&](auto D) {
+          joint_kernels::lerp<decltype(D)::value>(&ps(n, 0), &ps(n + 1, 0),
+                                                  interp, dof, point.p);
+        });
         const double t = t0 + i + n + 1. * interp;
 
         // std::cout << t << " " << point << std::endl;
 
-        const auto qr = TP.query(point, t);
+        const bool feasible = checker ? checker->is_feasible(point, t)
+                                      : TP.query(point, t)->isFeasible;
 
-        if (!qr->isFeasible) {
+        if (!feasible) {
           // std::cout << "A" << std::endl;
           shortcutFeasible = false;
           break;
         }
       }
-      if (!shortcutFeasible){break;}
     }
 
     // if path is valid, copy it over
@@ -223,16 +285,11 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
       for (uint n = 1; n < ps.d0; ++n) {
         smoothedPath[i + n] = ps[n];
       }
-    }
-
-    const auto c = path_length(TP.C, smoothedPath);
-    costs.push_back(c);
+      std::copy(shortcut_costs.begin(), shortcut_costs.end(),
+                segment_costs.begin() + i);
 
-    // proxy measure for convergence
-    const uint conv = 100;
-    if (k > conv && abs(costs.back() - costs[costs.size() - conv - 1]) < 1e-6) {
-      spdlog::info("Converged after {}, iterations", k);
-      break;
+      costs.push_back(costs.back() - current_len + len);
+      iterations_without_improvement = 0;
     }
   }
 
@@ -426,40 +483,130 @@ arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
 }
 
 
+// optimizes the rows (i, i + horizon) of the joint path of all robots with
+// komo. The rows i - 1, i and i + horizon are fixed, as well as the poses of
+// the robots at the end of their tasks. Only reads from `input`, and writes
+// the interior of the window to `output` if the solution satisfies the
+// constraints.
+bool reoptimize_window(const rai::Configuration &C, const arr &input,
+                       arr &output, const uint i, const uint horizon,
+                       const Plan &plan,
+                       const std::unordered_map<Robot, StringA> &per_robot_joints) {
+  OptOptions options;
+  options.stopIters = 10;
+  // options.damping = 1e-3;
+  // options.stopLineSteps = 5;
+
+  KOMO komo;
+  komo.setModel(C, true);
+  komo.setTiming(1., horizon, 1, 2);
+  komo.verbose = 0;
+  komo.solver = rai::KS_sparse;
+
+  komo.add_collision(true, .001, 1e1);
+  komo.add_qControlObjective({}, 2, 1e1);
+  komo.add_qControlObjective({}, 1, 1e1);
+
+  // start constraint: step j of komo is row i + 1 + j of the path
+  komo.setConfiguration(-2, input[i == 0 ? 0 : i - 1]);
+  komo.setConfiguration(-1, input[i]);
+
+  for (uint j = 0; j < horizon; ++j) {
+    komo.setConfiguration(j, input[i + 1 + j]);
+  }
+
+  // goal constraint
+  komo.addObjective({1}, FS_qItself, {}, OT_eq, {1e1}, input[i + horizon]);
+
+  // add constraints for positions of actions
+  for (const auto &robot_tasks : plan) {
+    const auto &r = robot_tasks.first;
+    for (const auto &task : robot_tasks.second) {
+      const uint task_end_time = task.t(0) + task.t.d0 - 1;
+      if (task_end_time <= i || task_end_time >= i + horizon) {
+        continue;
+      }
+
+      const double scaled_time = 1. * (task_end_time - i) / horizon;
+      const double constr_start_time =
+          std::max(0., scaled_time - 0.5 / horizon);
+      const double constr_end_time = std::min(1., scaled_time + 0.5 / horizon);
+
+      spdlog::debug("Adding constraint for robot {} at time {}", r.prefix,
+                    task_end_time);
+
+      // position
+      komo.addObjective({constr_start_time, constr_end_time},
+                        make_shared<F_qItself>(F_qItself::byJointNames,
+                                               per_robot_joints.at(r),
+                                               komo.world),
+                        {}, OT_eq, {1e1}, task.path[-1]);
+
+      // velocity
+      komo.addObjective({constr_start_time, constr_end_time},
+                        make_shared<F_qItself>(F_qItself::byJointNames,
+                                               per_robot_joints.at(r),
+                                               komo.world),
+                        {}, OT_eq, {1e1}, {}, 1);
+    }
+  }
+
+  komo.run_prepare(0.0, true);
+  komo.run(options);
+
+  const double ineq = komo.getReport(false).get<double>("ineq");
+  const double eq = komo.getReport(false).get<double>("eq");
+
+  spdlog::debug("Window {} - {}: ineq {} eq {}", i, i + horizon, ineq, eq);
+
+  if (eq > 1 || ineq > 1) {
+    return false;
+  }
+
+  for (uint j = 0; j + 1 < horizon; ++j) {
+    output[i + 1 + j] = komo.getPath_q(j);
+  }
+  return true;
+}
+
+// Smooths the plan of all robots jointly.
+// The joint path is split into non-overlapping windows which are optimized
+// concurrently. A second pass optimizes windows that are centered on the
+// boundaries of the first ones to smooth the seams. Finally, the result is
+// checked for collisions, and the windows that introduced new collisions are
+// reverted.
 Plan reoptimize_plan(rai::Configuration C,
                 const Plan &unscaled_plan,
                 const std::unordered_map<Robot, arr> &home_poses) {
-  // formulate KOMO problem for multiple robots
   std::vector<Robot> all_robots;
   for (const auto &per_robot_plan : unscaled_plan) {
     all_robots.push_back(per_robot_plan.first);
   }
 
-  for (const auto &element : all_robots) {
-    std::cout << element << std::endl;
-  }
-
   setActive(C, all_robots);
 
   rai::Animation A = make_animation_from_plan(unscaled_plan);
-
-  setActive(C, all_robots);
+  const uint total_length = A.getT();
 
   // extract complete trajectory
-  std::cout << "extracting traj" << std::endl;
-  arr smoothed_path(A.getT(), (unscaled_plan.begin()->second)[0].path.d1 *
-                                  all_robots.size());
-  for (uint i = 0; i < A.getT(); ++i) {
-    uint offset = 0;
+  std::vector<uint> offsets;
+  uint dof = 0;
+  for (const auto &r : all_robots) {
+    offsets.push_back(dof);
+    dof += home_poses.at(r).N;
+  }
+
+  arr smoothed_path(total_length, dof);
+  for (uint i = 0; i < total_length; ++i) {
     for (uint j = 0; j < all_robots.size(); ++j) {
       const arr pose =
           get_robot_pose_at_time(i, all_robots[j], home_poses, unscaled_plan);
       for (uint k = 0; k < pose.N; ++k) {
-        smoothed_path[i](k + offset) = pose(k);
+        smoothed_path(i, k + offsets[j]) = pose(k);
       }
-      offset += pose.N;
     }
   }
+  const arr initial_path = smoothed_path;
 
   // get joints per robot
   std::unordered_map<Robot, StringA> per_robot_joints;
@@ -472,158 +619,438 @@ Plan reoptimize_plan(rai::Configuration C,
   }
 
   const uint horizon_length = 50;
-  const uint total_length = A.getT();
-  const uint step_size = 20;
 
-  OptOptions options;
-  options.stopIters = 10;
-  // options.damping = 1e-3;
-  // options.stopLineSteps = 5;
+  // windows and the input of both passes, to be able to revert single windows
+  std::vector<std::vector<std::pair<uint, uint>>> pass_windows(2);
+  std::vector<arr> pass_inputs(2);
 
-  KOMO komo;
-  komo.setModel(C, true);
-  komo.setTiming(1., horizon_length, 1, 2);
-  komo.verbose = 0;
-  komo.solver = rai::KS_sparse;
+  for (const uint pass : {0u, 1u}) {
+    // windows of the second pass are shifted by half a horizon
+    std::vector<std::pair<uint, uint>> &windows = pass_windows[pass];
+    for (uint i = pass * horizon_length / 2; i + 3 < total_length;
+         i += horizon_length) {
+      windows.push_back({i, std::min(horizon_length, total_length - 1 - i)});
+    }
+
+    spdlog::info("Reoptimization pass {}: {} windows", pass, windows.size());
+
+    // every window gets its own copy of the configuration
+    std::vector<rai::Configuration> configurations(windows.size());
+    for (auto &Ccpy : configurations) {
+      Ccpy.copy(C);
+    }
 
-  for (uint i = 0; i < total_length - horizon_length; i += step_size) {
-    std::cout << "iteration " << i << std::endl;
-    komo.add_collision(true, .001, 1e1);
-    komo.add_qControlObjective({}, 2, 1e1);
-    komo.add_qControlObjective({}, 1, 1e1);
-
-    // start constraint
-    if (i > 0) {
-      komo.setConfiguration(-2, smoothed_path[i - 2]);
-      komo.setConfiguration(-1, smoothed_path[i - 1]);
-    }
-
-    const arr q0 = smoothed_path[i];
-    komo.setConfiguration(0, q0);
-
-    for (uint j = 0; j < horizon_length; ++j) {
-      komo.setConfiguration(j, smoothed_path[i + j]);
-    }
-
-    // goal constraint
-    const arr q_final = smoothed_path[i + horizon_length];
-
-    komo.addObjective({1}, FS_qItself, {}, OT_eq, {1e1}, q_final);
-
-    // add constraints for positions of actions
-    // TODO: check if this is actually correct
-    for (const auto &robot_tasks : unscaled_plan) {
-      const auto r = robot_tasks.first;
-      const auto tasks = robot_tasks.second;
-
-      for (const auto &task : tasks) {
-        const double task_end_time = task.t(0) + task.t.d0;
-        if (task_end_time >= i && task_end_time < i + horizon_length) {
-          const double scaled_time = 1. * (task_end_time - i) / horizon_length;
-          const double constr_start_time =
-              std::max(0., scaled_time - 0.5 / horizon_length);
-          const double constr_end_time =
-              std::min(1., scaled_time + 0.5 / horizon_length);
-
-          std::cout << "Adding constraint at time " << task_end_time
-                    << std::endl;
-          std::cout << "for robot " << r << std::endl;
-          std::cout << scaled_time << std::endl;
-          std::cout << constr_start_time << " " << constr_end_time << std::endl;
-
-          // position
-          komo.addObjective({constr_start_time, constr_end_time},
-                            make_shared<F_qItself>(F_qItself::byJointNames,
-                                                   per_robot_joints[r],
-                                                   komo.world),
-                            {}, OT_eq, {1e1}, task.path[-1]);
-
-          // velocity
-          komo.addObjective({constr_start_time, constr_end_time},
-                            make_shared<F_qItself>(F_qItself::byJointNames,
-                                                   per_robot_joints[r],
-                                                   komo.world),
-                            {}, OT_eq, {1e1}, {}, 1);
+    pass_inputs[pass] = smoothed_path;
+    const arr &input = pass_inputs[pass];
+    run_parallel(windows.size(), global_params.reoptimize_threads,
+                 [&](const uint w) {
+                   if (!reoptimize_window(configurations[w], input,
+                                          smoothed_path,
+                                          windows[w].first, windows[w].second,
+                                          unscaled_plan, per_robot_joints)) {
+                     spdlog::debug("Keeping window {} unchanged",
+                                   windows[w].first);
+                   }
+                 });
+  }
+
+  // the plan with the paths of the robots taken from the joint path
+  const auto make_plan = [&](const arr &path) {
+    Plan plan;
+    for (const auto &per_robot_plan : unscaled_plan) {
+      const auto robot = per_robot_plan.first;
+      uint offset = 0;
+      for (uint j = 0; j < all_robots.size(); ++j) {
+        if (all_robots[j] == robot) {
+          offset = offsets[j];
         }
       }
+      const uint n = home_poses.at(robot).N;
+
+      for (const auto &task : per_robot_plan.second) {
+        TaskPart new_task_part;
+
+        new_task_part.t = task.t;
+        new_task_part.r = task.r;
+        new_task_part.task_index = task.task_index;
+        new_task_part.algorithm = task.algorithm;
+        new_task_part.name = task.name;
+        new_task_part.is_exit = task.is_exit;
+
+        new_task_part.path.resize(task.t.d0, n);
+        for (uint i = 0; i < task.t.d0; ++i) {
+          for (uint k = 0; k < n; ++k) {
+            new_task_part.path(i, k) = path(task.t(0) + i, offset + k);
+          }
+        }
+
+        FrameL robot_frames;
+        for (const auto &frame : task.anim->frameNames) {
+          robot_frames.append(C[frame]);
+        }
+        setActive(C, robot);
+        new_task_part.anim = make_animation_part(C, new_task_part.path,
+                                                 robot_frames, task.t(0));
+
+        plan[robot].push_back(new_task_part);
+      }
     }
+    setActive(C, all_robots);
+    return plan;
+  };
+
+  // validation: the optimized plan must not collide where the input plan did
+  // not. The komo windows do not model held or animated objects, so
+  // collisions are expected. Only the windows that contain a colliding
+  // timestep are reverted to their input, the ones of the second pass first.
+  const auto pairs = get_cant_collide_pairs(C);
+
+  TimedConfigurationProblem TP_old(C, A);
+  TP_old.C.fcl()->deactivatePairs(pairs);
+  std::vector<bool> old_feasible(total_length);
+  for (uint i = 0; i < total_length; ++i) {
+    old_feasible[i] = TP_old.query(initial_path[i], i)->isFeasible;
+  }
 
-    // optimize
-    komo.run_prepare(0.0, true);
-    std::cout << "running" << std::endl;
-    komo.run(options);
-    std::cout << "done" << std::endl;
+  std::vector<std::vector<bool>> reverted = {
+      std::vector<bool>(pass_windows[0].size(), false),
+      std::vector<bool>(pass_windows[1].size(), false)};
 
-    // TODO: ensure that everything is collision free
+  const auto revert = [&](const uint pass, const uint w) {
+    const auto &window = pass_windows[pass][w];
+    for (uint i = window.first; i <= window.first + window.second; ++i) {
+      smoothed_path[i] = pass_inputs[pass][i];
+    }
+    reverted[pass][w] = true;
+  };
+
+  const auto contains = [](const std::pair<uint, uint> &window,
+                           const uint t) {
+    return t > window.first && t < window.first + window.second;
+  };
+
+  Plan optimized_plan = make_plan(smoothed_path);
+  while (true) {
+    TimedConfigurationProblem TP_new(C,
+                                     make_animation_from_plan(optimized_plan));
+    TP_new.C.fcl()->deactivatePairs(pairs);
+
+    int collision_time = -1;
+    for (uint i = 0; i < total_length; ++i) {
+      if (old_feasible[i] && !TP_new.query(smoothed_path[i], i)->isFeasible) {
+        collision_time = i;
+        break;
+      }
+    }
 
-    // get results from komo
-    for (uint j = 0; j < horizon_length; ++j) {
-      smoothed_path[i + j] = komo.getPath_q(j);
+    if (collision_time < 0) {
+      break;
     }
 
-    const double ineq = komo.getReport(false).get<double>("ineq");
-    const double eq = komo.getReport(false).get<double>("eq");
+    bool changed = false;
+    for (uint w = 0; w < pass_windows[1].size() && !changed; ++w) {
+      if (!reverted[1][w] && contains(pass_windows[1][w], collision_time)) {
+        revert(1, w);
+        changed = true;
+      }
+    }
 
-    std::cout << ineq << " " << eq << std::endl;
+    // reverting a window of the first pass also reverts the windows of the
+    // second pass that overlap with it, since they were optimized with its
+    // result as input
+    for (uint w = 0; w < pass_windows[0].size() && !changed; ++w) {
+      const auto &window = pass_windows[0][w];
+      if (reverted[0][w] || !contains(window, collision_time)) {
+        continue;
+      }
+      for (uint v = 0; v < pass_windows[1].size(); ++v) {
+        const auto &other = pass_windows[1][v];
+        if (!reverted[1][v] && other.first < window.first + window.second &&
+            window.first < other.first + other.second) {
+          revert(1, v);
+        }
+      }
+      revert(0, w);
+      changed = true;
+    }
 
-    if (false) {
-      std::cout << komo.getReport(true, 0) << std::endl;
-      komo.pathConfig.watch(true);
+    if (!changed) {
+      spdlog::warn("Reoptimized plan is in collision at time {}, keeping the "
+                   "original plan.",
+                   collision_time);
+      return unscaled_plan;
     }
 
-    komo.clearObjectives();
+    spdlog::info("Reoptimized plan is in collision at time {}, reverting the "
+                 "window.",
+                 collision_time);
+    optimized_plan = make_plan(smoothed_path);
   }
 
-  std::unordered_map<Robot, arr> per_robot_paths;
-  for (const auto &r : all_robots) {
-    per_robot_paths[r].resize(A.getT(), home_poses.at(r).d0);
+  return optimized_plan;
+}
+
+// linear interpolation between the rows of a path at the (fractional) index
+// tau, taking the shorter direction for the periodic dimensions
+arr interpolate_path(const arr &path, const double tau,
+                     const std::vector<unsigned char> &periodic) {
+  const uint i = std::min<uint>(uint(std::floor(tau)), path.d0 - 1);
+  const double a = tau - i;
+  arr q = path[i];
+  if (a < 1e-9 || i + 1 >= path.d0) {
+    return q;
+  }
+
+  for (uint k = 0; k < q.N; ++k) {
+    const double delta = path(i + 1, k) - path(i, k);
+    q(k) += a * (periodic[k] ? joint_kernels::wrap_angle(delta) : delta);
+    if (periodic[k]) {
+      q(k) = joint_kernels::wrap_angle(q(k));
+    }
+  }
+  return q;
+}
+
+// interpolates the frame poses of an animation part at the (fractional)
+// index tau. Positions are interpolated linearly, orientations with nlerp.
+arr interpolate_frame_poses(const arr &X, const double tau) {
+  const uint i = std::min<uint>(uint(std::floor(tau)), X.d0 - 1);
+  const double a = tau - i;
+  arr res = X[i];
+  if (a < 1e-9 || i + 1 >= X.d0) {
+    return res;
   }
 
-  for (uint i = 0; i < A.getT(); ++i) {
-    C.setJointState(smoothed_path[i]);
-    C.watch(false);
-    rai::wait(0.01);
+  for (uint f = 0; f < X.d1; ++f) {
+    for (uint k = 0; k < 3; ++k) {
+      res(f, k) += a * (X(i + 1, f, k) - X(i, f, k));
+    }
 
-    for (const auto &r : all_robots) {
-      setActive(C, r);
-      const arr pose = C.getJointState();
-      per_robot_paths[r][i] = pose;
+    double dot = 0;
+    for (uint k = 3; k < 7; ++k) {
+      dot += X(i, f, k) * X(i + 1, f, k);
     }
+    const double sign = dot < 0 ? -1. : 1.;
 
-    setActive(C, all_robots);
+    double norm = 0;
+    for (uint k = 3; k < 7; ++k) {
+      res(f, k) = (1 - a) * X(i, f, k) + a * sign * X(i + 1, f, k);
+      norm += res(f, k) * res(f, k);
+    }
+    norm = std::sqrt(norm);
+    for (uint k = 3; k < 7; ++k) {
+      res(f, k) /= norm;
+    }
   }
+  return res;
+}
 
-  Plan optimized_plan;
+// Compresses the plan in time with a time warp that is shared by all robots.
+// Each step of the plan gets the shortest duration for which no robot exceeds
+// its velocity limit, and steps in which no robot moves (waits, e.g. the
+// padding of mode switches) are compressed to idle_step_duration. The change
+// of the time scaling between consecutive moving steps is limited by
+// max_scaling_change, as proxy for an acceleration limit.
+// Slack of a single robot (e.g. one that finished its tasks already) is not
+// used, since that would need a separate timeline per robot.
+// Since all robots share the warp, the relative timing (and with that
+// synchronization for handovers, and the collision constraints) is kept
+// up to interpolation. The start and end of each task stay on integer time
+// steps.
+// The retimed plan is checked for collisions, and the input plan is returned
+// if the retiming introduced new collisions.
+Plan retime_plan(rai::Configuration C, const Plan &plan,
+                 const std::unordered_map<Robot, arr> &home_poses,
+                 const double max_scaling_change = 0.1,
+                 const double idle_step_duration = 0.1) {
+  std::vector<Robot> all_robots;
+  for (const auto &per_robot_plan : plan) {
+    all_robots.push_back(per_robot_plan.first);
+  }
 
-  for (const auto &per_robot_plan : unscaled_plan) {
-    const auto robot = per_robot_plan.first;
-    const auto tasks = per_robot_plan.second;
+  const uint total_length = uint(get_makespan_from_plan(plan)) + 1;
+  if (total_length < 2) {
+    return plan;
+  }
+
+  std::unordered_map<Robot, std::vector<unsigned char>> periodic;
+  for (const auto &r : all_robots) {
+    setActive(C, r);
+    periodic[r] = get_periodic_dimensions(C);
+  }
+
+  // duration of each step of the plan
+  std::vector<double> durations(total_length - 1, 0.);
+  for (const auto &r : all_robots) {
+    arr prev = get_robot_pose_at_time(0, r, home_poses, plan);
+    for (uint t = 0; t + 1 < total_length; ++t) {
+      const arr next = get_robot_pose_at_time(t + 1, r, home_poses, plan);
+      const double dist = joint_kernels::dispatch(prev.N, [&](auto D) {
+        return joint_kernels::step_length<decltype(D)::value>(
+            next.p, prev.p, periodic[r].data(), prev.N, true);
+      });
+      durations[t] = std::max(durations[t], dist / r.vmax);
+      prev = next;
+    }
+  }
 
-    for (const auto &task : tasks) {
-      TaskPart new_task_part;
+  std::vector<unsigned char> idle(durations.size(), false);
+  for (uint t = 0; t < durations.size(); ++t) {
+    if (durations[t] < 1e-6) {
+      // nobody moves
+      idle[t] = true;
+      durations[t] = idle_step_duration;
+    } else if (durations[t] > 1.) {
+      // the path is already at the velocity limit
+      durations[t] = 1.;
+    }
+  }
 
-      new_task_part.t = task.t;
-      new_task_part.r = task.r;
-      new_task_part.task_index = task.task_index;
-      new_task_part.algorithm = task.algorithm;
-      new_task_part.name = task.name;
-      new_task_part.is_exit = task.is_exit;
+  // limit the change of the scaling between consecutive moving steps by
+  // slowing down the faster step
+  for (uint t = 1; t < durations.size(); ++t) {
+    if (!idle[t] && !idle[t - 1]) {
+      durations[t] =
+          std::max(durations[t], durations[t - 1] - max_scaling_change);
+    }
+  }
+  for (uint t = durations.size() - 1; t > 0; --t) {
+    if (!idle[t] && !idle[t - 1]) {
+      durations[t - 1] =
+          std::max(durations[t - 1], durations[t] - max_scaling_change);
+    }
+  }
 
-      new_task_part.path =
-          per_robot_paths[task.r]({task.t(0), task.t(0) + task.t.d0 - 1});
+  // the start and end of every task is kept on an integer time step
+  std::vector<uint> boundaries{0, total_length - 1};
+  for (const auto &per_robot_plan : plan) {
+    for (const auto &part : per_robot_plan.second) {
+      boundaries.push_back(uint(part.t(0)));
+      boundaries.push_back(uint(part.t(-1)));
+    }
+  }
+  std::sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+
+  // new (continuous) time of each old time step
+  std::vector<double> new_time(total_length, 0.);
+  for (uint b = 0; b + 1 < boundaries.size(); ++b) {
+    const uint t0 = boundaries[b];
+    const uint t1 = boundaries[b + 1];
+
+    double length = 0;
+    for (uint t = t0; t < t1; ++t) {
+      length += durations[t];
+    }
+    // round up, i.e. slow down slightly
+    const double scale = std::max(1., std::ceil(length - 1e-6)) / length;
 
-      FrameL robot_frames;
-      for (const auto &frame : task.anim.frameNames) {
-        robot_frames.append(C[frame]);
+    for (uint t = t0; t < t1; ++t) {
+      new_time[t + 1] = new_time[t] + durations[t] * scale;
+    }
+    new_time[t1] = std::round(new_time[t1]);
+  }
+
+  // old (fractional) time of a new integer time step
+  const auto get_old_time = [&](const uint s) {
+    const auto it = std::upper_bound(new_time.begin(), new_time.end(),
+                                     s + 1e-9);
+    const uint t = std::max<int>(0, int(it - new_time.begin()) - 1);
+    if (t + 1 >= total_length) {
+      return double(total_length - 1);
+    }
+    return t + (s - new_time[t]) / (new_time[t + 1] - new_time[t]);
+  };
+
+  Plan retimed_plan;
+  for (const auto &per_robot_plan : plan) {
+    const Robot &r = per_robot_plan.first;
+    for (const auto &part : per_robot_plan.second) {
+      const uint t0 = uint(part.t(0));
+      const uint s0 = uint(std::round(new_time[t0]));
+      const uint s1 = uint(std::round(new_time[uint(part.t(-1))]));
+
+      TaskPart new_part = part;
+      new_part.t.resize(s1 - s0 + 1);
+      new_part.path.resize(s1 - s0 + 1, part.path.d1);
+
+      auto anim = std::make_shared<rai::Animation::AnimationPart>();
+      if (part.anim) {
+        anim->start = s0;
+        anim->frameIDs = part.anim->frameIDs;
+        anim->frameNames = part.anim->frameNames;
+        anim->X.resize(s1 - s0 + 1, part.anim->X.d1, 7);
       }
-      setActive(C, robot);
-      const auto anim_part =
-          make_animation_part(C, new_task_part.path, robot_frames, task.t(0));
-      new_task_part.anim = anim_part;
 
-      optimized_plan[robot].push_back(new_task_part);
+      for (uint s = s0; s <= s1; ++s) {
+        const double tau = get_old_time(s) - t0;
+        new_part.t(s - s0) = s;
+        new_part.path[s - s0] = interpolate_path(part.path, tau, periodic[r]);
+        if (part.anim) {
+          anim->X[s - s0] = interpolate_frame_poses(part.anim->X, tau);
+        }
+      }
+      if (part.anim) {
+        new_part.anim = anim;
+      }
+
+      retimed_plan[r].push_back(new_part);
     }
   }
 
-  return optimized_plan;
+  spdlog::info("Retiming: makespan {} -> {}", get_makespan_from_plan(plan),
+               get_makespan_from_plan(retimed_plan));
+
+  // validation: the retimed plan must not collide where the input plan did
+  // not.
+  setActive(C, all_robots);
+
+  TimedConfigurationProblem TP_new(C, make_animation_from_plan(retimed_plan));
+  TimedConfigurationProblem TP_old(C, make_animation_from_plan(plan));
+  const auto pairs = get_cant_collide_pairs(C);
+  TP_new.C.fcl()->deactivatePairs(pairs);
+  TP_old.C.fcl()->deactivatePairs(pairs);
+
+  const uint new_length = uint(get_makespan_from_plan(retimed_plan)) + 1;
+  for (uint s = 0; s < new_length; ++s) {
+    arr q_new, q_old;
+    const uint t = uint(std::round(get_old_time(s)));
+    for (const auto &r : all_robots) {
+      q_new.append(get_robot_pose_at_time(s, r, home_poses, retimed_plan));
+      q_old.append(get_robot_pose_at_time(t, r, home_poses, plan));
+    }
+
+    if (!TP_new.query(q_new, s)->isFeasible &&
+        TP_old.query(q_old, t)->isFeasible) {
+      spdlog::warn("Retimed plan is in collision at time {}, keeping the "
+                   "original plan.",
+                   s);
+      return plan;
+    }
+  }
+
+  return retimed_plan;
+}
+
+// post processing of finished plans before they are exported. The plan is
+// not copied if nothing is done.
+PlanHandle postprocess_plan(const rai::Configuration &C, const PlanHandle &plan,
+                            const std::unordered_map<Robot, arr> &home_poses) {
+  if (!global_params.reoptimize_plans && !global_params.retime_plans) {
+    return plan;
+  }
+
+  Plan res = plan;
+  if (global_params.reoptimize_plans) {
+    spdlog::info("Reoptimizing plan");
+    res = reoptimize_plan(C, res, home_poses);
+  }
+
+  if (global_params.retime_plans) {
+    spdlog::info("Retiming plan");
+    res = retime_plan(C, res, home_poses);
+  }
+
+  return PlanHandle(std::move(res));
 }
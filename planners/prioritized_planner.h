@@ -15,6 +15,7 @@
 
 #include "plan.h"
 #include "postprocessing.h"
+#include "roadmap.h"
 
 #include "common/util.h"
 #include "common/env_util.h"
@@ -109,6 +110,25 @@ FrameL get_robot_joints(rai::Configuration &C, const Robot &robot) {
   return joints;
 }
 
+// skips collision checks between robots (and objects) that can never touch,
+// see get_out_of_reach_pairs.
+void deactivate_out_of_reach_pairs(
+    rai::Configuration &C, const std::unordered_map<Robot, arr> &home_poses) {
+  if (!global_params.prune_out_of_reach_pairs) {
+    return;
+  }
+
+  std::vector<Robot> robots;
+  for (const auto &hp : home_poses) {
+    robots.push_back(hp.first);
+  }
+
+  const uintA pairs =
+      get_out_of_reach_pairs(C, robots, global_params.out_of_reach_margin);
+  spdlog::info("Deactivating {} out of reach collision pairs.", pairs.d0);
+  C.fcl()->deactivatePairs(pairs);
+}
+
 arr plan_with_komo_given_horizon(const rai::Animation &A, rai::Configuration &C,
                                  const arr &q0, const arr &q1, const arr &ts,
                                  const Robot r, double &ineq,
@@ -239,13 +259,7 @@ arr plan_with_komo_given_horizon(const rai::Animation &A, rai::Configuration &C,
 }
 
 double get_max_speed(const arr &path) {
-  double max_speed = 0;
-  for (uint i = 0; i < path.d0 - 1; ++i) {
-    max_speed = std::max({max_speed, absMax(path[i] - path[i + 1])});
-    // max_speed = std::max({max_speed, length(path[i] - path[i + 1])});
-  }
-
-  return max_speed;
+  return get_max_step(path);
 }
 
 double get_earliest_feasible_time(TimedConfigurationProblem &TP, const arr &q,
@@ -273,6 +287,29 @@ double get_earliest_feasible_time(TimedConfigurationProblem &TP, const arr &q,
   return t_earliest_feas;
 }
 
+// same as above, but skips the time windows in which the configuration can
+// only collide with the static scene
+double get_earliest_feasible_time(TimedCollisionChecker &checker, const arr &q,
+                                  const uint t_max, const uint t_min) {
+  uint t_earliest_feas = t_max;
+  while (t_earliest_feas > t_min) {
+    if (!checker.is_feasible(q, t_earliest_feas)) {
+      spdlog::info("Not feasible at time {}", t_earliest_feas);
+      t_earliest_feas += 2;
+      break;
+    }
+
+    // nothing can change anymore in the remaining window
+    if (checker.is_window_free(t_min, t_earliest_feas)) {
+      t_earliest_feas = t_min;
+      break;
+    }
+    --t_earliest_feas;
+  }
+
+  return t_earliest_feas;
+}
+
 TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
                                 const uint t0, const arr &q0, const arr &q1,
                                 const uint time_lb, const Robot prefix,
@@ -302,7 +339,7 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
   }
 
   // const uint dt_max_vel = uint(std::ceil(length(q0 - q1) / prefix.vmax));
-  const uint dt_max_vel = uint(std::ceil(absMax(q0 - q1) / prefix.vmax));
+  const uint dt_max_vel = uint(std::ceil(abs_max_diff(q0, q1) / prefix.vmax));
 
   // the goal should always be free at the end of the animation, as we always
   // plan an exit path but it can be the case that we are currently planning an
@@ -495,16 +532,18 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
   const bool informed_sampling = rai::getParameter<bool>("informed_sampling", true);
   planner.informed_sampling = informed_sampling;
 
-  const uint dt_max_vel = uint(std::ceil(absMax(q0 - q1) / prefix.vmax));
+  const uint dt_max_vel = uint(std::ceil(abs_max_diff(q0, q1) / prefix.vmax));
   // const uint dt_max_vel = uint(std::ceil(length(q0 - q1) / prefix.vmax));
 
+  TimedCollisionChecker checker(TP, prefix);
+
   // the goal should always be free at the end of the animation, as we always
   // plan an exit path but it can be the case that we are currently planning an
   // exit path, thus we include the others
   const uint t_max_to_check = std::max({time_lb, t0 + dt_max_vel, TP.A.getT()});
   // establish time at which the goal is free, and stays free
   const uint t_earliest_feas = get_earliest_feasible_time(
-      TP, q1, t_max_to_check, std::max({time_lb, t0 + dt_max_vel}));
+      checker, q1, t_max_to_check, std::max({time_lb, t0 + dt_max_vel}));
 
   spdlog::info("t_earliest_feas {}", t_earliest_feas);
   spdlog::info("last anim time {}", TP.A.getT());
@@ -553,6 +592,9 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
     total_coll_time += planner.edge_checking_time_us;
     total_nn_time += planner.nn_time_us;
 
+    // the rrt queries TP directly
+    checker.invalidate();
+
     if (res.time.N != 0) {
       timedPath = res;
       break;
@@ -606,8 +648,7 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
 
   // check if resampled path is still fine
   for (uint i = 0; i < t.N; ++i) {
-    const auto res = TP.query(path[i], t(i));
-    if (!res->isFeasible) {
+    if (!checker.is_feasible(path[i], t(i))) {
       spdlog::error("resampled path is not feasible! This should not happen.");
       start_res->writeDetails(cout, TP.C);
 
@@ -649,7 +690,7 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
     //   }
     // }
 
-    new_path = partial_spacetime_shortcut(TP, path, t0);
+    new_path = partial_spacetime_shortcut(TP, path, t0, &checker);
 
     for (uint i = 0; i < new_path.d0; ++i) {
       const auto res = TP.query(new_path[i], t(i));
@@ -750,6 +791,81 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
   return tp;
 }
 
+// same as plan_in_animation_rrt, but searches the precomputed roadmap of the
+// robot instead of building a new tree. Returns an empty TaskPart if there is
+// no roadmap for this robot, or no path was found in it.
+TaskPart plan_in_animation_roadmap(TimedConfigurationProblem &TP,
+                                   const uint t0, const arr &q0, const arr &q1,
+                                   const uint time_lb, const Robot prefix) {
+  const auto roadmap = RoadmapRegistry::instance().get(prefix);
+  if (!roadmap || roadmap->dim() != q0.N) {
+    return TaskPart();
+  }
+
+  const auto start_time = std::chrono::high_resolution_clock::now();
+
+  const auto start_res = TP.query(q0, t0);
+  if (!start_res->isFeasible) {
+    spdlog::error("q_start is not feasible at time {}! This should not happen", t0);
+    return TaskPart();
+  }
+
+  const uint dt_max_vel = uint(std::ceil(abs_max_diff(q0, q1) / prefix.vmax));
+
+  TimedCollisionChecker checker(TP, prefix);
+
+  // same time bounds as in the rrt
+  const uint t_max_to_check = std::max({time_lb, t0 + dt_max_vel, TP.A.getT()});
+  const uint t_earliest_feas = get_earliest_feasible_time(
+      checker, q1, t_max_to_check, std::max({time_lb, t0 + dt_max_vel}));
+
+  const uint max_delta = 10;
+  const uint max_iter = 10;
+  TaskPart tp = roadmap->plan(checker, t0, q0, q1, t_earliest_feas,
+                              t_earliest_feas + max_delta * max_iter);
+
+  const auto end_time = std::chrono::high_resolution_clock::now();
+  const auto duration =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time -
+                                                            start_time)
+          .count();
+
+  tp.stats = ComputeStatistics();
+  tp.stats.rrt_plan_time = duration;
+
+  if (!tp.has_solution) {
+    return tp;
+  }
+
+  const bool should_shortcut = rai::getParameter<bool>("shortcutting", true);
+  if (should_shortcut && tp.path.d0 > 2) {
+    const auto shortcut_start_time = std::chrono::high_resolution_clock::now();
+    const arr new_path = partial_spacetime_shortcut(TP, tp.path, t0, &checker);
+
+    // only use the shortcut path if it is still feasible
+    bool feasible = true;
+    for (uint i = 0; i < new_path.d0; ++i) {
+      if (!checker.is_feasible(new_path[i], tp.t(i))) {
+        feasible = false;
+        break;
+      }
+    }
+    if (feasible) {
+      tp.path = new_path;
+    }
+
+    const auto shortcut_end_time = std::chrono::high_resolution_clock::now();
+    tp.stats.rrt_shortcut_time =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            shortcut_end_time - shortcut_start_time)
+            .count();
+  }
+
+  spdlog::info("Roadmap final time at {}", tp.t(-1));
+
+  return tp;
+}
+
 // policy should have other inputs:
 // policy(start_pos, end_pos, robot, mode)
 void run_waiting_policy(TaskPart &path, const uint lower = 5, const uint upper = 15){
@@ -794,8 +910,18 @@ TaskPart plan_in_animation(TimedConfigurationProblem &TP,
   // run rrt
   // TP.C.fcl()->stopEarly = false;
 
-  TaskPart rrt_path = plan_in_animation_rrt(TP, t0, q0, q1, time_lb, r);
-  rrt_path.algorithm = "rrt";
+  // the roadmap is tried first if it is enabled, and we fall back to the rrt
+  // if it does not find a path
+  TaskPart rrt_path;
+  if (global_params.use_roadmap) {
+    rrt_path = plan_in_animation_roadmap(TP, t0, q0, q1, time_lb, r);
+    rrt_path.algorithm = "roadmap";
+  }
+
+  if (!rrt_path.has_solution) {
+    rrt_path = plan_in_animation_rrt(TP, t0, q0, q1, time_lb, r);
+    rrt_path.algorithm = "rrt";
+  }
 
   // add waiting times for grabbing
   // TODO: sample from actual ststistical model
@@ -953,6 +1079,7 @@ class PrioritizedTaskPlanner {
 
       const auto pairs = get_cant_collide_pairs(TP.C);
       TP.C.fcl()->deactivatePairs(pairs);
+      deactivate_out_of_reach_pairs(TP.C, home_poses);
       TP.C.fcl()->stopEarly = global_params.use_early_coll_check_stopping;
       TP.activeOnly = true;
 
@@ -1065,7 +1192,7 @@ class PrioritizedTaskPlanner {
 
             // add obj. frame to the anim-part.
             bool tmp = false;
-            for (auto a: A.A){
+            for (const auto &a: A.A){
               if (a.frameNames.contains(STRING("obj" << rtp.task.object + 1))){
                 tmp = true;
                 break;
@@ -1521,7 +1648,7 @@ class PrioritizedTaskPlanner {
         //   rai::Animation A;
         //   for (const auto &p : paths) {
         //     for (const auto &path : p.second) {
-        //       A.A.append(path.anim);
+        //       A.A.append(*path.anim);
         //     }
         //   }
 
@@ -1600,7 +1727,7 @@ class PrioritizedTaskPlanner {
           } else {
             setActive(CPlanner, robot);
             // start_pose = CPlanner.getJointState();
-            start_pose = robot.start_pose;
+            start_pose = robot.start_pose.get();
             // CPlanner.watch(true);
             start_time = 0;
 
@@ -1682,7 +1809,7 @@ class PrioritizedTaskPlanner {
             auto tmp_frames = robot_frames.at(robot);
             // add obj. frame to the anim-part.
             bool tmp = false;
-            for (auto a: A.A){
+            for (const auto &a: A.A){
               if (a.frameNames.contains(STRING("obj" << task + 1))){
                 tmp = true;
                 break;
@@ -1798,11 +1925,13 @@ class PrioritizedTaskPlanner {
 // }
 
 PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
-    rai::Configuration C, const RobotTaskPoseMap &rtpm,
+    const ConfigurationHandle &C, const RobotTaskPoseMap &rtpm,
     const OrderedTaskSequence &sequence, const uint start_index,
-    const Plan prev_plan, const std::unordered_map<Robot, arr> &home_poses,
+    const PlanHandle &prev_plan,
+    const std::unordered_map<Robot, arr> &home_poses,
     const uint best_makespan_so_far = 1e6, const bool early_stopping = false) {
-  rai::Configuration CPlanner = C;
+  // this is the only copy of the configuration that we need, since we modify it
+  rai::Configuration CPlanner = C.get();
   // C.watch(true);
 
   // prepare planning-configuration
@@ -1824,9 +1953,9 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
 
   std::unordered_map<Robot, std::vector<TaskPart>> paths;
 
-  for (const auto &p : prev_plan) {
+  for (const auto &p : prev_plan.get()) {
     const auto r = p.first;
-    for (auto plan : p.second) {
+    for (const auto &plan : p.second) {
       if (std::find(unplanned_tasks.begin(), unplanned_tasks.end(),
                     plan.task_index) == unplanned_tasks.end()) {
         paths[r].push_back(plan);
@@ -1856,7 +1985,7 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
     // check if we want a path to the home pose at all: 
     // - at the moment, we only do this if we do not hold something.
     bool robot_holds_something = false;
-    for (const auto &c: C[STRING(robot.prefix + robot.ee_frame_name)]->children){
+    for (const auto &c: CPlanner[STRING(robot.prefix + robot.ee_frame_name)]->children){
       // std::cout << c->name << std::endl;
       if (c->name.contains("obj")){
         robot_holds_something = true;
@@ -1866,7 +1995,7 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
       continue;
     }
 
-    if (euclideanDistance(robot.start_pose, robot.home_pose) > 1e-6){
+    if (euclideanDistance(robot.start_pose.get(), robot.home_pose.get()) > 1e-6){
       spdlog::info("Planning an exit path for robot {} since it starts not at the home pose", robot.prefix);
       robot_exit_paths.push_back({robot.prefix, 0});
     }
@@ -1902,9 +2031,10 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
 
     const auto pairs = get_cant_collide_pairs(TP.C);
     TP.C.fcl()->deactivatePairs(pairs);
+    deactivate_out_of_reach_pairs(TP.C, home_poses);
     TP.C.fcl()->stopEarly = global_params.use_early_coll_check_stopping;
 
-    arr start_pose = robot.start_pose;
+    arr start_pose = robot.start_pose.get();
     int task_index = 0;
 
     if (paths.count(robot) > 0){
@@ -1941,7 +2071,7 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
       rai::Animation An;
       for (const auto &p2 : paths) {
         for (const auto path2 : p2.second) {
-          An.A.append(path2.anim);
+          An.A.append(*path2.anim);
         }
       }
       An.play(CPlanner, false);
@@ -2015,16 +2145,16 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
     }
   }
 
-  return PlanResult(PlanStatus::success, paths);
+  return PlanResult(PlanStatus::success, std::move(paths));
 }
 
 // overload (not in the literal or in the c++ sense) of the above
 PlanResult plan_multiple_arms_given_sequence(
-    rai::Configuration C, const RobotTaskPoseMap &rtpm,
+    const ConfigurationHandle &C, const RobotTaskPoseMap &rtpm,
     const OrderedTaskSequence &sequence, const std::unordered_map<Robot, arr> &home_poses,
     const uint best_makespan_so_far = 1e6, const bool early_stopping = false) {
 
-  Plan paths;
+  const PlanHandle paths;
   return plan_multiple_arms_given_subsequence_and_prev_plan(
       C, rtpm, sequence, 0, paths, home_poses, best_makespan_so_far,
       early_stopping);
@@ -0,0 +1,461 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include <Core/array.h>
+#include <Kin/kin.h>
+#include <PlanningSubroutines/ConfigurationProblem.h>
+#include <Manip/rrt-time.h>
+
+#include "plan.h"
+#include "timed_collision.h"
+#include "common/joint_kernels.h"
+
+#include "common/types.h"
+#include "common/util.h"
+#include "common/env_util.h"
+#include "common/static_sdf.h"
+
+// Roadmap for a single robot that is built once per scene against the static
+// parts of the environment (i.e. everything that is not a robot or an object).
+// Timed queries are answered by a search over (node, time) pairs, where the
+// edges are lazily checked against the animation of the other robots.
+class TimedRoadmap {
+public:
+  TimedRoadmap(const rai::Configuration &C, const Robot &_r,
+               const std::vector<Robot> &robots,
+               const std::vector<arr> &keyframes, const uint num_samples = 1000,
+               const uint _k = 10)
+      : r(_r), k(_k) {
+    rai::Configuration C_robot = C;
+    setActive(C_robot, r);
+
+    cp = std::make_unique<ConfigurationProblem>(C_robot);
+    cp->activeOnly = true;
+
+    // only check collisions of the robot with the static environment and
+    // itself
+    const uintA pairs = get_cant_collide_pairs(cp->C);
+    cp->C.fcl()->deactivatePairs(pairs);
+    cp->C.fcl()->deactivatePairs(get_non_static_pairs(cp->C, robots));
+    cp->C.fcl()->stopEarly = true;
+
+    surface_points = std::make_unique<RobotSurfacePoints>(cp->C, r);
+
+    const auto start_time = std::chrono::high_resolution_clock::now();
+
+    const arr limits = C_robot.getLimits();
+    const uint dim = C_robot.getJointState().N;
+
+    for (const arr &q : keyframes) {
+      add_node(q);
+    }
+
+    uint cnt = 0;
+    arr q(dim);
+    while (nodes.size() < keyframes.size() + num_samples &&
+           cnt < 10 * num_samples) {
+      ++cnt;
+      for (uint i = 0; i < dim; ++i) {
+        double lo = -RAI_PI;
+        double hi = RAI_PI;
+        if (limits.d0 == dim && limits(i, 1) > limits(i, 0)) {
+          lo = limits(i, 0);
+          hi = limits(i, 1);
+        }
+        q(i) = rnd.uni(lo, hi);
+      }
+
+      if (is_static_feasible(q)) {
+        add_node(q);
+      }
+    }
+
+    const auto end_time = std::chrono::high_resolution_clock::now();
+    const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              end_time - start_time)
+                              .count();
+    spdlog::info("Built roadmap for {} with {} nodes in {}ms", r.prefix,
+                 nodes.size(), duration);
+  }
+
+  // plans a path from q0 at time t0 to q1, arriving not earlier than
+  // t_goal_min and not later than t_max. Returns an empty TaskPart if no
+  // path is found in the roadmap.
+  // Start and goal poses that are not in the roadmap yet are only added for
+  // this query. Otherwise, the roadmap (and with it the linear node lookup and
+  // neighbour search) would grow with every query of a long search.
+  TaskPart plan(TimedCollisionChecker &checker, const uint t0, const arr &q0,
+                const arr &q1, const uint t_goal_min, const uint t_max,
+                const uint max_expansions = 20000) {
+    const uint num_nodes = nodes.size();
+
+    const uint start = find_or_add_node(q0);
+    const uint goal = find_or_add_node(q1);
+
+    TaskPart res;
+    if (start != invalid_node && goal != invalid_node) {
+      res = search(checker, t0, start, goal, t_goal_min, t_max,
+                   max_expansions);
+    }
+
+    remove_nodes(num_nodes);
+    return res;
+  }
+
+  std::size_t size() const { return nodes.size(); }
+  uint dim() const { return nodes.size() > 0 ? nodes[0].N : 0; }
+
+private:
+  enum class EdgeStatus { unknown, free, blocked };
+
+  struct Edge {
+    uint to;
+    uint steps;
+    EdgeStatus status;
+  };
+
+  static constexpr uint invalid_node = std::numeric_limits<uint>::max();
+
+  TaskPart search(TimedCollisionChecker &checker, const uint t0,
+                  const uint start, const uint goal, const uint t_goal_min,
+                  const uint t_max, const uint max_expansions) {
+    struct SearchNode {
+      uint node;
+      uint t;
+      uint f;
+      bool operator>(const SearchNode &o) const { return f > o.f; }
+    };
+
+    // key: (node, time), value: key of the predecessor
+    std::unordered_map<uint64_t, uint64_t> parents;
+    std::priority_queue<SearchNode, std::vector<SearchNode>,
+                        std::greater<SearchNode>>
+        open;
+
+    const auto make_key = [](const uint node, const uint t) {
+      return (uint64_t(node) << 32) | t;
+    };
+
+    parents[make_key(start, t0)] = make_key(start, t0);
+    open.push({start, t0, t0 + steps_between(nodes[start], nodes[goal])});
+
+    uint expansions = 0;
+    while (!open.empty() && expansions < max_expansions) {
+      const SearchNode current = open.top();
+      open.pop();
+      ++expansions;
+
+      if (current.node == goal && current.t >= t_goal_min) {
+        spdlog::info("Roadmap found path after {} expansions", expansions);
+        return reconstruct(parents, make_key(current.node, current.t), t0);
+      }
+
+      // wait in place
+      if (current.t + 1 <= t_max &&
+          parents.count(make_key(current.node, current.t + 1)) == 0 &&
+          checker.is_feasible(nodes[current.node], current.t + 1)) {
+        parents[make_key(current.node, current.t + 1)] =
+            make_key(current.node, current.t);
+        open.push({current.node, current.t + 1,
+                   current.t + 1 +
+                       steps_between(nodes[current.node], nodes[goal])});
+      }
+
+      for (auto &e : edges[current.node]) {
+        const uint t_next = current.t + e.steps;
+        if (t_next > t_max || parents.count(make_key(e.to, t_next)) > 0) {
+          continue;
+        }
+
+        // lazily check the edge against the static environment once
+        if (e.status == EdgeStatus::unknown) {
+          e.status = is_static_edge_feasible(nodes[current.node], nodes[e.to],
+                                             e.steps)
+                         ? EdgeStatus::free
+                         : EdgeStatus::blocked;
+          set_reverse_edge_status(e.to, current.node, e.status);
+        }
+        if (e.status == EdgeStatus::blocked) {
+          continue;
+        }
+
+        if (!is_timed_edge_feasible(checker, nodes[current.node], nodes[e.to],
+                                    current.t, e.steps)) {
+          continue;
+        }
+
+        parents[make_key(e.to, t_next)] = make_key(current.node, current.t);
+        open.push({e.to, t_next,
+                   t_next + steps_between(nodes[e.to], nodes[goal])});
+      }
+    }
+
+    spdlog::info("Roadmap search failed after {} expansions", expansions);
+    return TaskPart();
+  }
+
+  // pairs between the frames of this robot and all robots and objects
+  uintA get_non_static_pairs(const rai::Configuration &C,
+                             const std::vector<Robot> &robots) const {
+    FrameL own;
+    FrameL others;
+    for (const auto f : C.frames) {
+      if (f->name.contains("obj")) {
+        others.append(f);
+        continue;
+      }
+
+      for (const auto &other : robots) {
+        if (std::string(f->name.p).rfind(other.prefix, 0) == 0) {
+          if (other == r) {
+            own.append(f);
+          } else {
+            others.append(f);
+          }
+          break;
+        }
+      }
+    }
+
+    uintA pairs;
+    for (const auto a : own) {
+      for (const auto b : others) {
+        pairs.append(TUP(a->ID, b->ID));
+      }
+    }
+    pairs.reshape(-1, 2);
+
+    return pairs;
+  }
+
+  uint steps_between(const arr &q0, const arr &q1) const {
+    return std::max(1u, uint(std::ceil(abs_max_diff(q1, q0) / r.vmax)));
+  }
+
+  bool is_static_feasible(const arr &q) {
+    // cheap rejection of samples that are inside of the static scene
+    const StaticSceneSDF &sdf = StaticSceneSDF::instance();
+    if (sdf.is_valid()) {
+      cp->C.setJointState(q);
+      if (surface_points->is_inside_static_scene(cp->C, sdf)) {
+        return false;
+      }
+    }
+
+    return cp->query(q)->isFeasible;
+  }
+
+  bool is_static_edge_feasible(const arr &q0, const arr &q1,
+                               const uint steps) {
+    for (uint i = 1; i < steps; ++i) {
+      const arr q = q0 + (q1 - q0) * (1. * i / steps);
+      if (!is_static_feasible(q)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool is_timed_edge_feasible(TimedCollisionChecker &checker, const arr &q0,
+                              const arr &q1, const uint t0, const uint steps) {
+    for (uint i = 1; i <= steps; ++i) {
+      const arr q = q0 + (q1 - q0) * (1. * i / steps);
+      if (!checker.is_feasible(q, t0 + i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void set_reverse_edge_status(const uint from, const uint to,
+                               const EdgeStatus status) {
+    for (auto &e : edges[from]) {
+      if (e.to == to) {
+        e.status = status;
+        return;
+      }
+    }
+  }
+
+  // connects the new node to its k nearest neighbours
+  uint add_node(const arr &q) {
+    const uint id = nodes.size();
+
+    std::vector<std::pair<double, uint>> dists;
+    dists.reserve(nodes.size());
+    for (uint i = 0; i < nodes.size(); ++i) {
+      dists.push_back({abs_max_diff(nodes[i], q), i});
+    }
+
+    const uint num_neighbours = std::min<uint>(k, dists.size());
+    std::partial_sort(dists.begin(), dists.begin() + num_neighbours,
+                      dists.end());
+
+    nodes.push_back(q);
+    edges.push_back({});
+
+    for (uint i = 0; i < num_neighbours; ++i) {
+      const uint other = dists[i].second;
+      const uint steps = steps_between(q, nodes[other]);
+      edges[id].push_back({other, steps, EdgeStatus::unknown});
+      edges[other].push_back({id, steps, EdgeStatus::unknown});
+    }
+
+    return id;
+  }
+
+  // removes the nodes that were added after the first num_nodes, and the
+  // edges to them. Since they were added last, the edges to them are at the
+  // end of the edge lists of their neighbours.
+  void remove_nodes(const uint num_nodes) {
+    for (uint i = num_nodes; i < nodes.size(); ++i) {
+      for (const auto &e : edges[i]) {
+        auto &other = edges[e.to];
+        while (!other.empty() && other.back().to >= num_nodes) {
+          other.pop_back();
+        }
+      }
+    }
+    nodes.resize(num_nodes);
+    edges.resize(num_nodes);
+  }
+
+  uint find_or_add_node(const arr &q) {
+    for (uint i = 0; i < nodes.size(); ++i) {
+      if (abs_max_diff(nodes[i], q) < 1e-6) {
+        return i;
+      }
+    }
+
+    // the keyframes are in the roadmap already, other poses are added for the
+    // current query only, see plan()
+    if (!is_static_feasible(q)) {
+      spdlog::warn("Pose not feasible in static environment, can not add it "
+                   "to the roadmap.");
+      return invalid_node;
+    }
+    return add_node(q);
+  }
+
+  TaskPart reconstruct(const std::unordered_map<uint64_t, uint64_t> &parents,
+                       uint64_t key, const uint t0) const {
+    std::vector<uint64_t> keys;
+    while (true) {
+      keys.push_back(key);
+      const uint64_t parent = parents.at(key);
+      if (parent == key) {
+        break;
+      }
+      key = parent;
+    }
+    std::reverse(keys.begin(), keys.end());
+
+    const uint t_end = uint(keys.back() & 0xFFFFFFFF);
+    const uint dim = nodes[0].N;
+
+    arr t(t_end - t0 + 1);
+    arr path(t_end - t0 + 1, dim);
+    for (uint i = 0; i < t.N; ++i) {
+      t(i) = t0 + i;
+    }
+
+    path[0] = nodes[uint(keys[0] >> 32)];
+    for (uint i = 1; i < keys.size(); ++i) {
+      const uint n0 = uint(keys[i - 1] >> 32);
+      const uint n1 = uint(keys[i] >> 32);
+      const uint t_start = uint(keys[i - 1] & 0xFFFFFFFF);
+      const uint steps = uint(keys[i] & 0xFFFFFFFF) - t_start;
+      for (uint j = 1; j <= steps; ++j) {
+        path[t_start - t0 + j] =
+            nodes[n0] + (nodes[n1] - nodes[n0]) * (1. * j / steps);
+      }
+    }
+
+    return TaskPart(t, path);
+  }
+
+  Robot r;
+  uint k;
+
+  // collision checks against the static environment only
+  std::unique_ptr<ConfigurationProblem> cp;
+  std::unique_ptr<RobotSurfacePoints> surface_points;
+
+  std::vector<arr> nodes;
+  std::vector<std::vector<Edge>> edges;
+};
+
+// roadmaps of the current scene, one per robot.
+class RoadmapRegistry {
+public:
+  static RoadmapRegistry &instance() {
+    static RoadmapRegistry registry;
+    return registry;
+  }
+
+  // builds the roadmaps for all robots, and connects the keyframes of the
+  // robot_task_pose_map and the home poses to them.
+  void build(const rai::Configuration &C, const std::vector<Robot> &robots,
+             const RobotTaskPoseMap &rtpm,
+             const std::unordered_map<Robot, arr> &home_poses,
+             const uint num_samples = 1000) {
+    std::lock_guard<std::mutex> lock(m);
+    roadmaps.clear();
+
+    for (const auto &r : robots) {
+      if (home_poses.count(r) == 0) {
+        spdlog::error("No home pose for robot {}, not building a roadmap.",
+                      r.prefix);
+        continue;
+      }
+
+      std::vector<arr> keyframes{home_poses.at(r)};
+
+      // keyframes that involve more than one robot are planned jointly, and
+      // are thus not part of the single robot roadmap.
+      for (const auto &entry : rtpm) {
+        if (entry.first.robots.size() != 1 || entry.first.robots[0] != r) {
+          continue;
+        }
+        for (const auto &poses : entry.second) {
+          for (const auto &q : poses) {
+            if (q.N == home_poses.at(r).N) {
+              keyframes.push_back(q);
+            }
+          }
+        }
+      }
+
+      roadmaps[r] = std::make_shared<TimedRoadmap>(C, r, robots, keyframes,
+                                                   num_samples);
+    }
+  }
+
+  std::shared_ptr<TimedRoadmap> get(const Robot &r) {
+    std::lock_guard<std::mutex> lock(m);
+    if (roadmaps.count(r) == 0) {
+      return nullptr;
+    }
+    return roadmaps.at(r);
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(m);
+    roadmaps.clear();
+  }
+
+private:
+  RoadmapRegistry(){};
+
+  std::mutex m;
+  std::unordered_map<Robot, std::shared_ptr<TimedRoadmap>> roadmaps;
+};
@@ -0,0 +1,384 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include <Core/array.h>
+#include <Kin/kin.h>
+#include <PlanningSubroutines/Animation.h>
+#include <PlanningSubroutines/ConfigurationProblem.h>
+
+#include "common/types.h"
+#include "common/config.h"
+#include "common/static_sdf.h"
+
+// axis aligned bounding box
+struct AABB {
+  double lo[3]{1e10, 1e10, 1e10};
+  double hi[3]{-1e10, -1e10, -1e10};
+
+  bool empty() const { return lo[0] > hi[0]; }
+
+  void add(const AABB &o) {
+    for (uint i = 0; i < 3; ++i) {
+      lo[i] = std::min(lo[i], o.lo[i]);
+      hi[i] = std::max(hi[i], o.hi[i]);
+    }
+  }
+
+  void add(const double *p, const double radius) {
+    for (uint i = 0; i < 3; ++i) {
+      lo[i] = std::min(lo[i], p[i] - radius);
+      hi[i] = std::max(hi[i], p[i] + radius);
+    }
+  }
+
+  bool intersects_sphere(const double *c, const double radius) const {
+    if (empty()) {
+      return false;
+    }
+
+    double dist_sq = 0;
+    for (uint i = 0; i < 3; ++i) {
+      const double d = std::max({lo[i] - c[i], 0., c[i] - hi[i]});
+      dist_sq += d * d;
+    }
+    return dist_sq <= radius * radius;
+  }
+};
+
+// conservative radius of a sphere around the frame origin that contains the
+// shape of the frame
+double get_bounding_radius(rai::Frame *f) {
+  if (!f->shape) {
+    return 0.;
+  }
+
+  rai::Shape &shape = f->getShape();
+  const arr &V = shape.mesh().V;
+  if (V.d0 > 0) {
+    double max_sq = 0;
+    for (uint i = 0; i < V.d0; ++i) {
+      max_sq = std::max(max_sq, V(i, 0) * V(i, 0) + V(i, 1) * V(i, 1) +
+                                    V(i, 2) * V(i, 2));
+    }
+    return std::sqrt(max_sq);
+  }
+
+  const arr &size = shape.size;
+  if (size.N == 1) {
+    return size(0);
+  }
+  if (size.N >= 3) {
+    const double half_diag =
+        0.5 * std::sqrt(size(0) * size(0) + size(1) * size(1) +
+                        size(2) * size(2));
+    return half_diag + (size.N > 3 ? size(3) : 0.);
+  }
+
+  // unknown shape, stay on the safe side
+  return 0.5;
+}
+
+// segment tree over the timesteps of an animation part, where each node
+// stores the bounding box of all (collidable) frames of the part over the
+// timesteps it covers.
+class TemporalBVH {
+public:
+  TemporalBVH(const rai::Animation::AnimationPart &part,
+              const std::vector<uint> &frame_indices,
+              const std::vector<double> &radii, const AABB &initial)
+      : start(part.start), num_steps(part.X.d0), initial_box(initial) {
+    size = 1;
+    while (size < num_steps) {
+      size *= 2;
+    }
+    nodes.resize(2 * size);
+
+    for (uint t = 0; t < num_steps; ++t) {
+      AABB &box = nodes[size + t];
+      for (uint k = 0; k < frame_indices.size(); ++k) {
+        box.add(&part.X(t, frame_indices[k], 0), radii[k]);
+      }
+    }
+
+    for (uint i = size - 1; i > 0; --i) {
+      nodes[i] = nodes[2 * i];
+      nodes[i].add(nodes[2 * i + 1]);
+    }
+  }
+
+  // bounding box of the frames over the time window [t0, t1] (absolute times)
+  AABB get_box(const uint t0, const uint t1) const {
+    AABB box;
+    if (num_steps == 0) {
+      return box;
+    }
+
+    // before the start of the part, the frames are not set by this part, and
+    // might be in their initial state, or at any other state of the part.
+    if (t0 < start) {
+      box.add(initial_box);
+      box.add(nodes[1]);
+      return box;
+    }
+
+    // after the end, the frames stay at the last state
+    const uint end = start + num_steps - 1;
+    const uint a = std::min(t0, end) - start;
+    const uint b = std::min(t1, end) - start;
+
+    return query(a, b);
+  }
+
+private:
+  AABB query(uint a, uint b) const {
+    AABB box;
+    a += size;
+    b += size + 1;
+    while (a < b) {
+      if (a & 1) {
+        box.add(nodes[a++]);
+      }
+      if (b & 1) {
+        box.add(nodes[--b]);
+      }
+      a /= 2;
+      b /= 2;
+    }
+    return box;
+  }
+
+  uint start;
+  uint num_steps;
+  uint size;
+
+  AABB initial_box;
+
+  std::vector<AABB> nodes;
+};
+
+// Wraps the queries of a TimedConfigurationProblem for a single active robot.
+// If no animated frame can reach the workspace of the active robot at time t
+// (checked with the temporal bvh), the result only depends on the static parts
+// of the scene, and is cached per configuration.
+// Additionally, the animation is set incrementally: only the parts whose
+// sample changed since the last query are written to the configuration.
+// This assumes that nobody else changes TP.C in between, i.e. invalidate()
+// has to be called after using TP directly.
+class TimedCollisionChecker {
+public:
+  TimedCollisionChecker(TimedConfigurationProblem &_TP, const Robot &r,
+                        const double margin = 0.1)
+      : TP(_TP) {
+    setup_incremental_animation();
+
+    // independent of the temporal bvh below. Only the frames of r are
+    // checked, which is also valid if more robots are active.
+    if (StaticSceneSDF::instance().is_valid()) {
+      surface_points = std::make_unique<RobotSurfacePoints>(TP.C, r);
+    }
+
+    if (!global_params.use_temporal_bvh) {
+      return;
+    }
+
+    // only single robot queries are supported
+    if (TP.C.getJointState().N != r.home_pose.get().N) {
+      return;
+    }
+
+    rai::Frame *base = TP.C.getFrame(STRING(r.prefix << "base"), false);
+    if (!base) {
+      return;
+    }
+
+    const arr base_pos = base->getPosition();
+    for (uint i = 0; i < 3; ++i) {
+      center[i] = base_pos(i);
+    }
+    radius = get_workspace_from_robot_type(r.type) + margin;
+
+    for (const auto &part : TP.A.A) {
+      std::vector<uint> frame_indices;
+      std::vector<double> radii;
+      AABB initial;
+      for (uint k = 0; k < part.frameIDs.N; ++k) {
+        rai::Frame *f = TP.C.frames(part.frameIDs(k));
+
+        // the frames of the active robot are set from the query
+        if (f->name.startsWith(r.prefix.c_str())) {
+          continue;
+        }
+        if (!f->shape || f->getShape().cont == 0) {
+          continue;
+        }
+
+        frame_indices.push_back(k);
+        radii.push_back(get_bounding_radius(f));
+
+        const arr pos = f->getPosition();
+        initial.add(pos.p, radii.back());
+      }
+
+      if (frame_indices.size() > 0) {
+        bvhs.emplace_back(part, frame_indices, radii, initial);
+      }
+    }
+
+    enabled = true;
+  }
+
+  // true if no animated frame can get close to the active robot in [t0, t1]
+  bool is_window_free(const uint t0, const uint t1) const {
+    if (!enabled) {
+      return false;
+    }
+
+    for (const auto &bvh : bvhs) {
+      if (bvh.get_box(t0, t1).intersects_sphere(center, radius)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool is_feasible(const arr &q, const double t) {
+    // cheap rejection of configurations that are inside of the static scene
+    if (surface_points) {
+      TP.C.setJointState(q);
+      if (surface_points->is_inside_static_scene(TP.C,
+                                                 StaticSceneSDF::instance())) {
+        return false;
+      }
+    }
+
+    if (!is_window_free(uint(std::floor(t)), uint(std::ceil(t)))) {
+      return query(q, t);
+    }
+
+    std::string key(reinterpret_cast<const char *>(q.p),
+                    q.N * sizeof(double));
+    const auto it = static_results.find(key);
+    if (it != static_results.end()) {
+      return it->second;
+    }
+
+    const bool feasible = query(q, t);
+    static_results[key] = feasible;
+    return feasible;
+  }
+
+  // the configuration was changed from outside, the next query sets the full
+  // animation again
+  void invalidate() { animation_is_set = false; }
+
+private:
+  void setup_incremental_animation() {
+    const uint num_parts = TP.A.A.N;
+    part_frames.resize(num_parts);
+    current_samples.assign(num_parts, -1);
+    earlier_overlapping_parts.resize(num_parts);
+
+    // parts that are applied later overwrite the frames of earlier ones,
+    // so they have to be set again if an earlier one with the same frames
+    // changed
+    std::unordered_map<uint, std::vector<uint>> parts_of_frame;
+    for (uint i = 0; i < num_parts; ++i) {
+      part_frames[i] = TP.C.getFrames(TP.A.A(i).frameIDs);
+
+      auto &earlier = earlier_overlapping_parts[i];
+      for (const uint id : TP.A.A(i).frameIDs) {
+        auto &parts = parts_of_frame[id];
+        earlier.insert(earlier.end(), parts.begin(), parts.end());
+        parts.push_back(i);
+      }
+      std::sort(earlier.begin(), earlier.end());
+      earlier.erase(std::unique(earlier.begin(), earlier.end()), earlier.end());
+    }
+  }
+
+  // index of the sample of the part that is set at time t, -1 if the part
+  // did not start yet.
+  int get_sample(const uint i, const uint t) const {
+    const auto &part = TP.A.A(i);
+    if (part.X.d0 == 0 || t < part.start) {
+      return -1;
+    }
+    return std::min<int>(t - part.start, part.X.d0 - 1);
+  }
+
+  bool query(const arr &q, const double t) {
+    if (!global_params.incremental_animation ||
+        TP.A.prePlannedFrames.N != 0 || t != std::floor(t)) {
+      animation_is_set = false;
+      return TP.query(q, t)->isFeasible;
+    }
+
+    const uint num_parts = TP.A.A.N;
+    if (!animation_is_set) {
+      TP.A.setToTime(TP.C, t);
+      for (uint i = 0; i < num_parts; ++i) {
+        current_samples[i] = get_sample(i, t);
+      }
+      animation_is_set = true;
+    } else {
+      // when going back in time, a part can end up not started anymore. It
+      // then leaves its frames untouched, i.e. they have to be set by the
+      // earlier parts with the same frames again, as setToTime would do.
+      // This continues through earlier parts that did not start either.
+      std::vector<bool> force_update(num_parts, false);
+      for (uint i = num_parts; i-- > 0;) {
+        if (get_sample(i, t) == -1 &&
+            (current_samples[i] != -1 || force_update[i])) {
+          for (const uint j : earlier_overlapping_parts[i]) {
+            force_update[j] = true;
+          }
+        }
+      }
+
+      std::vector<bool> was_set(num_parts, false);
+      for (uint i = 0; i < num_parts; ++i) {
+        const int sample = get_sample(i, t);
+
+        // parts that did not start yet leave their frames untouched
+        bool needs_update =
+            sample != -1 && (sample != current_samples[i] || force_update[i]);
+        for (const uint j : earlier_overlapping_parts[i]) {
+          if (sample != -1 && was_set[j]) {
+            needs_update = true;
+            break;
+          }
+        }
+
+        if (needs_update) {
+          TP.C.setFrameState(TP.A.A(i).X[sample], part_frames[i]);
+          was_set[i] = true;
+        }
+        current_samples[i] = sample;
+      }
+    }
+
+    return TP.ConfigurationProblem::query(q)->isFeasible;
+  }
+
+  TimedConfigurationProblem &TP;
+
+  bool animation_is_set = false;
+  std::vector<FrameL> part_frames;
+  std::vector<int> current_samples;
+  std::vector<std::vector<uint>> earlier_overlapping_parts;
+
+  bool enabled = false;
+  double center[3]{0, 0, 0};
+  double radius = 0;
+
+  std::vector<TemporalBVH> bvhs;
+  std::unique_ptr<RobotSurfacePoints> surface_points;
+  std::unordered_map<std::string, bool> static_results;
+};
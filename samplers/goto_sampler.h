@@ -7,6 +7,7 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 #include "common/util.h"
+#include "samplers/reachability.h"
 
 class GoToSampler {
 public:
@@ -36,9 +37,7 @@ public:
     const arr goal_pos = C[goal]->getPosition();
     const arr r1_pos = C[STRING(r << "base")]->getPosition();
 
-    // TODO: solve subproblems to check for feasibility.
-    // For now: hardcode the radius of the ur5
-    if (euclideanDistance(goal_pos, r1_pos) > 1.) {
+    if (!is_reachable(C, r, goal_pos)) {
       spdlog::info("Skipping goto keyframe copmutation for obj {} and "
                    "robots {}",
                    goal.p, r.prefix);
@@ -10,17 +10,17 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 
+#include "samplers/komo_template.h"
 #include "samplers/pick_constraints.h"
+#include "samplers/multistart.h"
+#include "samplers/seed_bank.h"
 
 // TODO: unify the two things
 // - reduce code duplication of actual solver and subproblem
 std::vector<arr> solve_subproblem(rai::Configuration &C, Robot r1, Robot r2,
-                                  rai::String obj, rai::String goal) {
+                                  rai::String obj, rai::String goal,
+                                  KomoTemplateCache &templates) {
   spdlog::info("Solving subproblem for handover");
-  std::unordered_map<Robot, FrameL> robot_frames;
-  for (const auto &r : {r1, r2}) {
-    robot_frames[r] = get_robot_joints(C, r);
-  }
 
   // C.watch(true);
   OptOptions options;
@@ -34,7 +34,6 @@ std::vector<arr> solve_subproblem(rai::Configuration &C, Robot r1, Robot r2,
 
   // options.maxStep = 1;
 
-  ConfigurationProblem cp(C);
   const arr obj_pos = C[obj]->getPosition();
   const arr goal_pos = C[goal]->getPosition();
 
@@ -43,169 +42,189 @@ std::vector<arr> solve_subproblem(rai::Configuration &C, Robot r1, Robot r2,
 
   const auto link_to_frame = STRING("table");
 
-  KOMO komo;
-  // komo.verbose = 5;
-  komo.verbose = 0;
-  komo.setModel(C, true);
-  // komo.animateOptimization = 5;
+  const KeyframeSeed seed(C, "handover_pick", {r1, r2}, obj, {},
+                          {obj_pos, goal_pos, r2_pos});
 
-  // komo.world.fcl()->deactivatePairs(pairs);
-  // komo.pathConfig.fcl()->stopEarly = true;
+  const std::string template_key =
+      std::string("handover_pick;") + r1.prefix + ";" + r2.prefix + ";" +
+      get_shape_key(C[obj]) + ";" + get_shape_key(C[goal]);
 
-  komo.setDiscreteOpt(2);
+  const uint max_attempts = 10;
+  const KeyframeAttempt attempt = [&](const uint j, rai::Configuration &C,
+                                      const arr &noise,
+                                      std::mt19937 &rng) -> std::vector<arr> {
+    // the frames of the configuration of this restart
+    std::unordered_map<Robot, FrameL> robot_frames;
+    for (const auto &r : {r1, r2}) {
+      robot_frames[r] = get_robot_joints(C, r);
+    }
+    ConfigurationProblem cp(C);
 
-  // komo.add_collision(true, .05, 1e1);
-  komo.add_collision(true, .1, 1e1);
+    const auto r1_pen_tip = STRING(r1 << r1.ee_frame_name);
+    const auto r2_pen_tip = STRING(r2 << r2.ee_frame_name);
 
-  komo.add_jointLimits(true, 0., 1e1);
-  komo.addSquaredQuaternionNorms();
+    const double r1_z_rot = C[STRING(r1 << "base")]->get_X().rot.getEulerRPY()(2);
+    const double r2_z_rot = C[STRING(r2 << "base")]->get_X().rot.getEulerRPY()(2);
 
-  const auto r1_pen_tip = STRING(r1 << r1.ee_frame_name);
-  const auto r2_pen_tip = STRING(r2 << r2.ee_frame_name);
+    const double r1_obj_angle =
+        std::atan2(obj_pos(1) - r1_pos(1), obj_pos(0) - r1_pos(0)) - r1_z_rot;
+    const double r1_r2_angle =
+        std::atan2(r2_pos(1) - r1_pos(1), r2_pos(0) - r1_pos(0)) - r1_z_rot;
+    const double r2_r1_angle =
+        std::atan2(r1_pos(1) - r2_pos(1), r1_pos(0) - r2_pos(0)) - r2_z_rot;
 
-  const double r1_z_rot = C[STRING(r1 << "base")]->get_X().rot.getEulerRPY()(2);
-  const double r2_z_rot = C[STRING(r2 << "base")]->get_X().rot.getEulerRPY()(2);
+    // the problem is only set up once for all restarts, see
+    // samplers/komo_template.h
+    const KomoBuilder build = [&](KOMO &komo, const bool collisions) {
+      // komo.verbose = 5;
+      komo.verbose = 0;
+      komo.setModel(C, true);
+      // komo.animateOptimization = 5;
 
-  const double r1_obj_angle =
-      std::atan2(obj_pos(1) - r1_pos(1), obj_pos(0) - r1_pos(0)) - r1_z_rot;
-  const double r1_r2_angle =
-      std::atan2(r2_pos(1) - r1_pos(1), r2_pos(0) - r1_pos(0)) - r1_z_rot;
-  const double r2_r1_angle =
-      std::atan2(r1_pos(1) - r2_pos(1), r1_pos(0) - r2_pos(0)) - r2_z_rot;
+      // komo.world.fcl()->deactivatePairs(pairs);
+      // komo.pathConfig.fcl()->stopEarly = true;
 
-  Skeleton S = {
-      // {1., 2., SY_touch, {r1_pen_tip, obj}},
-      {1., 2, SY_stable, {r1_pen_tip, obj}},
-      // {2., -1., SY_touch, {r2_pen_tip, obj}},
-      // {2., 3., SY_stable, {r2_pen_tip, obj}},
-      // {3., -1, SY_poseEq, {obj, goal}},
-      // {3., -1, SY_positionEq, {obj, goal}}
-      // {3., -1, SY_stable, {obj, goal}},
-  };
+      komo.setDiscreteOpt(2);
 
-  komo.setSkeleton(S);
+      // komo.add_collision(true, .05, 1e1);
+      if (collisions) {
+        komo.add_collision(true, .1, 1e1);
+      }
 
-  const double offset = 0.1;
-  komo.addObjective({2., 2.}, FS_distance, {link_to_frame, obj}, OT_ineq, {1e0},
-                    {-offset});
+      komo.add_jointLimits(true, 0., 1e1);
+      komo.addSquaredQuaternionNorms();
 
-  // komo.addObjective({1., 1.}, FS_aboveBox, {obj, r1_pen_tip}, OT_ineq, {1e2},
-  // {0.0, 0.0, 0.0, 0.0}); komo.addObjective({2., 2.}, FS_aboveBox, {obj,
-  // r2_pen_tip}, OT_ineq, {1e2}, {0.1, 0.1, 0.1, 0.1});
+      Skeleton S = {
+          // {1., 2., SY_touch, {r1_pen_tip, obj}},
+          {1., 2, SY_stable, {r1_pen_tip, obj}},
+          // {2., -1., SY_touch, {r2_pen_tip, obj}},
+          // {2., 3., SY_stable, {r2_pen_tip, obj}},
+          // {3., -1, SY_poseEq, {obj, goal}},
+          // {3., -1, SY_positionEq, {obj, goal}}
+          // {3., -1, SY_stable, {obj, goal}},
+      };
 
-  komo.addObjective({1., 1.}, FS_positionDiff, {r1_pen_tip, obj}, OT_sos,
-                    {1e0});
-  komo.addObjective({2., 2.}, FS_positionDiff, {r2_pen_tip, obj}, OT_sos,
-                    {1e0});
+      komo.setSkeleton(S);
 
-  komo.addObjective({1., 1.}, FS_insideBox, {r1_pen_tip, obj}, OT_ineq, {5e1});
-  komo.addObjective({2., 2.}, FS_insideBox, {r2_pen_tip, obj}, OT_ineq, {5e1});
+      const double offset = 0.1;
+      komo.addObjective({2., 2.}, FS_distance, {link_to_frame, obj}, OT_ineq, {1e0},
+                        {-offset});
 
-  // const double margin = 0.1;
-  // komo.addObjective({1., 1.}, FS_positionDiff, {r1_pen_tip, STRING(obj)},
-  //                   OT_ineq, {-1e1}, {-margin, -margin, -margin});
+      // komo.addObjective({1., 1.}, FS_aboveBox, {obj, r1_pen_tip}, OT_ineq, {1e2},
+      // {0.0, 0.0, 0.0, 0.0}); komo.addObjective({2., 2.}, FS_aboveBox, {obj,
+      // r2_pen_tip}, OT_ineq, {1e2}, {0.1, 0.1, 0.1, 0.1});
 
-  // komo.addObjective({1., 1.}, FS_positionDiff, {r1_pen_tip, STRING(obj)},
-  //             OT_ineq, {1e1}, {margin, margin, margin});
+      komo.addObjective({1., 1.}, FS_positionDiff, {r1_pen_tip, obj}, OT_sos,
+                        {1e0});
+      komo.addObjective({2., 2.}, FS_positionDiff, {r2_pen_tip, obj}, OT_sos,
+                        {1e0});
 
-  // komo.addObjective({2., 2.}, FS_positionDiff, {r2_pen_tip, STRING(obj)},
-  //                   OT_ineq, {-1e1}, {-margin, -margin, -margin});
+      komo.addObjective({1., 1.}, FS_insideBox, {r1_pen_tip, obj}, OT_ineq, {5e1});
+      komo.addObjective({2., 2.}, FS_insideBox, {r2_pen_tip, obj}, OT_ineq, {5e1});
 
-  // komo.addObjective({2., 2.}, FS_positionDiff, {r2_pen_tip, STRING(obj)},
-  //                   OT_ineq, {1e1}, {margin, margin, margin});
+      // const double margin = 0.1;
+      // komo.addObjective({1., 1.}, FS_positionDiff, {r1_pen_tip, STRING(obj)},
+      //                   OT_ineq, {-1e1}, {-margin, -margin, -margin});
 
-  komo.addObjective({1., 1.}, FS_scalarProductZZ, {obj, r1_pen_tip}, OT_sos,
-                    {1e1}, {-1.});
+      // komo.addObjective({1., 1.}, FS_positionDiff, {r1_pen_tip, STRING(obj)},
+      //             OT_ineq, {1e1}, {margin, margin, margin});
 
-  komo.addObjective({2., 2.}, FS_scalarProductZZ, {obj, r2_pen_tip}, OT_sos,
-                    {1e1}, {-1.});
+      // komo.addObjective({2., 2.}, FS_positionDiff, {r2_pen_tip, STRING(obj)},
+      //                   OT_ineq, {-1e1}, {-margin, -margin, -margin});
 
-  // komo.addObjective({1.}, FS_scalarProductYX, {obj, r1_pen_tip},
-  //                   OT_sos, {1e0}, {1.});
+      // komo.addObjective({2., 2.}, FS_positionDiff, {r2_pen_tip, STRING(obj)},
+      //                   OT_ineq, {1e1}, {margin, margin, margin});
 
-  // komo.addObjective({2.}, FS_scalarProductYX, {obj, r2_pen_tip},
-  //                   OT_sos, {1e0}, {1.});
+      komo.addObjective({1., 1.}, FS_scalarProductZZ, {obj, r1_pen_tip}, OT_sos,
+                        {1e1}, {-1.});
 
-  // identify long axis
-  if (C[obj]->shape->size(0) > C[obj]->shape->size(1)) {
-    // x longer than y
-    spdlog::info("Trying to grab along x-axis");
-    if (r1.ee_type == EndEffectorType::two_finger) {
-      komo.addObjective({1., 1.}, FS_scalarProductXY, {obj, r1_pen_tip}, OT_eq,
-                        {1e1}, {0.});
-    }
+      komo.addObjective({2., 2.}, FS_scalarProductZZ, {obj, r2_pen_tip}, OT_sos,
+                        {1e1}, {-1.});
 
-    if (r2.ee_type == EndEffectorType::two_finger) {
-      komo.addObjective({2., 2.}, FS_scalarProductXY, {obj, r2_pen_tip}, OT_eq,
-                        {1e1}, {0.});
-    }
-  } else {
-    spdlog::info("Trying to grab along y-axis");
-    if (r1.ee_type == EndEffectorType::two_finger) {
-      komo.addObjective({1., 1.}, FS_scalarProductXX, {obj, r1_pen_tip}, OT_eq,
-                        {1e1}, {0.});
-    }
+      // komo.addObjective({1.}, FS_scalarProductYX, {obj, r1_pen_tip},
+      //                   OT_sos, {1e0}, {1.});
 
-    if (r2.ee_type == EndEffectorType::two_finger) {
-      komo.addObjective({2., 2.}, FS_scalarProductXX, {obj, r2_pen_tip}, OT_eq,
-                        {1e1}, {0.});
-    }
-  }
+      // komo.addObjective({2.}, FS_scalarProductYX, {obj, r2_pen_tip},
+      //                   OT_sos, {1e0}, {1.});
 
-  komo.run_prepare(0.0, false);
-  const auto inital_state = komo.pathConfig.getJointState();
+      // identify long axis
+      if (C[obj]->shape->size(0) > C[obj]->shape->size(1)) {
+        // x longer than y
+        spdlog::info("Trying to grab along x-axis");
+        if (r1.ee_type == EndEffectorType::two_finger) {
+          komo.addObjective({1., 1.}, FS_scalarProductXY, {obj, r1_pen_tip}, OT_eq,
+                            {1e1}, {0.});
+        }
 
-  const uint max_attempts = 10;
-  for (uint j = 0; j < max_attempts; ++j) {
-    // reset komo to initial state
-    komo.pathConfig.setJointState(inital_state);
-    komo.x = inital_state;
-
-    komo.run_prepare(0.0001, false);
-
-    const std::string r1_base_joint_name = get_base_joint_name(r1.type);
-    const std::string r2_base_joint_name = get_base_joint_name(r2.type);
-
-    uint r1_cnt = 0;
-    uint r2_cnt = 0;
-    for (const auto aj : komo.pathConfig.activeJoints) {
-      const uint ind = aj->qIndex;
-      if (aj->frame->name.contains(r1_base_joint_name.c_str()) &&
-          aj->frame->name.contains(r1.prefix.c_str())) {
-        // komo.x(ind) = cnt + j;
-        if (r1_cnt == 0) {
-          // compute orientation for robot to face towards box
-          komo.x(ind) = r1_obj_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+        if (r2.ee_type == EndEffectorType::two_finger) {
+          komo.addObjective({2., 2.}, FS_scalarProductXY, {obj, r2_pen_tip}, OT_eq,
+                            {1e1}, {0.});
         }
-        if (r1_cnt == 1) {
-          // compute orientation for robot to face towards other robot
-          komo.x(ind) = r1_r2_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+      } else {
+        spdlog::info("Trying to grab along y-axis");
+        if (r1.ee_type == EndEffectorType::two_finger) {
+          komo.addObjective({1., 1.}, FS_scalarProductXX, {obj, r1_pen_tip}, OT_eq,
+                            {1e1}, {0.});
+        }
+
+        if (r2.ee_type == EndEffectorType::two_finger) {
+          komo.addObjective({2., 2.}, FS_scalarProductXX, {obj, r2_pen_tip}, OT_eq,
+                            {1e1}, {0.});
         }
-        ++r1_cnt;
       }
 
-      if (aj->frame->name.contains(r2_base_joint_name.c_str()) &&
-          aj->frame->name.contains(r2.prefix.c_str())) {
-        // komo.x(ind) = cnt + j;
-        if (r2_cnt == 1) {
-          // compute orientation for robot to face towards box
-          komo.x(ind) = r2_r1_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+      komo.run_prepare(0., false);
+    };
+
+    const KomoInitializer init = [&](KOMO &komo, const uint) {
+      add_initialization_noise(komo, rng, 0.0001);
+
+      const std::string r1_base_joint_name = get_base_joint_name(r1.type);
+      const std::string r2_base_joint_name = get_base_joint_name(r2.type);
+
+      uint r1_cnt = 0;
+      uint r2_cnt = 0;
+      for (const auto aj : komo.pathConfig.activeJoints) {
+        const uint ind = aj->qIndex;
+        if (aj->frame->name.contains(r1_base_joint_name.c_str()) &&
+            aj->frame->name.contains(r1.prefix.c_str())) {
+          // komo.x(ind) = cnt + j;
+          if (r1_cnt == 0) {
+            // compute orientation for robot to face towards box
+            komo.x(ind) = r1_obj_angle + (noise(0) * j) / max_attempts;
+          }
+          if (r1_cnt == 1) {
+            // compute orientation for robot to face towards other robot
+            komo.x(ind) = r1_r2_angle + (noise(1) * j) / max_attempts;
+          }
+          ++r1_cnt;
+        }
+
+        if (aj->frame->name.contains(r2_base_joint_name.c_str()) &&
+            aj->frame->name.contains(r2.prefix.c_str())) {
+          // komo.x(ind) = cnt + j;
+          if (r2_cnt == 1) {
+            // compute orientation for robot to face towards box
+            komo.x(ind) = r2_r1_angle + (noise(2) * j) / max_attempts;
+          }
+          ++r2_cnt;
         }
-        ++r2_cnt;
       }
-    }
 
-    komo.pathConfig.setJointState(komo.x);
+      komo.pathConfig.setJointState(komo.x);
 
-    // TODO: replace
-    for (const auto f : komo.pathConfig.frames) {
-      if (f->name == obj) {
-        f->setPose(C[obj]->getPose());
+      // the first restart starts from the solution of a similar problem
+      if (j == 0) {
+        seed.apply(komo, C);
       }
-    }
-    komo.run_prepare(0.0, false);
+    };
 
-    komo.run(options);
+    const auto komo_template = solve_keyframe_problem(
+        templates, template_key, C, obj, goal, build, init, options);
+    if (!komo_template) {
+      return {};
+    }
+    KOMO &komo = komo_template->komo;
 
     const arr q0 = komo.getPath()[0]();
     const arr q1 = komo.getPath()[1]();
@@ -261,6 +280,7 @@ std::vector<arr> solve_subproblem(rai::Configuration &C, Robot r1, Robot r2,
 
       // C.watch(true);
 
+      seed.store({q0, q1});
       return {pick_pose, q1};
     } else {
       spdlog::debug("pick/place failed for robot {} and {}, obj {} ineq: "
@@ -281,14 +301,16 @@ std::vector<arr> solve_subproblem(rai::Configuration &C, Robot r1, Robot r2,
       }
       // komo.pathConfig.watch(true);
     }
-  }
 
-  return {};
+    return {};
+  };
+
+  return run_multistart(C, max_attempts, 3, attempt);
 }
 
 class HandoverSampler {
 public:
-  HandoverSampler(rai::Configuration &_C) : C(_C) {
+  HandoverSampler(const rai::Configuration &_C) : C(_C) {
     delete_unnecessary_frames(C);
     const auto pairs = get_cant_collide_pairs(C);
     C.fcl()->deactivatePairs(pairs);
@@ -301,6 +323,7 @@ public:
 
   rai::Configuration C;
   OptOptions options;
+  KomoTemplateCache templates;
 
   std::vector<arr>
   sample(const Robot r1, const Robot r2, const rai::String obj,
@@ -315,11 +338,6 @@ public:
       spdlog::debug("Not optimizing the pick pose.");
     }
 
-    std::unordered_map<Robot, FrameL> robot_frames;
-    for (const auto &r : {r1, r2}) {
-      robot_frames[r] = get_robot_joints(C, r);
-    }
-
     setActive(C, std::vector<Robot>{r1, r2});
 
     const arr obj_pos = C[obj]->getPosition();
@@ -347,206 +365,239 @@ public:
 
     std::vector<arr> subproblem_sol;
     if (sample_pick){
-      subproblem_sol = solve_subproblem(C, r1, r2, obj, goal);
+      subproblem_sol = solve_subproblem(C, r1, r2, obj, goal, templates);
     }
 
-    KOMO komo;
-    // komo.verbose = 5;
-    komo.verbose = 0;
-    komo.setModel(C, true);
-    // komo.animateOptimization = 5;
-
-    // komo.world.fcl()->deactivatePairs(pairs);
-    // komo.pathConfig.fcl()->stopEarly = true;
+    const KeyframeSeed seed(C, sample_pick ? "handover" : "handover_place",
+                            {r1, r2}, obj, {pick_direction_1, pick_direction_2},
+                            {obj_pos, goal_pos, r2_pos});
 
-    komo.setDiscreteOpt(3);
+    // the place problem keeps the robots at their current pose, which holds
+    // the object, i.e. it can not be shared with other objects
+    const std::string template_key =
+        (sample_pick ? std::string("handover;") + get_shape_key(C[obj])
+                     : std::string("handover_place;") + obj.p + ";" +
+                           get_joint_state_key(C)) +
+        ";" + get_shape_key(C[goal]) + ";" + r1.prefix + ";" + r2.prefix +
+        ";" + to_string(pick_direction_1) + ";" + to_string(pick_direction_2);
 
-    // komo.add_collision(true, .05, 1e1);
-    komo.add_collision(true, .1, 1e1);
+    const uint max_attempts = 10;
+    const KeyframeAttempt attempt = [&](const uint j, rai::Configuration &C,
+                                        const arr &noise,
+                                        std::mt19937 &rng) -> std::vector<arr> {
+      // the frames of the configuration of this restart
+      std::unordered_map<Robot, FrameL> robot_frames;
+      for (const auto &r : {r1, r2}) {
+        robot_frames[r] = get_robot_joints(C, r);
+      }
 
-    komo.add_jointLimits(true, 0., 1e1);
-    komo.addSquaredQuaternionNorms();
+      ConfigurationProblem cp(C);
 
-    const auto r1_pen_tip = STRING(r1 << r1.ee_frame_name);
-    const auto r2_pen_tip = STRING(r2 << r1.ee_frame_name);
+      spdlog::debug("Attempting to solve {}th time", j);
 
-    const double r1_z_rot =
-        C[STRING(r1 << "base")]->get_X().rot.getEulerRPY()(2);
-    const double r2_z_rot =
-        C[STRING(r2 << "base")]->get_X().rot.getEulerRPY()(2);
+      const auto r1_pen_tip = STRING(r1 << r1.ee_frame_name);
+      const auto r2_pen_tip = STRING(r2 << r1.ee_frame_name);
+
+      const double r1_z_rot =
+          C[STRING(r1 << "base")]->get_X().rot.getEulerRPY()(2);
+      const double r2_z_rot =
+          C[STRING(r2 << "base")]->get_X().rot.getEulerRPY()(2);
+
+      const double r1_obj_angle =
+          std::atan2(obj_pos(1) - r1_pos(1), obj_pos(0) - r1_pos(0)) - r1_z_rot;
+      const double r1_r2_angle =
+          std::atan2(r2_pos(1) - r1_pos(1), r2_pos(0) - r1_pos(0)) - r1_z_rot;
+      const double r2_r1_angle =
+          std::atan2(r1_pos(1) - r2_pos(1), r1_pos(0) - r2_pos(0)) - r2_z_rot;
+      const double r2_goal_angle =
+          std::atan2(goal_pos(1) - r2_pos(1), goal_pos(0) - r2_pos(0)) - r2_z_rot;
+
+      // the problem is only set up once for all restarts, see
+      // samplers/komo_template.h
+      const KomoBuilder build = [&](KOMO &komo, const bool collisions) {
+        // komo.verbose = 5;
+        komo.verbose = 0;
+        komo.setModel(C, true);
+        // komo.animateOptimization = 5;
+
+        // komo.world.fcl()->deactivatePairs(pairs);
+        // komo.pathConfig.fcl()->stopEarly = true;
+
+        komo.setDiscreteOpt(3);
+
+        // komo.add_collision(true, .05, 1e1);
+        if (collisions) {
+          komo.add_collision(true, .1, 1e1);
+        }
 
-    const double r1_obj_angle =
-        std::atan2(obj_pos(1) - r1_pos(1), obj_pos(0) - r1_pos(0)) - r1_z_rot;
-    const double r1_r2_angle =
-        std::atan2(r2_pos(1) - r1_pos(1), r2_pos(0) - r1_pos(0)) - r1_z_rot;
-    const double r2_r1_angle =
-        std::atan2(r1_pos(1) - r2_pos(1), r1_pos(0) - r2_pos(0)) - r2_z_rot;
-    const double r2_goal_angle =
-        std::atan2(goal_pos(1) - r2_pos(1), goal_pos(0) - r2_pos(0)) - r2_z_rot;
-
-    const uint pick_phase = 1;
-    const uint handover_phase = 2;
-    const uint place_phase = 3;
-
-    Skeleton S;
-    S.append({1., 2, SY_stable, {r1_pen_tip, obj}});
-    S.append({2., 3., SY_stable, {r2_pen_tip, obj}});
-    S.append({3., -1, SY_poseEq, {obj, goal}});
-
-    // Skeleton S = {
-    //     // {1., 2., SY_touch, {r1_pen_tip, obj}},
-    //     {1., 2, SY_stable, {r1_pen_tip, obj}},
-    //     // {2., -1., SY_touch, {r2_pen_tip, obj}},
-    //     {2., 3., SY_stable, {r2_pen_tip, obj}},
-    //     {3., -1, SY_poseEq, {obj, goal}},
-    //     // {3., -1, SY_positionEq, {obj, goal}}
-    //     // {3., -1, SY_stable, {obj, goal}},
-    // };
-
-    komo.setSkeleton(S);
-
-    const double offset = 0.1;
-    komo.addObjective({2., 2.}, FS_distance, {link_to_frame, obj}, OT_ineq,
-                      {1e0}, {-offset});
-
-    // komo.addObjective({1., 1.}, FS_aboveBox, {obj, r1_pen_tip}, OT_ineq,
-    // {1e2}, {0.0, 0.0, 0.0, 0.0}); komo.addObjective({2., 2.}, FS_aboveBox,
-    // {obj, r2_pen_tip}, OT_ineq, {1e2}, {0.1, 0.1, 0.1, 0.1});
-
-    // constraints for picking
-    if (sample_pick){
-      add_pick_constraints(komo, pick_phase, pick_phase, r1_pen_tip, r1.ee_type,
-                          obj, pick_direction_1, C[obj]->shape->size);
-    }
+        komo.add_jointLimits(true, 0., 1e1);
+        komo.addSquaredQuaternionNorms();
+
+        const uint pick_phase = 1;
+        const uint handover_phase = 2;
+        const uint place_phase = 3;
+
+        Skeleton S;
+        S.append({1., 2, SY_stable, {r1_pen_tip, obj}});
+        S.append({2., 3., SY_stable, {r2_pen_tip, obj}});
+        S.append({3., -1, SY_poseEq, {obj, goal}});
+
+        // Skeleton S = {
+        //     // {1., 2., SY_touch, {r1_pen_tip, obj}},
+        //     {1., 2, SY_stable, {r1_pen_tip, obj}},
+        //     // {2., -1., SY_touch, {r2_pen_tip, obj}},
+        //     {2., 3., SY_stable, {r2_pen_tip, obj}},
+        //     {3., -1, SY_poseEq, {obj, goal}},
+        //     // {3., -1, SY_positionEq, {obj, goal}}
+        //     // {3., -1, SY_stable, {obj, goal}},
+        // };
+
+        komo.setSkeleton(S);
+
+        const double offset = 0.1;
+        komo.addObjective({2., 2.}, FS_distance, {link_to_frame, obj}, OT_ineq,
+                          {1e0}, {-offset});
+
+        // komo.addObjective({1., 1.}, FS_aboveBox, {obj, r1_pen_tip}, OT_ineq,
+        // {1e2}, {0.0, 0.0, 0.0, 0.0}); komo.addObjective({2., 2.}, FS_aboveBox,
+        // {obj, r2_pen_tip}, OT_ineq, {1e2}, {0.1, 0.1, 0.1, 0.1});
+
+        // constraints for picking
+        if (sample_pick){
+          add_pick_constraints(komo, pick_phase, pick_phase, r1_pen_tip, r1.ee_type,
+                              obj, pick_direction_1, C[obj]->shape->size);
+        }
 
-    // constraints for the handover
-    add_pick_constraints(komo, handover_phase, handover_phase, r2_pen_tip,
-                         r2.ee_type, obj, pick_direction_2,
-                         C[obj]->shape->size);
-
-    // homing
-    if (true) {
-      uintA bodies;
-
-      for (const auto &base_name : {r1.prefix, r2.prefix}) {
-        rai::Joint *j;
-        for (rai::Frame *f : komo.world.frames) {
-          if ((j = f->joint) && j->qDim() > 0 &&
-              (f->name.contains(base_name.c_str()))) {
-            bodies.append(f->ID);
+        // constraints for the handover
+        add_pick_constraints(komo, handover_phase, handover_phase, r2_pen_tip,
+                             r2.ee_type, obj, pick_direction_2,
+                             C[obj]->shape->size);
+
+        // homing
+        if (true) {
+          uintA bodies;
+
+          for (const auto &base_name : {r1.prefix, r2.prefix}) {
+            rai::Joint *j;
+            for (rai::Frame *f : komo.world.frames) {
+              if ((j = f->joint) && j->qDim() > 0 &&
+                  (f->name.contains(base_name.c_str()))) {
+                bodies.append(f->ID);
+              }
+            }
           }
-        }
-      }
 
-      komo.addObjective({0, 3}, make_shared<F_qItself>(bodies, true), {},
-                        OT_sos, {1e-1}, NoArr); // world.q, prec);
+          komo.addObjective({0, 3}, make_shared<F_qItself>(bodies, true), {},
+                            OT_sos, {1e-1}, NoArr); // world.q, prec);
     
-      if (!sample_pick){
-        komo.addObjective({0, 1}, make_shared<F_qItself>(bodies, false), {},
-                        OT_eq, {1e1}, komo.world.getJointState());
-      }
+          if (!sample_pick){
+            komo.addObjective({0, 1}, make_shared<F_qItself>(bodies, false), {},
+                            OT_eq, {1e1}, komo.world.getJointState());
+          }
       
-    }
-
-    komo.run_prepare(0.0, false);
-    const auto inital_state = komo.pathConfig.getJointState();
-
-    ConfigurationProblem cp(C);
+        }
 
-    const uint max_attempts = 10;
-    for (uint j = 0; j < max_attempts; ++j) {
-      spdlog::debug("Attempting to solve {}th time", j);
-      // reset komo to initial state
-      komo.pathConfig.setJointState(inital_state);
-      komo.x = inital_state;
+        komo.run_prepare(0., false);
+      };
+
+      const KomoInitializer init = [&](KOMO &komo, const uint obj_id) {
+        add_initialization_noise(komo, rng, 0.0001);
+
+        const std::string r1_base_joint_name = get_base_joint_name(r1.type);
+        const std::string r2_base_joint_name = get_base_joint_name(r2.type);
+
+        uint r1_cnt = 0;
+        uint r2_cnt = 0;
+        spdlog::debug("initializing bases to face boxes");
+        for (const auto aj : komo.pathConfig.activeJoints) {
+          const uint ind = aj->qIndex;
+          if (aj->frame->name.contains(r1_base_joint_name.c_str()) &&
+              aj->frame->name.contains(r1.prefix.c_str())) {
+            // komo.x(ind) = cnt + j;
+            if (r1_cnt == 0) {
+              // compute orientation for robot to face towards box
+              komo.x(ind) = r1_obj_angle + (noise(0) * j) / max_attempts;
+            }
+            if (r1_cnt == 1) {
+              // compute orientation for robot to face towards other robot
+              komo.x(ind) = r1_r2_angle + (noise(1) * j) / max_attempts;
+            }
+            ++r1_cnt;
+          }
 
-      komo.run_prepare(0.0001, false);
+          if (aj->frame->name.contains(r2_base_joint_name.c_str()) &&
+              aj->frame->name.contains(r2.prefix.c_str())) {
+            // komo.x(ind) = cnt + j;
+            if (r2_cnt == 1) {
+              // compute orientation for robot to face towards box
+              komo.x(ind) = r2_r1_angle + (noise(2) * j) / max_attempts;
+            }
+            if (r2_cnt == 2) {
+              // compute orientation for robot to face towards other robot
+              komo.x(ind) = r2_goal_angle + (noise(3) * j) / max_attempts;
+            }
+            ++r2_cnt;
+          }
+        }
 
-      const std::string r1_base_joint_name = get_base_joint_name(r1.type);
-      const std::string r2_base_joint_name = get_base_joint_name(r2.type);
+        komo.pathConfig.setJointState(komo.x);
 
-      uint r1_cnt = 0;
-      uint r2_cnt = 0;
-      spdlog::debug("initializing bases to face boxes");
-      for (const auto aj : komo.pathConfig.activeJoints) {
-        const uint ind = aj->qIndex;
-        if (aj->frame->name.contains(r1_base_joint_name.c_str()) &&
-            aj->frame->name.contains(r1.prefix.c_str())) {
-          // komo.x(ind) = cnt + j;
-          if (r1_cnt == 0) {
-            // compute orientation for robot to face towards box
-            komo.x(ind) = r1_obj_angle + (rnd.uni(-1, 1) * j) / max_attempts;
-          }
-          if (r1_cnt == 1) {
-            // compute orientation for robot to face towards other robot
-            komo.x(ind) = r1_r2_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+        // initialize stuff
+        if (subproblem_sol.size() > 0) {
+          spdlog::debug("setting solution from subproblem");
+          uintA r1IDs;
+          for (const rai::Frame *f : robot_frames[r1]) {
+            r1IDs.append(f->ID);
           }
-          ++r1_cnt;
-        }
+          // std::cout << subproblem_sol[0] << std::endl;
+          komo.pathConfig.setJointStateSlice(subproblem_sol[0], 1, r1IDs);
 
-        if (aj->frame->name.contains(r2_base_joint_name.c_str()) &&
-            aj->frame->name.contains(r2.prefix.c_str())) {
-          // komo.x(ind) = cnt + j;
-          if (r2_cnt == 1) {
-            // compute orientation for robot to face towards box
-            komo.x(ind) = r2_r1_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+          uintA f2IDs;
+          for (const rai::Frame *f : robot_frames[r1]) {
+            f2IDs.append(f->ID);
           }
-          if (r2_cnt == 2) {
-            // compute orientation for robot to face towards other robot
-            komo.x(ind) = r2_goal_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+          for (const rai::Frame *f : robot_frames[r2]) {
+            f2IDs.append(f->ID);
           }
-          ++r2_cnt;
-        }
-      }
+          // std::cout << subproblem_sol[1] << std::endl;
+          komo.pathConfig.setJointStateSlice(subproblem_sol[1], 2, f2IDs);
 
-      komo.pathConfig.setJointState(komo.x);
-
-      // initialize stuff
-      if (subproblem_sol.size() > 0) {
-        spdlog::debug("setting solution from subproblem");
-        uintA r1IDs;
-        for (const rai::Frame *f : robot_frames[r1]) {
-          r1IDs.append(f->ID);
+          // komo.pathConfig.watch(true);
         }
-        // std::cout << subproblem_sol[0] << std::endl;
-        komo.pathConfig.setJointStateSlice(subproblem_sol[0], 1, r1IDs);
 
-        uintA f2IDs;
-        for (const rai::Frame *f : robot_frames[r1]) {
-          f2IDs.append(f->ID);
-        }
-        for (const rai::Frame *f : robot_frames[r2]) {
-          f2IDs.append(f->ID);
+        // the first restart starts from the solution of a similar problem
+        if (j == 0) {
+          seed.apply(komo, C);
         }
-        // std::cout << subproblem_sol[1] << std::endl;
-        komo.pathConfig.setJointStateSlice(subproblem_sol[1], 2, f2IDs);
 
-        // komo.pathConfig.watch(true);
-      }
+        // initialize object pose to start and goal respectively
+        spdlog::debug("Setting object poses");
+        uintA objID;
+        objID.append(obj_id);
+        rai::Frame *obj1 =
+            komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 1 + objID)(0);
+        obj1->setPose(C[obj]->getPose());
 
-      // initialize object pose to start and goal respectively
-      spdlog::debug("Setting object poses");
-      uintA objID;
-      objID.append(C[obj]->ID);
-      rai::Frame *obj1 =
-          komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 1 + objID)(0);
-      obj1->setPose(C[obj]->getPose());
+        rai::Frame *obj2 =
+            komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 2 + objID)(0);
+        obj2->setRelativePosition(obj1->getRelativePosition());
+        obj2->setRelativeQuaternion(obj1->getRelativeQuaternion());
 
-      rai::Frame *obj2 =
-          komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 2 + objID)(0);
-      obj2->setRelativePosition(obj1->getRelativePosition());
-      obj2->setRelativeQuaternion(obj1->getRelativeQuaternion());
+        rai::Frame *obj3 =
+            komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 3 + objID)(0);
+        obj3->setPose(C[goal]->getPose());
 
-      rai::Frame *obj3 =
-          komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 3 + objID)(0);
-      obj3->setPose(C[goal]->getPose());
-
-      // komo.pathConfig.watch(true);
+        // komo.pathConfig.watch(true);
 
-      spdlog::debug("Initialized values, running optimizer");
-      komo.run_prepare(0.0, false);
+        spdlog::debug("Initialized values, running optimizer");
+      };
 
-      komo.run(options);
+      const auto komo_template = solve_keyframe_problem(
+          templates, template_key, C, obj, goal, build, init, options);
+      if (!komo_template) {
+        return {};
+      }
+      KOMO &komo = komo_template->komo;
 
       const arr q0 = komo.getPath()[0]();
       const arr q1 = komo.getPath()[1]();
@@ -616,6 +667,7 @@ public:
 
         C.setJointState(home);
 
+        seed.store({q0, q1, q2});
         return {pick_pose, q1, place_pose};
       } else {
         spdlog::debug("handover failed for robot {} and {}, obj {} ineq: "
@@ -642,32 +694,25 @@ public:
         }
         // komo.pathConfig.watch(true);
       }
-    }
 
-    return {};
+      return {};
+    };
+
+    return run_multistart(C, max_attempts, 4, attempt);
   }
 };
 
 std::vector<arr> compute_handover_pose(
-    rai::Configuration C, const Robot &r1, const Robot &r2,
+    const ConfigurationHandle &C, const Robot &r1, const Robot &r2,
     const rai::String &obj, const rai::String &goal,
     const PickDirection pick_direction_1 = PickDirection::NegZ,
     const PickDirection pick_direction_2 = PickDirection::NegZ) {
-  HandoverSampler sampler(C);
+  HandoverSampler sampler(C.get());
   return sampler.sample(r1, r2, obj, goal, pick_direction_1, pick_direction_2);
 }
 
-RobotTaskPoseMap
-compute_all_handover_poses(rai::Configuration C,
-                           const std::vector<Robot> &robots,
-                           const bool attempt_all_directions = false) {
-  uint num_objects = 0;
-  for (auto f : C.frames) {
-    if (f->name.contains("obj")) {
-      num_objects += 1;
-    }
-  }
-
+std::vector<std::pair<PickDirection, PickDirection>>
+get_handover_directions(const bool attempt_all_directions) {
   std::vector<std::pair<PickDirection, PickDirection>> directions;
   if (attempt_all_directions) {
     for (int i = 5; i >= 0; --i) {
@@ -679,116 +724,134 @@ compute_all_handover_poses(rai::Configuration C,
   } else {
     directions = {std::make_pair(PickDirection::NegZ, PickDirection::NegZ)};
   }
+  return directions;
+}
 
-  delete_unnecessary_frames(C);
-  const auto pairs = get_cant_collide_pairs(C);
-  C.fcl()->deactivatePairs(pairs);
+// keyframes of the handover of object i from r1 to r2, or an empty vector if
+// none could be found.
+std::vector<TaskPoses> compute_handover_keyframes(
+    HandoverSampler &sampler, const Robot &r1, const Robot &r2, const uint i,
+    const HeldObjects &held_objs,
+    const std::vector<std::pair<PickDirection, PickDirection>> &directions) {
+  if (r1 == r2) {
+    return {};
+  }
 
-  HandoverSampler sampler(C);
-  RobotTaskPoseMap rtpm;
+  const auto obj = STRING("obj" << i + 1);
+  const auto goal = STRING("goal" << i + 1);
 
-  // check if we are currently holding an object with the robot that we are computing the keyframe for
-  std::vector<std::pair<Robot, rai::String>> held_objs;
-  for (const Robot &r : robots) {
-    for (const auto &c: sampler.C[STRING(r.prefix + "pen_tip")]->children){
-      // std::cout << c->name << std::endl;
-      if (c->name.contains("obj")){
-        held_objs.push_back(std::make_pair(r, c->name));
-      }
+  bool is_held_by_other_robot = false;
+  bool is_held_by_this_robot = false;
+  for (const auto &robot_obj_pair: held_objs){
+    if (robot_obj_pair.second == obj && (robot_obj_pair.first != r1)){
+      is_held_by_other_robot = true;
+      break;
     }
+    if (robot_obj_pair.second == obj && robot_obj_pair.first == r1){
+      is_held_by_this_robot = true;
+      break;
+    }
+
   }
 
-  for (const auto &r1 : robots) {
-    for (const auto &r2 : robots) {
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(0);
-          break;
-        }
-      }
+  if (is_held_by_other_robot){
+    return {};
+  }
 
-      if (r1 == r2) {
-        continue;
-      }
+  for (const auto &robot_obj_pair: held_objs){
+    if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
+      // if we are planning keyframes for this robot, and the robot is holding something, 
+      // we need to disable the collision for this object
+      sampler.C[robot_obj_pair.second]->setContact(0);
+      break;
+    }
+  }
 
-      setActive(C, std::vector<Robot>{r1, r2});
+  spdlog::info("computing handover for {0}, {1}, obj {2}", r1.prefix,
+               r2.prefix, i + 1);
 
-      for (uint i = 0; i < num_objects; ++i) {
-        const auto obj = STRING("obj" << i + 1);
-        const auto goal = STRING("goal" << i + 1);
-
-        bool is_held_by_other_robot = false;
-        bool is_held_by_this_robot = false;
-        for (const auto &robot_obj_pair: held_objs){
-          if (robot_obj_pair.second == obj && (robot_obj_pair.first != r1)){
-            is_held_by_other_robot = true;
-            break;
-          }
-          if (robot_obj_pair.second == obj && robot_obj_pair.first == r1){
-            is_held_by_this_robot = true;
-            break;
-          }
+  const auto obj_quat = sampler.C[obj]->getRelativeQuaternion();
 
-        }
+  std::vector<std::pair<PickDirection, PickDirection>> reordered_directions;
+  for (const auto &d: directions){
+    if (euclideanDistance(dir_to_vec(d.first), -get_pos_z_axis_dir(obj_quat)) < 1e-6 || 
+        euclideanDistance(dir_to_vec(d.second), -get_pos_z_axis_dir(obj_quat)) < 1e-6 ){
+      reordered_directions.push_back(d);
+    }
+  }
 
-        if (is_held_by_other_robot){
-          continue;
-        }
+  for (const auto &dir: directions){
+    if (std::find(reordered_directions.begin(), reordered_directions.end(), dir) == reordered_directions.end()){
+      reordered_directions.push_back(dir);
+    }
+  }
 
-        spdlog::info("computing handover for {0}, {1}, obj {2}", r1.prefix,
-                     r2.prefix, i + 1);
+  std::vector<TaskPoses> keyframes;
+  for (const auto &dirs : reordered_directions) {
 
-        const auto obj_quat = C[obj]->getRelativeQuaternion();
+    const auto sol =
+        sampler.sample(r1, r2, obj, goal, dirs.first, dirs.second, !is_held_by_this_robot);
 
-        std::vector<std::pair<PickDirection, PickDirection>> reordered_directions;
-        for (const auto &d: directions){
-          if (euclideanDistance(dir_to_vec(d.first), -get_pos_z_axis_dir(obj_quat)) < 1e-6 || 
-              euclideanDistance(dir_to_vec(d.second), -get_pos_z_axis_dir(obj_quat)) < 1e-6 ){
-            reordered_directions.push_back(d);
-          }
-        }
+    // const auto sol = compute_handover_pose(C, r1, r2, obj, goal);
 
-        for (const auto &dir: directions){
-          if (std::find(reordered_directions.begin(), reordered_directions.end(), dir) == reordered_directions.end()){
-            reordered_directions.push_back(dir);
-          }
-        }
+    if (sol.size() > 0) {
+      keyframes.push_back(sol);
+      break;
+    }
 
-        for (const auto &dirs : reordered_directions) {
+    else {
+      spdlog::info("Could not find a solution.");
+    }
+  }
 
-          const auto sol =
-              sampler.sample(r1, r2, obj, goal, dirs.first, dirs.second, !is_held_by_this_robot);
+  for (const auto &robot_obj_pair: held_objs){
+    if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
+      // if we are planning keyframes for this robot, and the robot is holding something, 
+      // we need to disable the collision for this object
+      sampler.C[robot_obj_pair.second]->setContact(1);
+      break;
+    }
+  }
 
-          // const auto sol = compute_handover_pose(C, r1, r2, obj, goal);
+  return keyframes;
+}
 
-          if (sol.size() > 0) {
-            RobotTaskPair rtp;
-            rtp.robots = {r1, r2};
-            rtp.task = Task{.object = i, .type = PrimitiveType::handover};
+RobotTaskPoseMap
+compute_all_handover_poses(const ConfigurationHandle &C,
+                           const std::vector<Robot> &robots,
+                           const bool attempt_all_directions = false) {
+  uint num_objects = 0;
+  for (auto f : C->frames) {
+    if (f->name.contains("obj")) {
+      num_objects += 1;
+    }
+  }
 
-            rtpm[rtp].push_back(sol);
-            break;
-          }
+  const auto directions = get_handover_directions(attempt_all_directions);
 
-          else {
-            spdlog::info("Could not find a solution.");
-          }
-        }
-      
-      }
+  // the sampler works on its own copy of the configuration, and removes the
+  // unnecessary frames and collision pairs there.
+  HandoverSampler sampler(C.get());
+  RobotTaskPoseMap rtpm;
 
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(1);
-          break;
+  // check if we are currently holding an object with the robot that we are computing the keyframe for
+  const HeldObjects held_objs = get_held_objects(sampler.C, robots);
+
+  for (const auto &r1 : robots) {
+    for (const auto &r2 : robots) {
+      for (uint i = 0; i < num_objects; ++i) {
+        const auto keyframes = compute_handover_keyframes(
+            sampler, r1, r2, i, held_objs, directions);
+
+        if (keyframes.size() > 0) {
+          RobotTaskPair rtp;
+          rtp.robots = {r1, r2};
+          rtp.task = Task{.object = i, .type = PrimitiveType::handover};
+          rtpm[rtp] = keyframes;
         }
       }
     }
   }
 
   return rtpm;
-}
\ No newline at end of file
+}
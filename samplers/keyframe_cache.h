@@ -0,0 +1,434 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "json/json.h"
+
+#include <Core/array.h>
+#include <Kin/kin.h>
+
+#include "common/config.h"
+#include "common/static_sdf.h"
+#include "common/types.h"
+#include "planners/plan.h"
+#include "planners/prioritized_planner.h"
+#include "samplers/keyframe_provider.h"
+
+using json = nlohmann::ordered_json;
+
+// Everything the keyframes of a scene depend on: the settings they were
+// computed with, the static scene, the robots (placement, start pose and held
+// object) and the objects (pose, goal and size).
+struct KeyframeScene {
+  struct RobotState {
+    std::string prefix;
+    std::string type;
+    arr base_pose;
+    arr q;
+    std::string held_object;
+  };
+
+  struct ObjectState {
+    arr pose;
+    arr goal_pose;
+    arr size;
+  };
+
+  std::string settings;
+  std::string static_scene;
+  std::vector<RobotState> robots;
+  std::vector<ObjectState> objects;
+};
+
+// the settings the keyframes depend on, including the global parameters that
+// change which keyframes the samplers find
+std::string
+get_keyframe_settings(const bool use_picks, const bool use_handovers,
+                      const bool use_repeated_picks,
+                      const bool attempt_all_directions) {
+  std::stringstream ss;
+  ss << use_picks << use_handovers << use_repeated_picks
+     << attempt_all_directions << global_params.use_reachability_maps
+     << global_params.prune_pick_pick_legs << global_params.staged_keyframes
+     << global_params.use_seed_bank;
+  return ss.str();
+}
+
+KeyframeScene get_keyframe_scene(rai::Configuration &C,
+                                 const std::vector<Robot> &robots,
+                                 const std::string &settings) {
+  KeyframeScene scene;
+  scene.settings = settings;
+
+  std::stringstream ss;
+  ss.precision(6);
+  for (const auto f : get_static_frames(C, robots)) {
+    ss << ";" << f->name << "," << int(f->getShape().type()) << ","
+       << f->getShape().size << "," << f->getPose();
+  }
+  scene.static_scene = std::to_string(std::hash<std::string>()(ss.str()));
+
+  for (const auto &r : robots) {
+    KeyframeScene::RobotState state;
+    state.prefix = r.prefix;
+    state.type = robot_type_to_string(r.type) + "," + ee_type_to_string(r.ee_type);
+    state.base_pose = C[STRING(r.prefix << "base")]->getPose();
+    state.q = C.getJointState(get_robot_joints(C, r));
+    for (const auto &c : C[STRING(r.prefix + "pen_tip")]->children) {
+      if (c->name.contains("obj")) {
+        state.held_object = c->name.p;
+      }
+    }
+    scene.robots.push_back(state);
+  }
+
+  for (uint i = 0;; ++i) {
+    rai::Frame *obj = C.getFrame(STRING("obj" << i + 1), false);
+    rai::Frame *goal = C.getFrame(STRING("goal" << i + 1), false);
+    if (!obj || !goal) {
+      break;
+    }
+    scene.objects.push_back(
+        {obj->getPose(), goal->getPose(), obj->getShape().size});
+  }
+
+  return scene;
+}
+
+namespace keyframe_cache_detail {
+std::vector<double> to_vector(const arr &a) {
+  return std::vector<double>(a.p, a.p + a.N);
+}
+
+arr to_arr(const json &j) {
+  const std::vector<double> v = j;
+  arr a(v.size());
+  std::copy(v.begin(), v.end(), a.p);
+  return a;
+}
+
+bool differ(const arr &a, const arr &b, const double tol = 1e-6) {
+  if (a.N != b.N) {
+    return true;
+  }
+  for (uint i = 0; i < a.N; ++i) {
+    if (std::abs(a.elem(i) - b.elem(i)) > tol) {
+      return true;
+    }
+  }
+  return false;
+}
+} // namespace keyframe_cache_detail
+
+json keyframe_scene_to_json(const KeyframeScene &scene) {
+  using namespace keyframe_cache_detail;
+
+  json data;
+  data["settings"] = scene.settings;
+  data["static_scene"] = scene.static_scene;
+  data["robots"] = json::array();
+  for (const auto &r : scene.robots) {
+    json robot;
+    robot["prefix"] = r.prefix;
+    robot["type"] = r.type;
+    robot["base_pose"] = to_vector(r.base_pose);
+    robot["q"] = to_vector(r.q);
+    robot["held_object"] = r.held_object;
+    data["robots"].push_back(robot);
+  }
+  data["objects"] = json::array();
+  for (const auto &o : scene.objects) {
+    json obj;
+    obj["pose"] = to_vector(o.pose);
+    obj["goal_pose"] = to_vector(o.goal_pose);
+    obj["size"] = to_vector(o.size);
+    data["objects"].push_back(obj);
+  }
+  return data;
+}
+
+KeyframeScene keyframe_scene_from_json(const json &data) {
+  using namespace keyframe_cache_detail;
+
+  KeyframeScene scene;
+  scene.settings = data["settings"];
+  scene.static_scene = data["static_scene"];
+  for (const auto &robot : data["robots"]) {
+    KeyframeScene::RobotState r;
+    r.prefix = robot["prefix"];
+    r.type = robot["type"];
+    r.base_pose = to_arr(robot["base_pose"]);
+    r.q = to_arr(robot["q"]);
+    r.held_object = robot["held_object"];
+    scene.robots.push_back(r);
+  }
+  for (const auto &obj : data["objects"]) {
+    scene.objects.push_back(
+        {to_arr(obj["pose"]), to_arr(obj["goal_pose"]), to_arr(obj["size"])});
+  }
+  return scene;
+}
+
+// the keyframes of all primitives, as list of (primitive, keyframes) pairs.
+json keyframes_to_json(const RobotTaskPoseMap &rtpm) {
+  using namespace keyframe_cache_detail;
+
+  json data = json::array();
+  for (const auto &entry : rtpm) {
+    json item = ordered_sequence_to_json({entry.first})["tasks"][0];
+    item["keyframes"] = json::array();
+    for (const auto &poses : entry.second) {
+      json task_poses = json::array();
+      for (const auto &q : poses) {
+        task_poses.push_back(to_vector(q));
+      }
+      item["keyframes"].push_back(task_poses);
+    }
+    data.push_back(item);
+  }
+  return data;
+}
+
+RobotTaskPoseMap keyframes_from_json(const json &data,
+                                     const std::vector<Robot> &robots) {
+  using namespace keyframe_cache_detail;
+
+  RobotTaskPoseMap rtpm;
+  for (const auto &item : data) {
+    json tasks;
+    tasks["tasks"].push_back(item);
+    const RobotTaskPair rtp = load_sequence_from_json(tasks, robots)[0];
+
+    std::vector<TaskPoses> keyframes;
+    for (const auto &task_poses : item["keyframes"]) {
+      TaskPoses poses;
+      for (const auto &q : task_poses) {
+        poses.push_back(to_arr(q));
+      }
+      keyframes.push_back(poses);
+    }
+    rtpm[rtp] = keyframes;
+  }
+  return rtpm;
+}
+
+void save_keyframe_cache(const std::string &path, const KeyframeScene &scene,
+                         const RobotTaskPoseMap &rtpm) {
+  json data;
+  data["scene"] = keyframe_scene_to_json(scene);
+  data["keyframes"] = keyframes_to_json(rtpm);
+
+  const int res = system(
+      STRING("mkdir -p " << path.substr(0, path.find_last_of('/') + 1)).p);
+  (void)res;
+
+  std::ofstream ofs(path);
+  if (!ofs.good()) {
+    spdlog::warn("Could not write keyframe cache to {}", path);
+    return;
+  }
+  ofs << data;
+}
+
+bool load_keyframe_cache(const std::string &path,
+                         const std::vector<Robot> &robots, KeyframeScene &scene,
+                         RobotTaskPoseMap &rtpm) {
+  std::ifstream ifs(path);
+  if (!ifs.good()) {
+    return false;
+  }
+
+  const json data = json::parse(ifs, nullptr, false);
+  if (data.is_discarded() || !data.contains("scene") ||
+      !data.contains("keyframes")) {
+    spdlog::warn("Could not parse keyframe cache {}", path);
+    return false;
+  }
+
+  scene = keyframe_scene_from_json(data["scene"]);
+  rtpm = keyframes_from_json(data["keyframes"], robots);
+  return true;
+}
+
+// objects whose keyframes have to be recomputed, i.e. objects that moved,
+// whose goal moved, or that were picked up or put down. Objects that were
+// added or removed count as changed as well.
+std::vector<uint> get_changed_objects(const KeyframeScene &prev,
+                                      const KeyframeScene &cur) {
+  using namespace keyframe_cache_detail;
+
+  const auto is_held = [](const KeyframeScene &scene, const std::string &obj) {
+    for (const auto &r : scene.robots) {
+      if (r.held_object == obj) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  std::vector<uint> changed;
+  const uint n = std::max(prev.objects.size(), cur.objects.size());
+  for (uint i = 0; i < n; ++i) {
+    if (i >= prev.objects.size() || i >= cur.objects.size()) {
+      changed.push_back(i);
+      continue;
+    }
+
+    const auto &p = prev.objects[i];
+    const auto &c = cur.objects[i];
+    const std::string name = "obj" + std::to_string(i + 1);
+    if (differ(p.pose, c.pose) || differ(p.goal_pose, c.goal_pose) ||
+        differ(p.size, c.size) ||
+        is_held(prev, name) != is_held(cur, name)) {
+      changed.push_back(i);
+    }
+  }
+  return changed;
+}
+
+// Keyframes of the previous scene that are still valid in the current one.
+// Primitives that were computed before, but are not part of the previous map
+// are infeasible, and are returned with empty keyframes.
+// The keyframes of a primitive have to be recomputed if its object changed,
+// if the start pose or the held object of one of its robots changed, or if
+// something changed that the robots could collide with, i.e. a changed object
+// or robot within the reach of one of the robots.
+// Returns an empty map if the settings, the static scene or the robots are
+// different, i.e. if everything has to be recomputed.
+RobotTaskPoseMap get_reusable_keyframes(const KeyframeScene &prev,
+                                        const RobotTaskPoseMap &prev_rtpm,
+                                        const KeyframeScene &cur,
+                                        const std::vector<Robot> &robots,
+                                        const KeyframeProvider &provider,
+                                        const double margin = 0.2) {
+  using namespace keyframe_cache_detail;
+
+  if (prev.settings != cur.settings || prev.static_scene != cur.static_scene ||
+      prev.robots.size() != cur.robots.size()) {
+    return {};
+  }
+  for (uint k = 0; k < cur.robots.size(); ++k) {
+    if (prev.robots[k].prefix != cur.robots[k].prefix ||
+        prev.robots[k].type != cur.robots[k].type ||
+        differ(prev.robots[k].base_pose, cur.robots[k].base_pose)) {
+      return {};
+    }
+  }
+
+  std::vector<arr> base_positions;
+  std::vector<double> reach;
+  for (uint k = 0; k < robots.size(); ++k) {
+    base_positions.push_back(cur.robots[k].base_pose({0, 2}));
+    reach.push_back(get_workspace_from_robot_type(robots[k].type) + margin);
+  }
+
+  // robots whose keyframes are invalid, since they changed themselves, or
+  // something within their reach changed.
+  std::vector<bool> robot_affected(robots.size(), false);
+  for (uint k = 0; k < robots.size(); ++k) {
+    if (differ(prev.robots[k].q, cur.robots[k].q) ||
+        prev.robots[k].held_object != cur.robots[k].held_object) {
+      for (uint l = 0; l < robots.size(); ++l) {
+        const double dist =
+            euclideanDistance(base_positions[k], base_positions[l]);
+        if (dist <= reach[k] + reach[l]) {
+          robot_affected[l] = true;
+        }
+      }
+    }
+  }
+
+  const std::vector<uint> changed_objects = get_changed_objects(prev, cur);
+  std::unordered_set<uint> object_changed(changed_objects.begin(),
+                                          changed_objects.end());
+  for (const uint i : changed_objects) {
+    std::vector<arr> positions;
+    if (i < prev.objects.size()) {
+      positions.push_back(prev.objects[i].pose({0, 2}));
+    }
+    if (i < cur.objects.size()) {
+      positions.push_back(cur.objects[i].pose({0, 2}));
+    }
+    for (uint k = 0; k < robots.size(); ++k) {
+      for (const auto &pos : positions) {
+        if (euclideanDistance(pos, base_positions[k]) <= reach[k]) {
+          robot_affected[k] = true;
+        }
+      }
+    }
+  }
+
+  std::unordered_map<Robot, uint> robot_index;
+  for (uint k = 0; k < robots.size(); ++k) {
+    robot_index[robots[k]] = k;
+  }
+
+  RobotTaskPoseMap reusable;
+  for (uint i = 0; i < cur.objects.size(); ++i) {
+    if (object_changed.count(i) > 0) {
+      continue;
+    }
+
+    for (const auto &rtp : provider.get_candidates(i)) {
+      bool affected = false;
+      for (const auto &r : rtp.robots) {
+        affected = affected || robot_affected[robot_index.at(r)];
+      }
+      if (affected) {
+        continue;
+      }
+
+      std::vector<RobotTaskPair> parts = {rtp};
+      if (rtp.task.type == PrimitiveType::pick_pick_1) {
+        parts.push_back(KeyframeProvider::get_second_part(rtp));
+      }
+      for (const auto &part : parts) {
+        const auto it = prev_rtpm.find(part);
+        reusable[part] =
+            it != prev_rtpm.end() ? it->second : std::vector<TaskPoses>();
+      }
+    }
+  }
+
+  return reusable;
+}
+
+// computes the keyframes of the scene, and reuses the keyframes in the cache
+// file that are not affected by the changes since the cache was written.
+// The cache is overwritten with the result.
+RobotTaskPoseMap compute_keyframes_incrementally(
+    rai::Configuration &C, const std::vector<Robot> &robots,
+    const std::string &path, const bool use_picks = true,
+    const bool use_handovers = true, const bool use_repeated_picks = true,
+    const bool attempt_all_directions = false) {
+  const KeyframeScene scene = get_keyframe_scene(
+      C, robots,
+      get_keyframe_settings(use_picks, use_handovers, use_repeated_picks,
+                            attempt_all_directions));
+
+  KeyframeProvider provider(C, robots, use_picks, use_handovers,
+                            use_repeated_picks, attempt_all_directions);
+
+  KeyframeScene prev;
+  RobotTaskPoseMap prev_rtpm;
+  if (load_keyframe_cache(path, robots, prev, prev_rtpm)) {
+    const RobotTaskPoseMap reusable =
+        get_reusable_keyframes(prev, prev_rtpm, scene, robots, provider);
+    provider.set_known(reusable);
+    spdlog::info("Reusing keyframes of {} primitives from {}", reusable.size(),
+                 path);
+  }
+
+  const RobotTaskPoseMap rtpm = provider.get_all_keyframes();
+  save_keyframe_cache(path, scene, rtpm);
+
+  return rtpm;
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include <Kin/kin.h>
+
+#include "common/config.h"
+#include "common/util.h"
+#include "planners/plan.h"
+
+#include "samplers/handover_sampler.h"
+#include "samplers/pick_and_place_sampler.h"
+#include "samplers/repeated_pick_sampler.h"
+
+// Computes the keyframes of a primitive the first time they are requested,
+// instead of computing the keyframes of all primitives up front.
+// Feasible and infeasible results are both cached.
+// Keyframe computations are not run concurrently, since the samplers modify
+// their configurations.
+class KeyframeProvider {
+public:
+  KeyframeProvider(const rai::Configuration &C,
+                   const std::vector<Robot> &_robots,
+                   const bool _use_picks = true,
+                   const bool _use_handovers = true,
+                   const bool _use_repeated_picks = true,
+                   const bool attempt_all_directions = false)
+      : robots(_robots), use_picks(_use_picks), use_handovers(_use_handovers),
+        use_repeated_picks(_use_repeated_picks),
+        pick_directions(get_pick_directions(attempt_all_directions)),
+        handover_directions(get_handover_directions(attempt_all_directions)),
+        repeated_pick_directions(
+            get_repeated_pick_directions(attempt_all_directions)) {
+    C_base.copy(C);
+    for (auto f : C_base.frames) {
+      if (f->name.contains("obj")) {
+        num_objects += 1;
+      }
+    }
+  }
+
+  // uses the given keyframes instead of computing them, i.e. everything that
+  // is not part of the map is infeasible.
+  void set_precomputed(const RobotTaskPoseMap &rtpm) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    precomputed = true;
+    cache.clear();
+    for (const auto &entry : rtpm) {
+      cache[entry.first] = entry.second;
+    }
+  }
+
+  // keyframes that are already known, e.g. from a previous run. Primitives
+  // with empty keyframes are known to be infeasible. Everything else is still
+  // computed on request.
+  void set_known(const RobotTaskPoseMap &rtpm) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (const auto &entry : rtpm) {
+      cache[entry.first] = entry.second;
+    }
+  }
+
+  uint get_num_objects() const { return num_objects; }
+
+  // primitives that could be used for object i, without checking if they
+  // are feasible. pick_pick_2 is not part of this, since it is always
+  // executed after pick_pick_1.
+  std::vector<RobotTaskPair> get_candidates(const uint i) const {
+    std::vector<RobotTaskPair> candidates;
+    for (const auto &r1 : robots) {
+      if (use_picks) {
+        candidates.push_back(RobotTaskPair{
+            .robots = {r1}, .task = Task{.object = i, .type = PrimitiveType::pick}});
+      }
+      for (const auto &r2 : robots) {
+        if (use_handovers && r1 != r2) {
+          candidates.push_back(RobotTaskPair{
+              .robots = {r1, r2},
+              .task = Task{.object = i, .type = PrimitiveType::handover}});
+        }
+        if (use_repeated_picks) {
+          candidates.push_back(RobotTaskPair{
+              .robots = {r1, r2},
+              .task = Task{.object = i, .type = PrimitiveType::pick_pick_1}});
+        }
+      }
+    }
+    return candidates;
+  }
+
+  // keyframes of the primitive, computed on the first request. An empty
+  // vector if the primitive is infeasible.
+  std::vector<TaskPoses> get(const RobotTaskPair &rtp) {
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      const auto it = cache.find(rtp);
+      if (it != cache.end()) {
+        return it->second;
+      }
+      if (precomputed) {
+        return {};
+      }
+    }
+
+    compute(rtp);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return cache.at(rtp);
+  }
+
+  bool is_feasible(const RobotTaskPair &rtp) { return get(rtp).size() > 0; }
+
+  // the feasible keyframes of the primitives of the sequence, e.g. to plan
+  // for the sequence. Computes them if necessary.
+  RobotTaskPoseMap get_keyframes(const OrderedTaskSequence &seq) {
+    RobotTaskPoseMap rtpm;
+    for (const auto &rtp : seq) {
+      const auto keyframes = get(rtp);
+      if (keyframes.size() > 0) {
+        rtpm[rtp] = keyframes;
+      }
+    }
+    return rtpm;
+  }
+
+  // computes the keyframes of all primitives
+  RobotTaskPoseMap get_all_keyframes() {
+    RobotTaskPoseMap rtpm;
+    for (uint i = 0; i < num_objects; ++i) {
+      for (const auto &rtp : get_candidates(i)) {
+        if (get(rtp).size() == 0) {
+          continue;
+        }
+        if (rtp.task.type == PrimitiveType::pick_pick_1) {
+          const RobotTaskPair rtp_2 = get_second_part(rtp);
+          rtpm[rtp_2] = get(rtp_2);
+        }
+        rtpm[rtp] = get(rtp);
+      }
+    }
+    return rtpm;
+  }
+
+  static RobotTaskPair get_second_part(const RobotTaskPair &rtp) {
+    RobotTaskPair rtp_2 = rtp;
+    rtp_2.task.type = PrimitiveType::pick_pick_2;
+    return rtp_2;
+  }
+
+private:
+  // computes and caches the primitive, and the second part of a repeated
+  // pick along with the first one.
+  void compute(const RobotTaskPair &rtp) {
+    std::lock_guard<std::mutex> compute_lock(compute_mutex);
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cache.count(rtp) > 0) {
+        return;
+      }
+    }
+
+    const uint i = rtp.task.object;
+    std::unordered_map<RobotTaskPair, std::vector<TaskPoses>> res;
+    res[rtp] = {};
+
+    const PrimitiveType type = rtp.task.type;
+    if (type == PrimitiveType::pick && use_picks) {
+      init_samplers();
+      res[rtp] = compute_pick_and_place_keyframes(
+          *pick_sampler, rtp.robots[0], i, held_objs, pick_directions);
+    } else if (type == PrimitiveType::handover && use_handovers) {
+      init_samplers();
+      res[rtp] = compute_handover_keyframes(*handover_sampler, rtp.robots[0],
+                                            rtp.robots[1], i, held_objs,
+                                            handover_directions);
+    } else if ((type == PrimitiveType::pick_pick_1 ||
+                type == PrimitiveType::pick_pick_2) &&
+               use_repeated_picks) {
+      init_samplers();
+      RobotTaskPair rtp_1 = rtp;
+      rtp_1.task.type = PrimitiveType::pick_pick_1;
+      const RobotTaskPair rtp_2 = get_second_part(rtp_1);
+
+      const auto keyframes = compute_repeated_pick_keyframes(
+          *repeated_pick_sampler, rtp.robots[0], rtp.robots[1], i, held_objs,
+          repeated_pick_directions);
+      res[rtp_1] = {};
+      res[rtp_2] = {};
+      if (keyframes.size() > 0) {
+        res[rtp_1] = {keyframes[0]};
+        res[rtp_2] = {keyframes[1]};
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (const auto &r : res) {
+      cache[r.first] = r.second;
+    }
+  }
+
+  // the samplers copy the configuration, remove the unnecessary frames and
+  // collision pairs, and are then reused for all primitives.
+  void init_samplers() {
+    if (pick_sampler) {
+      return;
+    }
+
+    rai::Configuration C;
+    C.copy(C_base);
+    delete_unnecessary_frames(C);
+    C.fcl()->deactivatePairs(get_cant_collide_pairs(C));
+
+    pick_sampler = std::make_unique<PickAndPlaceSampler>(C);
+    handover_sampler = std::make_unique<HandoverSampler>(C_base);
+    repeated_pick_sampler = std::make_unique<RepeatedPickSampler>(C);
+
+    held_objs = get_held_objects(pick_sampler->C, robots);
+  }
+
+  std::vector<Robot> robots;
+  bool use_picks;
+  bool use_handovers;
+  bool use_repeated_picks;
+
+  std::vector<PickDirection> pick_directions;
+  std::vector<std::pair<PickDirection, PickDirection>> handover_directions;
+  std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+      repeated_pick_directions;
+
+  rai::Configuration C_base;
+  uint num_objects = 0;
+
+  std::unique_ptr<PickAndPlaceSampler> pick_sampler;
+  std::unique_ptr<HandoverSampler> handover_sampler;
+  std::unique_ptr<RepeatedPickSampler> repeated_pick_sampler;
+  HeldObjects held_objs;
+
+  std::unordered_map<RobotTaskPair, std::vector<TaskPoses>> cache;
+  bool precomputed = false;
+  std::mutex cache_mutex;
+  std::mutex compute_mutex;
+};
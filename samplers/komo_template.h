@@ -0,0 +1,285 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "spdlog/spdlog.h"
+
+#include <KOMO/komo.h>
+#include <Kin/kin.h>
+
+#include "common/config.h"
+
+// sets up a keyframe problem, with or without the collision terms
+typedef std::function<void(KOMO &komo, const bool collisions)> KomoBuilder;
+
+// sets the initialization of a restart of a keyframe problem. obj_id is the id
+// of the frame the object of the problem is bound to, see KomoTemplate::bind.
+typedef std::function<void(KOMO &komo, const uint obj_id)> KomoInitializer;
+
+// index of the keyframe worker the current thread runs as, set by
+// run_multistart. Templates are kept per worker, since a template can only be
+// solved by one thread at a time.
+thread_local uint keyframe_worker = 0;
+
+// A keyframe problem that is set up once and then solved repeatedly, e.g. by
+// the restarts of a sampler and for other objects of the same shape. Setting
+// up the problem (copying the configuration into the path configuration, the
+// skeleton and grounding the objectives, which also fixes the sparsity of the
+// jacobian) takes longer than solving small keyframe problems.
+class KomoTemplate {
+public:
+  KOMO komo;
+
+  bool is_built() const { return built; }
+
+  // stores the object and goal the objectives were set up with. Call once the
+  // problem is set up and prepared.
+  void finish_build(const rai::String &obj, const rai::String &goal) {
+    template_obj = obj;
+    template_goal = goal;
+    built = true;
+  }
+
+  // resets the solver state (e.g. the dual variables of the previous solve)
+  // and sets all time slices to the state of the configuration, i.e. the
+  // result of the previous solve is not used.
+  // The objectives refer to the object and goal the template was built with.
+  // These frames take the poses of obj and goal, and obj and goal take
+  // theirs, i.e. obj has to have the same shape as the object of the
+  // template.
+  void bind(rai::Configuration &C, const rai::String &obj,
+            const rai::String &goal) {
+    komo.reset();
+
+    arr X = C.getFrameState();
+    swap_rows(X, C.getFrame(template_obj)->ID, C.getFrame(obj)->ID);
+    swap_rows(X, C.getFrame(template_goal)->ID, C.getFrame(goal)->ID);
+    for (uint s = 0; s < komo.timeSlices.d0; ++s) {
+      komo.pathConfig.setFrameState(X, komo.timeSlices[s]);
+    }
+    komo.x = komo.pathConfig.getJointState();
+
+    obj_id = C.getFrame(template_obj)->ID;
+    goal_id = C.getFrame(template_goal)->ID;
+  }
+
+  // id of the frame the object of the problem is bound to
+  uint get_obj_id() const { return obj_id; }
+
+  // sets the path to the one of another template of the same problem, which
+  // might be bound to different frames
+  void set_path(const KomoTemplate &other) {
+    arr X = other.komo.pathConfig.getFrameState();
+    const uint n = komo.pathConfig.frames.d1;
+    for (uint s = 0; s < komo.pathConfig.frames.d0; ++s) {
+      swap_rows(X, s * n + other.obj_id, s * n + obj_id);
+      swap_rows(X, s * n + other.goal_id, s * n + goal_id);
+    }
+    komo.pathConfig.setFrameState(X);
+  }
+
+private:
+  static void swap_rows(arr &X, const uint i, const uint k) {
+    if (i == k) {
+      return;
+    }
+    const arr tmp = X[i];
+    X[i] = X[k];
+    X[k] = tmp;
+  }
+
+  rai::String template_obj;
+  rai::String template_goal;
+  uint obj_id = 0;
+  uint goal_id = 0;
+  bool built = false;
+};
+
+// key of the shape of an object, i.e. of the objects a template can be
+// shared between
+std::string get_shape_key(rai::Frame *f) {
+  if (!f->shape) {
+    return "noshape";
+  }
+  std::stringstream ss;
+  ss.precision(6);
+  ss << "shape" << int(f->getShape().type()) << "," << f->getShape().size;
+  return ss.str();
+}
+
+// key of the joint state, for problems that refer to the current pose of the
+// robots, e.g. to keep them in place
+std::string get_joint_state_key(const rai::Configuration &C) {
+  std::size_t h = 0;
+  for (const double v : C.getJointState()) {
+    h ^= std::hash<double>()(v) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+  }
+  return "q" + std::to_string(h);
+}
+
+// hash of everything a template depends on besides its key: the frames and
+// their parents, the shapes and contacts, the number of active joints and the
+// poses of the static frames. The poses of objects, goals and of the frames
+// that move with a joint are set from the configuration on every solve, see
+// KomoTemplate::bind.
+std::size_t get_scene_hash(const rai::Configuration &C) {
+  std::size_t h = C.frames.N;
+  const auto combine = [&h](const std::size_t v) {
+    h ^= v + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+  };
+
+  for (const auto f : C.frames) {
+    combine(f->parent ? f->parent->ID + 1 : 0);
+    if (f->shape) {
+      combine(std::hash<int>()(int(f->getShape().type())));
+      for (const double v : f->getShape().size) {
+        combine(std::hash<double>()(v));
+      }
+      combine(std::hash<int>()(f->shape->cont));
+    }
+
+    const bool is_static = !f->getUpwardLink()->joint &&
+                           !f->name.contains("obj") &&
+                           !f->name.contains("goal");
+    if (is_static) {
+      for (const double v : f->getPose()) {
+        combine(std::hash<double>()(v));
+      }
+    }
+  }
+  combine(C.activeJoints.N);
+  return h;
+}
+
+// Templates of the problems a sampler solved most recently, per keyframe
+// worker. The key has to describe the structure of the problem (primitive,
+// robots and directions, and the shape of the object, see get_shape_key), but
+// not the object itself. Templates are rebuilt if the static part of the
+// configuration changed since they were built.
+class KomoTemplateCache {
+public:
+  KomoTemplateCache(const uint _capacity = 8) : capacity(_capacity) {}
+
+  // the template, set up with the builder if it is not built yet, and bound
+  // to obj and goal.
+  std::shared_ptr<KomoTemplate> get(const std::string &key,
+                                    rai::Configuration &C,
+                                    const rai::String &obj,
+                                    const rai::String &goal,
+                                    const KomoBuilder &build,
+                                    const bool collisions = true) {
+    const auto t = lookup(collisions ? key : key + ";without_collisions", C);
+    if (!t->is_built()) {
+      build(t->komo, collisions);
+      t->finish_build(obj, goal);
+    }
+    t->bind(C, obj, goal);
+    return t;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(m);
+    workers.clear();
+  }
+
+private:
+  struct WorkerTemplates {
+    std::unordered_map<std::string,
+                       std::pair<std::size_t, std::shared_ptr<KomoTemplate>>>
+        templates;
+    std::deque<std::string> keys;
+  };
+
+  // the templates of the worker of the current thread. Every worker only
+  // accesses its own templates.
+  WorkerTemplates &get_worker_templates() {
+    std::lock_guard<std::mutex> lock(m);
+    return workers[keyframe_worker];
+  }
+
+  // a template that is not built yet if there is no matching one
+  std::shared_ptr<KomoTemplate> lookup(const std::string &key,
+                                       const rai::Configuration &C) {
+    if (!global_params.reuse_komo_templates) {
+      return std::make_shared<KomoTemplate>();
+    }
+
+    WorkerTemplates &w = get_worker_templates();
+    const std::size_t hash = get_scene_hash(C);
+    const auto it = w.templates.find(key);
+    if (it != w.templates.end() && it->second.first == hash) {
+      spdlog::debug("Reusing komo template {}", key);
+      return it->second.second;
+    }
+
+    if (it == w.templates.end()) {
+      w.keys.push_back(key);
+    }
+    if (w.keys.size() > capacity) {
+      w.templates.erase(w.keys.front());
+      w.keys.pop_front();
+    }
+
+    auto t = std::make_shared<KomoTemplate>();
+    w.templates[key] = std::make_pair(hash, t);
+    return t;
+  }
+
+  uint capacity;
+
+  // std::map, such that references stay valid when workers are added
+  std::map<uint, WorkerTemplates> workers;
+  std::mutex m;
+};
+
+// Solves a keyframe problem from the initialization of a restart.
+// With staged_keyframes, the problem is first solved without the collision
+// terms, which are the most expensive part of the evaluation. Only if this
+// converged, the solution is refined with the collision terms for a few
+// iterations. Returns nullptr if the problem without collisions did not
+// converge.
+std::shared_ptr<KomoTemplate>
+solve_keyframe_problem(KomoTemplateCache &templates, const std::string &key,
+                       rai::Configuration &C, const rai::String &obj,
+                       const rai::String &goal, const KomoBuilder &build,
+                       const KomoInitializer &init, const OptOptions &options) {
+  if (!global_params.staged_keyframes) {
+    const auto t = templates.get(key, C, obj, goal, build);
+    init(t->komo, t->get_obj_id());
+    t->komo.run_prepare(0.);
+    t->komo.run(options);
+    return t;
+  }
+
+  const auto coarse = templates.get(key, C, obj, goal, build, false);
+  init(coarse->komo, coarse->get_obj_id());
+  coarse->komo.run_prepare(0.);
+  coarse->komo.run(options);
+
+  const double ineq = coarse->komo.getReport(false).get<double>("ineq");
+  const double eq = coarse->komo.getReport(false).get<double>("eq");
+  if (ineq > 1. || eq > 1.) {
+    spdlog::debug("Problem {} without collisions did not converge, ineq: "
+                  "{:03.2f} eq: {:03.2f}",
+                  key, ineq, eq);
+    return nullptr;
+  }
+
+  // both problems have the same decision variables
+  const auto fine = templates.get(key, C, obj, goal, build, true);
+  init(fine->komo, fine->get_obj_id());
+  fine->set_path(*coarse);
+  fine->komo.run_prepare(0.);
+
+  OptOptions refine_options = options;
+  refine_options.stopIters = global_params.keyframe_refine_iters;
+  fine->komo.run(refine_options);
+  return fine;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include <Core/array.h>
+#include <KOMO/komo.h>
+#include <Kin/kin.h>
+
+#include "common/config.h"
+#include "common/util.h"
+#include "samplers/komo_template.h"
+
+// signature of a single restart of a keyframe optimization: solves restart j
+// on its own komo instance, using the configuration C (which belongs to this
+// restart) and the random seed perturbations in noise. Further random numbers
+// of the restart (e.g. the initialization noise) have to be drawn from rng
+// instead of the global rnd. Returns the keyframes, or an empty vector if the
+// restart failed.
+typedef std::function<std::vector<arr>(const uint j, rai::Configuration &C,
+                                       const arr &noise, std::mt19937 &rng)>
+    KeyframeAttempt;
+
+// adds gaussian noise to the decision variables of komo, drawn from the rng of
+// a restart. Replaces the initialization noise of komo.run_prepare, which
+// draws from the global rnd.
+void add_initialization_noise(KOMO &komo, std::mt19937 &rng,
+                              const double sigma) {
+  std::normal_distribution<double> gauss(0., sigma);
+  for (uint i = 0; i < komo.x.N; ++i) {
+    komo.x(i) += gauss(rng);
+  }
+}
+
+// Runs the restarts of a keyframe optimization and returns the result of the
+// first successful one.
+// Every restart draws its random numbers from its own generator, which is
+// seeded from a single draw of the global rnd. The result of a restart does
+// therefore not depend on the order in which the restarts are run, and
+// concurrent restarts do not share the global rnd.
+// With more than one keyframe thread, the restarts are solved concurrently.
+// Restarts that did not start yet are skipped as soon as a solution is found.
+// In deterministic mode, only restarts with a higher index than the best
+// solution so far are skipped, and the solution of the restart with the
+// lowest index is returned, i.e. the same one as in the sequential case.
+std::vector<arr> run_multistart(rai::Configuration &C, const uint max_attempts,
+                                const uint noise_dim,
+                                const KeyframeAttempt &attempt) {
+  const std::uint32_t seed = std::uint32_t(rnd.uni(0., 4294967295.));
+
+  // the rng and the perturbations of restart j
+  std::vector<std::mt19937> rngs;
+  arr noise(max_attempts, noise_dim);
+  for (uint j = 0; j < max_attempts; ++j) {
+    rngs.emplace_back(seed + j);
+    std::uniform_real_distribution<double> uni(-1., 1.);
+    for (uint k = 0; k < noise_dim; ++k) {
+      noise(j, k) = uni(rngs[j]);
+    }
+  }
+
+  // every restart starts from the same state of the configuration, also if
+  // the previous restart on the same configuration changed it
+  const arr X0 = C.getFrameState();
+
+  const uint num_threads = global_params.keyframe_threads;
+  if (num_threads == 1) {
+    for (uint j = 0; j < max_attempts; ++j) {
+      C.setFrameState(X0);
+      const auto res = attempt(j, C, noise[j], rngs[j]);
+      if (res.size() > 0) {
+        return res;
+      }
+    }
+    return {};
+  }
+
+  // copies of the configuration, made when a restart starts and no copy is
+  // free, i.e. there are at most as many copies as threads. Copying does not
+  // keep the deactivated collision pairs, they are deactivated again.
+  // The index of a copy is also the keyframe worker of the restart that uses
+  // it, see samplers/komo_template.h.
+  std::deque<rai::Configuration> configurations;
+  std::vector<uint> free_configurations;
+  std::mutex configurations_mutex;
+
+  const auto acquire = [&]() -> uint {
+    std::lock_guard<std::mutex> lock(configurations_mutex);
+    if (!free_configurations.empty()) {
+      const uint k = free_configurations.back();
+      free_configurations.pop_back();
+      return k;
+    }
+    configurations.emplace_back();
+    rai::Configuration &Ccpy = configurations.back();
+    Ccpy.copy(C);
+    Ccpy.fcl()->deactivatePairs(get_cant_collide_pairs(Ccpy));
+    return configurations.size() - 1;
+  };
+  const auto release = [&](const uint k) {
+    std::lock_guard<std::mutex> lock(configurations_mutex);
+    free_configurations.push_back(k);
+  };
+
+  std::vector<std::vector<arr>> results(max_attempts);
+  std::atomic<uint> best{max_attempts};
+  const bool deterministic = global_params.deterministic_keyframes;
+
+  run_parallel(max_attempts, num_threads, [&](const uint j) {
+    if ((deterministic && j > best) || (!deterministic && best < max_attempts)) {
+      return;
+    }
+
+    const uint k = acquire();
+    rai::Configuration *Ccpy;
+    {
+      std::lock_guard<std::mutex> lock(configurations_mutex);
+      Ccpy = &configurations[k];
+    }
+    Ccpy->setFrameState(X0);
+    const uint prev_worker = keyframe_worker;
+    keyframe_worker = k + 1;
+    results[j] = attempt(j, *Ccpy, noise[j], rngs[j]);
+    keyframe_worker = prev_worker;
+    release(k);
+    if (results[j].size() == 0) {
+      return;
+    }
+
+    uint current = best;
+    while (j < current && !best.compare_exchange_weak(current, j)) {
+    }
+  });
+
+  if (best < max_attempts) {
+    spdlog::debug("Multistart: restart {} succeeded", uint(best));
+    return results[best];
+  }
+  return {};
+}
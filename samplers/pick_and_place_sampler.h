@@ -8,7 +8,11 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 
+#include "samplers/komo_template.h"
 #include "samplers/pick_constraints.h"
+#include "samplers/multistart.h"
+#include "samplers/reachability.h"
+#include "samplers/seed_bank.h"
 
 class PickAndPlaceSampler {
 public:
@@ -31,6 +35,7 @@ public:
   }
 
   OptOptions options;
+  KomoTemplateCache templates;
 
   // TaskPoses sample_at_times(std::vector<Robot> robots, std::string obj,
   //                           rai::Animation A) {
@@ -53,126 +58,148 @@ public:
 
     setActive(C, r);
 
-    // TODO: solve subproblems to check for feasibility.
-    // For now: hardcode the radius of the ur5
-    if (euclideanDistance(obj_pos, r1_pos) > 1. ||
-        euclideanDistance(goal_pos, r1_pos) > 1.) {
+    // the object has to be reachable at the start and at the goal
+    if (!is_reachable(C, r, obj_pos) || !is_reachable(C, r, goal_pos)) {
       spdlog::info("Skipping pick keyframe computation for obj {} and "
                    "robot {}",
                    obj, r.prefix);
       return {};
     }
 
-    KOMO komo;
-    komo.verbose = 0;
-    komo.setModel(C, true);
-    // komo.pathConfig.fcl()->deactivatePairs(pairs);
+    const KeyframeSeed seed(C, sample_only_place ? "place" : "pick", {r}, obj,
+                            {pick_direction}, {obj_pos, goal_pos});
 
-    uint total_phases = 2;
+    // the place problem keeps the robot at its current pose, which holds the
+    // object, i.e. it can not be shared with other objects
+    const std::string template_key =
+        (sample_only_place
+             ? std::string("place;") + obj.p + ";" + get_joint_state_key(C)
+             : std::string("pick;") + get_shape_key(C[obj])) +
+        ";" + get_shape_key(C[goal]) + ";" + r.prefix + ";" +
+        to_string(pick_direction);
 
-    komo.setDiscreteOpt(total_phases);
-    // komo.animateOptimization = 3;
+    const uint max_attempts = 10;
+    const KeyframeAttempt attempt = [&](const uint j, rai::Configuration &C,
+                                        const arr &noise,
+                                        std::mt19937 &rng) -> std::vector<arr> {
+      const auto pen_tip = STRING(r.prefix << r.ee_frame_name);
 
-    // komo.world.stepSwift();
+      const double r1_z_rot =
+          C[STRING(r << "base")]->get_X().rot.getEulerRPY()(2);
 
-    komo.add_collision(true, 0.1, 1e1);
-    komo.add_jointLimits(true, 0., 1e1);
+      const double r1_obj_angle =
+          std::atan2(obj_pos(1) - r1_pos(1), obj_pos(0) - r1_pos(0)) - r1_z_rot;
+      const double r1_goal_angle =
+          std::atan2(goal_pos(1) - r1_pos(1), goal_pos(0) - r1_pos(0)) - r1_z_rot;
 
-    const auto pen_tip = STRING(r.prefix << r.ee_frame_name);
+      // the problem is only set up once for all restarts, see
+      // samplers/komo_template.h
+      const KomoBuilder build = [&](KOMO &komo, const bool collisions) {
+        komo.verbose = 0;
+        komo.setModel(C, true);
+        // komo.pathConfig.fcl()->deactivatePairs(pairs);
 
-    const double r1_z_rot =
-        C[STRING(r << "base")]->get_X().rot.getEulerRPY()(2);
+        uint total_phases = 2;
 
-    const double r1_obj_angle =
-        std::atan2(obj_pos(1) - r1_pos(1), obj_pos(0) - r1_pos(0)) - r1_z_rot;
-    const double r1_goal_angle =
-        std::atan2(goal_pos(1) - r1_pos(1), goal_pos(0) - r1_pos(0)) - r1_z_rot;
+        komo.setDiscreteOpt(total_phases);
+        // komo.animateOptimization = 3;
 
-    double pick_phase = 1;
-    double place_phase = 2;
+        // komo.world.stepSwift();
 
-    Skeleton S;
-    S.append({pick_phase, place_phase, SY_stable, {pen_tip, obj}});
-    S.append({place_phase, place_phase, SY_poseEq, {obj, goal}});
+        if (collisions) {
+          komo.add_collision(true, 0.1, 1e1);
+        }
+        komo.add_jointLimits(true, 0., 1e1);
 
-    komo.setSkeleton(S);
+        double pick_phase = 1;
+        double place_phase = 2;
 
-    if (!sample_only_place) {
-      add_pick_constraints(komo, pick_phase, pick_phase, pen_tip, r.ee_type,
-                           obj, pick_direction, C[obj]->shape->size);
-    }
+        Skeleton S;
+        S.append({pick_phase, place_phase, SY_stable, {pen_tip, obj}});
+        S.append({place_phase, place_phase, SY_poseEq, {obj, goal}});
 
-    if (true) {
-      for (const auto &base_name : {r.prefix}) {
-        uintA bodies;
-        rai::Joint *j;
-        for (rai::Frame *f : komo.world.frames) {
-          if ((j = f->joint) && j->qDim() > 0 &&
-              (f->name.contains(base_name.c_str()))) {
-            bodies.append(f->ID);
-          }
-        }
-        komo.addObjective({0, 3}, make_shared<F_qItself>(bodies, true), {},
-                          OT_sos, {1e0}, NoArr); // world.q, prec);
+        komo.setSkeleton(S);
 
-        // enforce that the position of the robot is the same
-        if (sample_only_place){
-          komo.addObjective({0, 1}, make_shared<F_qItself>(bodies, false), {},
-                          OT_eq, {1e1}, komo.world.getJointState());
+        if (!sample_only_place) {
+          add_pick_constraints(komo, pick_phase, pick_phase, pen_tip, r.ee_type,
+                               obj, pick_direction, C[obj]->shape->size);
         }
-      }
-    }
 
-    komo.run_prepare(0.0, false);
-    const auto inital_state = komo.pathConfig.getJointState();
-
-    const uint max_attempts = 10;
-    for (uint j = 0; j < max_attempts; ++j) {
-      // reset komo to initial state
-      komo.pathConfig.setJointState(inital_state);
-      komo.reset();
-
-      komo.run_prepare(0.0001, false);
-
-      // set orientation to the direction of the object and the goal
-      // respectively
-
-      uint r1_cnt = 0;
-      const std::string base_joint_name = get_base_joint_name(r.type);
-
-      for (const auto aj : komo.pathConfig.activeJoints) {
-        const uint ind = aj->qIndex;
-        if (aj->frame->name.contains(base_joint_name.c_str()) &&
-            aj->frame->name.contains(r.prefix.c_str())) {
-          // komo.x(ind) = cnt + j;
-          if (r1_cnt == 0) {
-            // compute orientation for robot to face towards box
-            komo.x(ind) = r1_obj_angle + rnd.uni(-1, 1) * j / max_attempts;
+        if (true) {
+          for (const auto &base_name : {r.prefix}) {
+            uintA bodies;
+            rai::Joint *j;
+            for (rai::Frame *f : komo.world.frames) {
+              if ((j = f->joint) && j->qDim() > 0 &&
+                  (f->name.contains(base_name.c_str()))) {
+                bodies.append(f->ID);
+              }
+            }
+            komo.addObjective({0, 3}, make_shared<F_qItself>(bodies, true), {},
+                              OT_sos, {1e0}, NoArr); // world.q, prec);
+
+            // enforce that the position of the robot is the same
+            if (sample_only_place){
+              komo.addObjective({0, 1}, make_shared<F_qItself>(bodies, false), {},
+                              OT_eq, {1e1}, komo.world.getJointState());
+            }
           }
-          if (r1_cnt == 1) {
-            // compute orientation for robot to face towards other robot
-            komo.x(ind) = r1_goal_angle + rnd.uni(-1, 1) * j / max_attempts;
-          }
-          ++r1_cnt;
         }
-      }
 
-      komo.pathConfig.setJointState(komo.x);
+        komo.run_prepare(0., false);
+      };
+
+      const KomoInitializer init = [&](KOMO &komo, const uint obj_id) {
+        add_initialization_noise(komo, rng, 0.0001);
+
+        // set orientation to the direction of the object and the goal
+        // respectively
+
+        uint r1_cnt = 0;
+        const std::string base_joint_name = get_base_joint_name(r.type);
+
+        for (const auto aj : komo.pathConfig.activeJoints) {
+          const uint ind = aj->qIndex;
+          if (aj->frame->name.contains(base_joint_name.c_str()) &&
+              aj->frame->name.contains(r.prefix.c_str())) {
+            // komo.x(ind) = cnt + j;
+            if (r1_cnt == 0) {
+              // compute orientation for robot to face towards box
+              komo.x(ind) = r1_obj_angle + noise(0) * j / max_attempts;
+            }
+            if (r1_cnt == 1) {
+              // compute orientation for robot to face towards other robot
+              komo.x(ind) = r1_goal_angle + noise(1) * j / max_attempts;
+            }
+            ++r1_cnt;
+          }
+        }
 
-      uintA objID;
-      objID.append(C[obj]->ID);
-      rai::Frame *obj1 =
-          komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 1 + objID)(0);
-      obj1->setPose(C[obj]->getPose());
+        komo.pathConfig.setJointState(komo.x);
 
-      rai::Frame *obj2 =
-          komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 2 + objID)(0);
-      obj2->setPose(C[goal]->getPose());
+        // the first restart starts from the solution of a similar problem
+        if (j == 0) {
+          seed.apply(komo, C);
+        }
 
-      komo.run_prepare(0.);
-      // std::cout << "init confg" << std::endl;
-      // komo.pathConfig.watch(true);
-      komo.run(options);
+        uintA objID;
+        objID.append(obj_id);
+        rai::Frame *obj1 =
+            komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 1 + objID)(0);
+        obj1->setPose(C[obj]->getPose());
+
+        rai::Frame *obj2 =
+            komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 2 + objID)(0);
+        obj2->setPose(C[goal]->getPose());
+      };
+
+      const auto komo_template =
+          solve_keyframe_problem(templates, template_key, C, obj, goal, build,
+                                 init, options);
+      if (!komo_template) {
+        return {};
+      }
+      KOMO &komo = komo_template->komo;
 
       const arr q0 = komo.getPath()[0]();
       const arr q1 = komo.getPath()[1]();
@@ -197,6 +224,7 @@ public:
       const double eq = komo.getReport(false).get<double>("eq");
 
       if (res1->isFeasible && res2->isFeasible && ineq < 1. && eq < 1.) {
+        seed.store({q0, q1});
         return {q0, q1};
 
         // std::cout << q0 << std::endl;
@@ -222,13 +250,110 @@ public:
         }
         // komo.pathConfig.watch(true);
       }
-    }
 
-    std::vector<arr> infeasible;
-    return infeasible;
+      return {};
+    };
+
+    return run_multistart(C, max_attempts, 2, attempt);
   }
 };
 
+std::vector<PickDirection>
+get_pick_directions(const bool attempt_all_directions) {
+  if (attempt_all_directions) {
+    return {PickDirection::NegZ, PickDirection::NegX, PickDirection::NegY,
+            PickDirection::PosZ, PickDirection::PosX, PickDirection::PosY};
+  }
+  return {PickDirection::NegZ};
+}
+
+// keyframes of the pick and place of object i with robot r, or an empty
+// vector if none could be found. Tries the directions one by one, starting
+// with the one from the top.
+std::vector<TaskPoses>
+compute_pick_and_place_keyframes(PickAndPlaceSampler &sampler, const Robot &r,
+                                 const uint i, const HeldObjects &held_objs,
+                                 const std::vector<PickDirection> &all_directions) {
+  const auto obj = STRING("obj" << i + 1);
+  const auto goal = STRING("goal" << i + 1);
+
+  bool is_held_by_other_robot = false;
+  bool is_held_by_this_robot = false;
+  for (const auto &robot_obj_pair: held_objs){
+    if (robot_obj_pair.second == obj && robot_obj_pair.first != r){
+      is_held_by_other_robot = true;
+      break;
+    }
+    if (robot_obj_pair.second == obj && robot_obj_pair.first == r){
+      is_held_by_this_robot = true;
+      break;
+    }
+  }
+
+  if (is_held_by_other_robot){
+    return {};
+  }
+
+  for (const auto &robot_obj_pair: held_objs){
+    if (r == robot_obj_pair.first){
+      // if we are planning keyframes for this robot, and the robot is holding something, 
+      // we need to disable the collision for this object
+      sampler.C[robot_obj_pair.second]->setContact(0);
+      break;
+    }
+  }
+
+  // TODO: figure out which direction is pointing in pos z-direction in
+  // world frame, and prioritize this on in our search
+  const auto obj_quat = sampler.C[obj]->getRelativeQuaternion();
+
+  // reorder the directions to make sure we try the one that points to the top first
+  std::vector<PickDirection> reordered_directions;
+  PickDirection pos_z_dir;
+  for (const auto &dir: all_directions){
+    if (euclideanDistance(dir_to_vec(dir), -get_pos_z_axis_dir(obj_quat)) < 1e-6){
+      reordered_directions.push_back(dir);
+      pos_z_dir = dir;
+      break;
+    }
+  }
+
+  for (const auto &dir: all_directions){
+    if (dir != pos_z_dir){
+      reordered_directions.push_back(dir);
+    }
+  }
+
+  std::vector<TaskPoses> keyframes;
+  for (const auto dir : reordered_directions) {
+    // C.watch(true);
+    if (euclideanDistance(dir_to_vec(dir), get_pos_z_axis_dir(obj_quat)) < 1e-6) {
+      spdlog::info("skipping direction " + to_string(dir) + " in pick-pose computation.");
+      continue;
+    }
+
+    const auto sol = sampler.sample(r, obj, goal, dir, is_held_by_this_robot);
+
+    if (sol.size() > 0) {
+      keyframes.push_back({sol[0], sol[1]});
+      spdlog::info("Found a solution");
+      break;
+    } else {
+      spdlog::info("Did not find a solution");
+    }
+  }
+
+  for (const auto &robot_obj_pair: held_objs){
+    if (r == robot_obj_pair.first){
+      // if we are planning keyframes for this robot, and the robot is holding something, 
+      // we need to re-enable the collision for this object
+      sampler.C[robot_obj_pair.second]->setContact(1);
+    }
+  }
+
+  return keyframes;
+}
+
 RobotTaskPoseMap compute_all_pick_and_place_positions(
     rai::Configuration C, const std::vector<Robot> &robots,
     const bool attempt_all_directions = false) {
@@ -243,12 +368,8 @@ RobotTaskPoseMap compute_all_pick_and_place_positions(
 
   delete_unnecessary_frames(C);
 
-  std::vector<PickDirection> all_directions = {PickDirection::NegZ};
-  if (attempt_all_directions) {
-    all_directions = {PickDirection::NegZ, PickDirection::NegX,
-                      PickDirection::NegY, PickDirection::PosZ,
-                      PickDirection::PosX, PickDirection::PosY};
-  }
+  const std::vector<PickDirection> all_directions =
+      get_pick_directions(attempt_all_directions);
 
   const auto pairs = get_cant_collide_pairs(C);
   C.fcl()->deactivatePairs(pairs);
@@ -256,97 +377,21 @@ RobotTaskPoseMap compute_all_pick_and_place_positions(
   PickAndPlaceSampler sampler(C);
 
   // check if we are currently holding an object with the robot that we are computing the keyframe for
-  std::vector<std::pair<Robot, rai::String>> held_objs;
-  for (const Robot &r : robots) {
-    for (const auto &c: sampler.C[STRING(r.prefix + "pen_tip")]->children){
-      // std::cout << c->name << std::endl;
-      if (c->name.contains("obj")){
-        held_objs.push_back(std::make_pair(r, c->name));
-      }
-    }
-  }
+  const HeldObjects held_objs = get_held_objects(sampler.C, robots);
 
   for (const Robot &r : robots) {
-    for (const auto &robot_obj_pair: held_objs){
-      if (r == robot_obj_pair.first){
-        // if we are planning keyframes for this robot, and the robot is holding something, 
-        // we need to disable the collision for this object
-        sampler.C[robot_obj_pair.second]->setContact(0);
-        break;
-      }
-    }
-
     for (uint i = 0; i < num_objects; ++i) {
-      const auto obj = STRING("obj" << i + 1);
-      const auto goal = STRING("goal" << i + 1);
-
-      bool is_held_by_other_robot = false;
-      bool is_held_by_this_robot = false;
-      for (const auto &robot_obj_pair: held_objs){
-        if (robot_obj_pair.second == obj && robot_obj_pair.first != r){
-          is_held_by_other_robot = true;
-          break;
-        }
-        if (robot_obj_pair.second == obj && robot_obj_pair.first == r){
-          is_held_by_this_robot = true;
-          break;
-        }
-      }
-
-      if (is_held_by_other_robot){
-        continue;
-      }
-
-      // TODO: figure out which direction is pointing in pos z-direction in
-      // world frame, and prioritize this on in our search
-      const auto obj_quat = C[obj]->getRelativeQuaternion();
-
-      // reorder the directions to make sure we try the one that points to the top first
-      std::vector<PickDirection> reordered_directions;
-      PickDirection pos_z_dir;
-      for (const auto &dir: all_directions){
-        if (euclideanDistance(dir_to_vec(dir), -get_pos_z_axis_dir(obj_quat)) < 1e-6){
-          reordered_directions.push_back(dir);
-          pos_z_dir = dir;
-          break;
-        }
-      }
-
-      for (const auto &dir: all_directions){
-        if (dir != pos_z_dir){
-          reordered_directions.push_back(dir);
-        }
-      }
-
-      for (const auto dir : reordered_directions) {
-        // C.watch(true);
-        if (euclideanDistance(dir_to_vec(dir), get_pos_z_axis_dir(obj_quat)) < 1e-6) {
-          spdlog::info("skipping direction " + to_string(dir) + " in pick-pose computation.");
-          continue;
-        }
-
-        const auto sol = sampler.sample(r, obj, goal, dir, is_held_by_this_robot);
-
-        if (sol.size() > 0) {
-          RobotTaskPair rtp;
-          rtp.robots = {r};
-          rtp.task = Task{.object = i, .type = PrimitiveType::pick};
-          rtpm[rtp].push_back({sol[0], sol[1]});
-          spdlog::info("Found a solution");
-          break;
-        } else {
-          spdlog::info("Did not find a solution");
-        }
-      }
-    }
-    for (const auto &robot_obj_pair: held_objs){
-      if (r == robot_obj_pair.first){
-        // if we are planning keyframes for this robot, and the robot is holding something, 
-        // we need to re-enable the collision for this object
-        sampler.C[robot_obj_pair.second]->setContact(1);
+      const auto keyframes = compute_pick_and_place_keyframes(
+          sampler, r, i, held_objs, all_directions);
+
+      if (keyframes.size() > 0) {
+        RobotTaskPair rtp;
+        rtp.robots = {r};
+        rtp.task = Task{.object = i, .type = PrimitiveType::pick};
+        rtpm[rtp] = keyframes;
       }
     }
   }
 
   return rtpm;
-}
\ No newline at end of file
+}
@@ -191,4 +191,20 @@ void add_pick_constraints(KOMO &komo, const double start, const int end,
       }
     }
   }
-}
\ No newline at end of file
+}
+
+// objects that are currently attached to the end effector of a robot
+typedef std::vector<std::pair<Robot, rai::String>> HeldObjects;
+
+HeldObjects get_held_objects(rai::Configuration &C,
+                             const std::vector<Robot> &robots) {
+  HeldObjects held_objs;
+  for (const Robot &r : robots) {
+    for (const auto &c : C[STRING(r.prefix + "pen_tip")]->children) {
+      if (c->name.contains("obj")) {
+        held_objs.push_back(std::make_pair(r, c->name));
+      }
+    }
+  }
+  return held_objs;
+}
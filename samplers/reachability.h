@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "json/json.h"
+
+#include <Core/array.h>
+#include <Kin/kin.h>
+
+#include "common/config.h"
+#include "common/env_util.h"
+#include "common/types.h"
+#include "samplers/pick_constraints.h"
+
+using json = nlohmann::ordered_json;
+
+// bitmask of the axes (in the order of PickDirection) that the vector is not
+// too far away from.
+unsigned char get_direction_mask(const arr &v, const double min_cos = 0.5) {
+  unsigned char mask = 0;
+  for (uint i = 0; i < 3; ++i) {
+    if (v(i) >= min_cos) {
+      mask |= 1 << (2 * i);
+    }
+    if (-v(i) >= min_cos) {
+      mask |= 1 << (2 * i + 1);
+    }
+  }
+  return mask;
+}
+
+// Voxelized reachability of the end effector of a robot, relative to its
+// base. Every voxel stores the directions (given by the z-axis of the end
+// effector in the frame of the base) the end effector can reach the voxel
+// with.
+// The map is built by sampling joint states and ignores collisions, i.e. it
+// can only be used to rule out problems.
+// Since the map is sampled, a (voxel, direction) cell that was never hit does
+// not mean that it is not reachable. Only the position is thus used to rule
+// out problems, see is_reachable().
+class ReachabilityMap {
+public:
+  // samples joint states of the robot, and marks the voxels the end effector
+  // ends up in. Afterwards, the false negative rate of is_reachable() is
+  // estimated on a tenth as many new samples, which are all reachable.
+  void build(rai::Configuration &C, const Robot &r, const uint num_samples,
+             const double _resolution = 0.05) {
+    resolution = _resolution;
+
+    const double extent = get_workspace_from_robot_type(r.type) + 0.3;
+    for (uint i = 0; i < 3; ++i) {
+      origin[i] = -extent;
+      dims[i] = uint(std::ceil(2 * extent / resolution)) + 1;
+    }
+    masks.assign(std::size_t(dims[0]) * dims[1] * dims[2], 0);
+
+    setActive(C, r);
+    const arr q0 = C.getJointState();
+    const arr lims = C.getLimits();
+
+    rai::Frame *base = C[STRING(r.prefix << "base")];
+    rai::Frame *ee = C[STRING(r.prefix << r.ee_frame_name)];
+
+    arr q = q0;
+    arr pos, z;
+    for (uint n = 0; n < num_samples; ++n) {
+      sample_ee(C, lims, base, ee, q, pos, z);
+
+      int ind[3];
+      if (!get_voxel(pos, ind)) {
+        continue;
+      }
+      masks[index(ind[0], ind[1], ind[2])] |= get_direction_mask(z);
+    }
+
+    const uint num_test_samples = std::max(num_samples / 10, 1u);
+    uint false_negatives = 0;
+    for (uint n = 0; n < num_test_samples; ++n) {
+      sample_ee(C, lims, base, ee, q, pos, z);
+      if (!is_reachable(pos)) {
+        ++false_negatives;
+      }
+    }
+
+    C.setJointState(q0);
+
+    uint cnt = 0;
+    for (const auto m : masks) {
+      cnt += (m != 0);
+    }
+    spdlog::info("Built reachability map for {} with {} reachable voxels, "
+                 "false negative rate on {} new samples: {}%",
+                 r.prefix, cnt, num_test_samples,
+                 100. * false_negatives / num_test_samples);
+  }
+
+  bool is_valid() const { return !masks.empty(); }
+
+  // checks if the position (in the frame of the base) can be reached from any
+  // direction. The direction bits are too sparse to reject on (6 bits per
+  // voxel, and a few samples per voxel for 7 dof arms), so a position is only
+  // rejected if no direction was reached anywhere in the neighbourhood of
+  // the voxel, and neither in the next larger neighbourhood. The second check
+  // only runs for the (rare) positions that fail the first one.
+  bool is_reachable(const arr &pos, const int dilation = 1) const {
+    if (!is_valid()) {
+      return true;
+    }
+
+    int ind[3];
+    if (!get_voxel(pos, ind)) {
+      return false;
+    }
+
+    return has_reachable_neighbour(ind, dilation) ||
+           has_reachable_neighbour(ind, dilation + 1);
+  }
+
+  bool load(const std::string &path) {
+    std::ifstream ifs(path);
+    if (!ifs.good()) {
+      return false;
+    }
+
+    const json jf = json::parse(ifs, nullptr, false);
+    if (jf.is_discarded()) {
+      spdlog::warn("Could not parse reachability map {}", path);
+      return false;
+    }
+
+    resolution = jf["resolution"];
+    for (uint i = 0; i < 3; ++i) {
+      origin[i] = jf["origin"][i];
+      dims[i] = jf["dims"][i];
+    }
+    masks.assign(std::size_t(dims[0]) * dims[1] * dims[2], 0);
+
+    // only the reachable voxels are stored, as pairs of index and mask
+    for (const auto &v : jf["voxels"]) {
+      const std::size_t ind = v[0];
+      if (ind < masks.size()) {
+        masks[ind] = v[1].get<unsigned char>();
+      }
+    }
+    return true;
+  }
+
+  void save(const std::string &path, const Robot &r) const {
+    json data;
+    data["robot_type"] = robot_type_to_string(r.type);
+    data["ee_type"] = ee_type_to_string(r.ee_type);
+    data["resolution"] = resolution;
+    data["origin"] = {origin[0], origin[1], origin[2]};
+    data["dims"] = {dims[0], dims[1], dims[2]};
+    data["voxels"] = json::array();
+    for (std::size_t i = 0; i < masks.size(); ++i) {
+      if (masks[i] != 0) {
+        data["voxels"].push_back({i, masks[i]});
+      }
+    }
+
+    std::ofstream ofs(path);
+    if (!ofs.good()) {
+      spdlog::warn("Could not write reachability map to {}", path);
+      return;
+    }
+    ofs << data;
+  }
+
+private:
+  // sets a random joint state, and returns the position and z-axis of the end
+  // effector in the frame of the base.
+  static void sample_ee(rai::Configuration &C, const arr &lims,
+                        rai::Frame *base, rai::Frame *ee, arr &q, arr &pos,
+                        arr &z) {
+    for (uint i = 0; i < q.N; ++i) {
+      double lb = lims(i, 0);
+      double ub = lims(i, 1);
+      if (ub < lb) {
+        lb = -RAI_PI;
+        ub = RAI_PI;
+      }
+      q(i) = rnd.uni(lb, ub);
+    }
+    C.setJointState(q);
+
+    const arr R = base->getRotationMatrix();
+    pos = ~R * (ee->getPosition() - base->getPosition());
+    const arr Ree = ee->getRotationMatrix();
+    z = ~R * arr{Ree(0, 2), Ree(1, 2), Ree(2, 2)};
+  }
+
+  bool has_reachable_neighbour(const int *ind, const int dilation) const {
+    for (int i = ind[0] - dilation; i <= ind[0] + dilation; ++i) {
+      for (int j = ind[1] - dilation; j <= ind[1] + dilation; ++j) {
+        for (int k = ind[2] - dilation; k <= ind[2] + dilation; ++k) {
+          if (i < 0 || j < 0 || k < 0 || i >= int(dims[0]) ||
+              j >= int(dims[1]) || k >= int(dims[2])) {
+            continue;
+          }
+          if (masks[index(i, j, k)] != 0) {
+            return true;
+          }
+        }
+      }
+    }
+    return false;
+  }
+
+  std::size_t index(const uint i, const uint j, const uint k) const {
+    return (std::size_t(i) * dims[1] + j) * dims[2] + k;
+  }
+
+  bool get_voxel(const arr &pos, int *ind) const {
+    for (uint i = 0; i < 3; ++i) {
+      ind[i] = int(std::round((pos(i) - origin[i]) / resolution));
+      if (ind[i] < 0 || ind[i] >= int(dims[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  double resolution = 0.05;
+  double origin[3]{0, 0, 0};
+  uint dims[3]{0, 0, 0};
+
+  std::vector<unsigned char> masks;
+};
+
+// maps of all robot and end effector types, loaded on first use from the
+// reachability folder.
+class ReachabilityMapRegistry {
+public:
+  static ReachabilityMapRegistry &instance() {
+    static ReachabilityMapRegistry registry;
+    return registry;
+  }
+
+  static std::string get_filename(const Robot &r) {
+    return global_params.reachability_path + "/" +
+           robot_type_to_string(r.type) + "_" + ee_type_to_string(r.ee_type) +
+           ".json";
+  }
+
+  // returns nullptr if there is no map for this type of robot
+  std::shared_ptr<const ReachabilityMap> get(const Robot &r) {
+    std::lock_guard<std::mutex> lock(m);
+    const std::string path = get_filename(r);
+    if (maps.count(path) == 0) {
+      auto map = std::make_shared<ReachabilityMap>();
+      if (map->load(path)) {
+        spdlog::info("Loaded reachability map {}", path);
+        maps[path] = map;
+      } else {
+        spdlog::warn("No reachability map at {}, using the workspace radius "
+                     "instead. Run the mode build_reachability_maps first.",
+                     path);
+        maps[path] = nullptr;
+      }
+    }
+    return maps[path];
+  }
+
+private:
+  std::map<std::string, std::shared_ptr<const ReachabilityMap>> maps;
+  std::mutex m;
+};
+
+// checks if the end effector of the robot with the given base pose can reach
+// the position (in world coordinates).
+// Falls back to the radius of the workspace if there is no map for the robot.
+// Does not access the configuration, i.e. can be used concurrently.
+bool is_reachable(const Robot &r, const arr &base_pos, const arr &base_rot,
+                  const arr &pos) {
+  const auto map = global_params.use_reachability_maps
+                       ? ReachabilityMapRegistry::instance().get(r)
+                       : nullptr;
+  if (!map) {
+    return euclideanDistance(pos, base_pos) <=
+           get_workspace_from_robot_type(r.type);
+  }
+
+  return map->is_reachable(~base_rot * (pos - base_pos));
+}
+
+bool is_reachable(rai::Configuration &C, const Robot &r, const arr &pos) {
+  rai::Frame *base = C[STRING(r.prefix << "base")];
+  return is_reachable(r, base->getPosition(), base->getRotationMatrix(), pos);
+}
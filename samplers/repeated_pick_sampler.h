@@ -1,5 +1,9 @@
 #pragma once
 
+#include <map>
+#include <string>
+#include <tuple>
+
 #include "spdlog/spdlog.h"
 
 #include <Geo/fclInterface.h>
@@ -10,9 +14,37 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 
+#include "samplers/komo_template.h"
+#include "samplers/multistart.h"
 #include "samplers/pick_constraints.h"
-
-bool solve_problem_without_collision() {}
+#include "samplers/seed_bank.h"
+
+// orientation of the object when it is placed on the table between the picks
+void add_intermediate_direction_objective(KOMO &komo, const double time,
+                                          const rai::String &obj,
+                                          const rai::String &link_to_frame,
+                                          const PickDirection intermediate_dir) {
+  const double dir_weight = 5e1;
+  if (intermediate_dir == PickDirection::NegZ) {
+    komo.addObjective({time, time}, FS_scalarProductZZ, {obj, link_to_frame},
+                      OT_eq, {dir_weight}, {-1.});
+  } else if (intermediate_dir == PickDirection::PosZ) {
+    komo.addObjective({time, time}, FS_scalarProductZZ, {obj, link_to_frame},
+                      OT_eq, {dir_weight}, {1.});
+  } else if (intermediate_dir == PickDirection::NegX) {
+    komo.addObjective({time, time}, FS_scalarProductXZ, {obj, link_to_frame},
+                      OT_eq, {dir_weight}, {-1.});
+  } else if (intermediate_dir == PickDirection::PosX) {
+    komo.addObjective({time, time}, FS_scalarProductXZ, {obj, link_to_frame},
+                      OT_eq, {dir_weight}, {1.});
+  } else if (intermediate_dir == PickDirection::NegY) {
+    komo.addObjective({time, time}, FS_scalarProductYZ, {obj, link_to_frame},
+                      OT_eq, {dir_weight}, {-1.});
+  } else if (intermediate_dir == PickDirection::PosY) {
+    komo.addObjective({time, time}, FS_scalarProductYZ, {obj, link_to_frame},
+                      OT_eq, {dir_weight}, {1.});
+  }
+}
 
 class RepeatedPickSampler {
 public:
@@ -29,6 +61,126 @@ public:
 
   rai::Configuration C;
   OptOptions options;
+  KomoTemplateCache templates;
+
+  // cache of the feasibility of the single arm legs, keyed by
+  // (leg, robot id, object, first direction, second direction)
+  std::map<std::tuple<uint, uint, std::string, int, int>, bool>
+      leg_feasibility;
+
+  uintA get_joint_frame_ids(const KOMO &komo, const std::string &prefix) {
+    uintA ids;
+    rai::Joint *j;
+    for (rai::Frame *f : komo.world.frames) {
+      if ((j = f->joint) && j->qDim() > 0 &&
+          (f->name.contains(prefix.c_str()))) {
+        ids.append(f->ID);
+      }
+    }
+    return ids;
+  }
+
+  // Single arm subproblems of the repeated pick, without collisions:
+  // leg 0: r picks the object with dir_a, and places it on the table with
+  // orientation dir_b.
+  // leg 1: the object lies on the table with orientation dir_a, and r picks
+  // it with dir_b and places it at the goal.
+  // The legs are solved with the same restarts as the full problem (see
+  // samplers/multistart.h), such that an infeasible leg means the same as a
+  // failed full problem.
+  bool is_leg_feasible(const uint leg, const Robot &r, const rai::String &obj,
+                       const rai::String &goal, const PickDirection dir_a,
+                       const PickDirection dir_b) {
+    const auto key =
+        std::make_tuple(leg, r.id, std::string(obj.p), int(dir_a), int(dir_b));
+    const auto it = leg_feasibility.find(key);
+    if (it != leg_feasibility.end()) {
+      return it->second;
+    }
+
+    const auto pen_tip = STRING(r << r.ee_frame_name);
+    const auto link_to_frame = STRING("table");
+
+    const double pick_time = leg == 0 ? 1. : 2.;
+    const double place_time = leg == 0 ? 2. : 1.;
+    const PickDirection pick_dir = leg == 0 ? dir_a : dir_b;
+    const PickDirection intermediate_dir = leg == 0 ? dir_b : dir_a;
+
+    // only the joints of this robot are optimized
+    setActive(C, r);
+
+    const uint max_attempts = 5;
+    const uint num_slices = leg == 0 ? 2 : 3;
+    const KeyframeAttempt attempt = [&](const uint j, rai::Configuration &C,
+                                        const arr &noise,
+                                        std::mt19937 &) -> std::vector<arr> {
+      KOMO komo;
+      komo.verbose = 0;
+      komo.setModel(C, false);
+      komo.setDiscreteOpt(num_slices);
+      komo.add_jointLimits(true, 0., 1e1);
+
+      Skeleton S;
+      if (leg == 0) {
+        S.append({1., 2., SY_touch, {pen_tip, obj}});
+        S.append({1., 2., SY_stable, {pen_tip, obj}});
+        S.append({2., -1, SY_stable, {link_to_frame, obj}});
+      } else {
+        S.append({1., 2., SY_stable, {link_to_frame, obj}});
+        S.append({2., 3., SY_touch, {pen_tip, obj}});
+        S.append({2., 3., SY_stable, {pen_tip, obj}});
+        S.append({3., -1, SY_poseEq, {obj, goal}});
+      }
+      komo.setSkeleton(S);
+
+      add_pick_constraints(komo, pick_time, pick_time + 1, pen_tip, r.ee_type,
+                           obj, pick_dir, C[obj]->shape->size);
+
+      komo.addObjective({place_time, place_time}, FS_distance,
+                        {link_to_frame, obj}, OT_ineq, {-1e1}, {-0.04});
+      komo.addObjective({place_time, place_time}, FS_distance,
+                        {link_to_frame, obj}, OT_ineq, {1e1}, {0.05});
+      add_intermediate_direction_objective(komo, place_time, obj,
+                                           link_to_frame, intermediate_dir);
+
+      komo.addObjective(
+          {0, 5},
+          make_shared<F_qItself>(get_joint_frame_ids(komo, r.prefix), true),
+          {}, OT_sos, {1e1}, NoArr);
+
+      komo.run_prepare(0.0, false);
+
+      // the first restart starts from the current pose, the others rotate
+      // the base in every time slice, as the restarts of the full problem
+      const std::string base_joint_name = get_base_joint_name(r.type);
+      uint cnt = 0;
+      for (const auto aj : komo.pathConfig.activeJoints) {
+        if (aj->frame->name.contains(base_joint_name.c_str()) &&
+            aj->frame->name.contains(r.prefix.c_str())) {
+          komo.x(aj->qIndex) +=
+              noise(std::min(cnt, num_slices - 1)) * j / max_attempts;
+          ++cnt;
+        }
+      }
+      komo.pathConfig.setJointState(komo.x);
+
+      auto subproblem_options = options;
+      subproblem_options.nonStrictSteps = 200;
+      komo.run(subproblem_options);
+
+      const double ineq = komo.getReport(false).get<double>("ineq");
+      const double eq = komo.getReport(false).get<double>("eq");
+      if (ineq <= 1 && eq <= 1) {
+        return {komo.x};
+      }
+      return {};
+    };
+
+    const bool feasible =
+        run_multistart(C, max_attempts, num_slices, attempt).size() > 0;
+    leg_feasibility[key] = feasible;
+    return feasible;
+  }
 
   void
   setup_problem(KOMO &komo, const Robot &r1, const Robot &r2,
@@ -72,26 +224,8 @@ public:
     komo.addObjective({2., 3.}, FS_distance, {link_to_frame, obj}, OT_ineq,
                       {1e1}, {0.05});
 
-    const double dir_weight = 5e1;
-    if (intermediate_dir == PickDirection::NegZ) {
-      komo.addObjective({2., 2.}, FS_scalarProductZZ, {obj, link_to_frame},
-                        OT_eq, {dir_weight}, {-1.});
-    } else if (intermediate_dir == PickDirection::PosZ) {
-      komo.addObjective({2., 2.}, FS_scalarProductZZ, {obj, link_to_frame},
-                        OT_eq, {dir_weight}, {1.});
-    } else if (intermediate_dir == PickDirection::NegX) {
-      komo.addObjective({2., 2.}, FS_scalarProductXZ, {obj, link_to_frame},
-                        OT_eq, {dir_weight}, {-1.});
-    } else if (intermediate_dir == PickDirection::PosX) {
-      komo.addObjective({2., 2.}, FS_scalarProductXZ, {obj, link_to_frame},
-                        OT_eq, {dir_weight}, {1.});
-    } else if (intermediate_dir == PickDirection::NegY) {
-      komo.addObjective({2., 2.}, FS_scalarProductYZ, {obj, link_to_frame},
-                        OT_eq, {dir_weight}, {-1.});
-    } else if (intermediate_dir == PickDirection::PosY) {
-      komo.addObjective({2., 2.}, FS_scalarProductYZ, {obj, link_to_frame},
-                        OT_eq, {dir_weight}, {1.});
-    }
+    add_intermediate_direction_objective(komo, 2., obj, link_to_frame,
+                                         intermediate_dir);
 
     // komo.addObjective({2., 2.}, FS_scalarProductZZ, {obj, link_to_frame},
     // OT_eq,
@@ -107,13 +241,7 @@ public:
       }
 
       for (const auto &base_name : roots) {
-        rai::Joint *j;
-        for (rai::Frame *f : komo.world.frames) {
-          if ((j = f->joint) && j->qDim() > 0 &&
-              (f->name.contains(base_name.c_str()))) {
-            bodies.append(f->ID);
-          }
-        }
+        bodies.append(get_joint_frame_ids(komo, base_name));
       }
       komo.addObjective({0, 5}, make_shared<F_qItself>(bodies, true), {},
                         OT_sos, {1e1}, NoArr); // world.q, prec);
@@ -166,6 +294,21 @@ public:
       return {};
     }
 
+    // check the legs of the individual robots first, they are shared between
+    // many direction triples and cached.
+    if (global_params.prune_pick_pick_legs) {
+      if ((sample_pick &&
+           !is_leg_feasible(0, r1, obj, goal, pd1, intermediate_direction)) ||
+          !is_leg_feasible(1, r2, obj, goal, intermediate_direction, pd2)) {
+        spdlog::info("Skipping pickpick keyframe computation for obj {} and "
+                     "robots {}, {} since a single arm leg is infeasible",
+                     obj.p, r1.prefix, r2.prefix);
+        setActive(C, std::vector<Robot>{r1, r2});
+        return {};
+      }
+      setActive(C, std::vector<Robot>{r1, r2});
+    }
+
     // solve simpler subproblem to check for feasibility.
     {
       KOMO komo;
@@ -203,18 +346,35 @@ public:
       }
     }
 
-    KOMO komo;
-    komo.verbose = 0;
-    komo.setModel(C, true);
-    // komo.animateOptimization = 5;
+    // the problem is only set up once for all attempts, see
+    // samplers/komo_template.h
+    // the place problem keeps the robots at their current pose, which holds
+    // the object, i.e. it can not be shared with other objects
+    const std::string template_key =
+        (sample_pick ? std::string("pick_pick;") + get_shape_key(C[obj])
+                     : std::string("pick_pick_place;") + obj.p + ";" +
+                           get_joint_state_key(C)) +
+        ";" + get_shape_key(C[goal]) + ";" + r1.prefix + ";" + r2.prefix +
+        ";" + to_string(pd1) + ";" + to_string(intermediate_direction) + ";" +
+        to_string(pd2);
+
+    const KomoBuilder build = [&](KOMO &komo, const bool collisions) {
+      komo.verbose = 0;
+      komo.setModel(C, true);
+      // komo.animateOptimization = 5;
 
-    komo.setDiscreteOpt(4);
+      komo.setDiscreteOpt(4);
 
-    komo.add_collision(true, .05, 1e1);
-    komo.add_jointLimits(true, 0., 1e1);
+      if (collisions) {
+        komo.add_collision(true, .05, 1e1);
+      }
+      komo.add_jointLimits(true, 0., 1e1);
+
+      // add constraints and costs for alignment
+      setup_problem(komo, r1, r2, obj, goal, pd1, intermediate_direction, pd2, sample_pick);
 
-    // add constraints and costs for alignment
-    setup_problem(komo, r1, r2, obj, goal, pd1, intermediate_direction, pd2, sample_pick);
+      komo.run_prepare(0.0, false);
+    };
 
     const auto r1_pen_tip = STRING(r1 << "pen_tip");
     const auto r2_pen_tip = STRING(r2 << "pen_tip");
@@ -235,70 +395,79 @@ public:
     const double r2_goal_angle =
         std::atan2(goal_pos(1) - r2_pos(1), goal_pos(0) - r2_pos(0)) - r2_z_rot;
 
+    const KeyframeSeed seed(C, sample_pick ? "pick_pick" : "pick_pick_place",
+                            {r1, r2}, obj, {pd1, intermediate_direction, pd2},
+                            {obj_pos, goal_pos, r2_pos});
+
     const uint max_attempts = 5;
     for (uint j = 0; j < max_attempts; ++j) {
-      komo.run_prepare(0.00001, false);
-
-      const std::string r1_base_joint_name = get_base_joint_name(r1.type);
-      const std::string r2_base_joint_name = get_base_joint_name(r2.type);
-
-      uint r1_cnt = 0;
-      uint r2_cnt = 0;
-      for (const auto aj : komo.pathConfig.activeJoints) {
-        const uint ind = aj->qIndex;
-        if (aj->frame->name.contains(r1_base_joint_name.c_str()) &&
-            aj->frame->name.contains(r1.prefix.c_str())) {
-          // komo.x(ind) = cnt + j;
-          if (r1_cnt == 0) {
-            // compute orientation for robot to face towards box
-            komo.x(ind) = r1_obj_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+      const KomoInitializer init = [&](KOMO &komo, const uint obj_id) {
+        komo.run_prepare(0.00001, false);
+
+        const std::string r1_base_joint_name = get_base_joint_name(r1.type);
+        const std::string r2_base_joint_name = get_base_joint_name(r2.type);
+
+        uint r1_cnt = 0;
+        uint r2_cnt = 0;
+        for (const auto aj : komo.pathConfig.activeJoints) {
+          const uint ind = aj->qIndex;
+          if (aj->frame->name.contains(r1_base_joint_name.c_str()) &&
+              aj->frame->name.contains(r1.prefix.c_str())) {
+            // komo.x(ind) = cnt + j;
+            if (r1_cnt == 0) {
+              // compute orientation for robot to face towards box
+              komo.x(ind) = r1_obj_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+            }
+            if (r1_cnt == 1) {
+              // compute orientation for robot to face towards other robot
+              komo.x(ind) = r1_r2_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+            }
+            ++r1_cnt;
           }
-          if (r1_cnt == 1) {
-            // compute orientation for robot to face towards other robot
-            komo.x(ind) = r1_r2_angle + (rnd.uni(-1, 1) * j) / max_attempts;
-          }
-          ++r1_cnt;
-        }
 
-        if (aj->frame->name.contains(r2_base_joint_name.c_str()) &&
-            aj->frame->name.contains(r2.prefix.c_str())) {
-          // komo.x(ind) = cnt + j;
-          if (r2_cnt == 2) {
-            // compute orientation for robot to face towards box
-            komo.x(ind) = r2_r1_angle + (rnd.uni(-1, 1) * j) / max_attempts;
-          }
-          if (r2_cnt == 3) {
-            // compute orientation for robot to face towards other robot
-            komo.x(ind) = r2_goal_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+          if (aj->frame->name.contains(r2_base_joint_name.c_str()) &&
+              aj->frame->name.contains(r2.prefix.c_str())) {
+            // komo.x(ind) = cnt + j;
+            if (r2_cnt == 2) {
+              // compute orientation for robot to face towards box
+              komo.x(ind) = r2_r1_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+            }
+            if (r2_cnt == 3) {
+              // compute orientation for robot to face towards other robot
+              komo.x(ind) = r2_goal_angle + (rnd.uni(-1, 1) * j) / max_attempts;
+            }
+            ++r2_cnt;
           }
-          ++r2_cnt;
         }
-      }
 
-      komo.pathConfig.setJointState(komo.x);
-      for (const auto f : komo.pathConfig.frames) {
-        if (f->name == obj) {
-          f->setPose(C[obj]->getPose());
-        }
-      }
-
-      uintA objID;
-      objID.append(C[obj]->ID);
-      // rai::Frame *obj2 =
-      //     komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 3 +
-      //     objID)(0);
-      // arr rndpos(2);
-      // rndUniform(rndpos, -1, 1);
-      // obj2->setRelativePosition({rndpos(0), rndpos(1),
-      // C[obj]->getRelativePosition()(2)});
+        komo.pathConfig.setJointState(komo.x);
 
-      rai::Frame *obj3 =
-          komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 4 + objID)(0);
-      obj3->setPose(C[goal]->getPose());
-
-      komo.run_prepare(0.0, false);
+        // the first attempt starts from the solution of a similar problem
+        if (j == 0) {
+          seed.apply(komo, C);
+        }
 
-      komo.run(options);
+        uintA objID;
+        objID.append(obj_id);
+        // rai::Frame *obj2 =
+        //     komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 3 +
+        //     objID)(0);
+        // arr rndpos(2);
+        // rndUniform(rndpos, -1, 1);
+        // obj2->setRelativePosition({rndpos(0), rndpos(1),
+        // C[obj]->getRelativePosition()(2)});
+
+        rai::Frame *obj3 =
+            komo.pathConfig.getFrames(komo.pathConfig.frames.d1 * 4 + objID)(0);
+        obj3->setPose(C[goal]->getPose());
+      };
+
+      const auto komo_template = solve_keyframe_problem(
+          templates, template_key, C, obj, goal, build, init, options);
+      if (!komo_template) {
+        continue;
+      }
+      KOMO &komo = komo_template->komo;
 
       // komo.pathConfig.watch(true);
 
@@ -348,6 +517,7 @@ public:
 
         C.setJointState(home);
 
+        seed.store({q0, q1, q2, q3});
         return {pick_pose, place_pose, pick_2_pose, place_2_pose};
       }
     }
@@ -365,17 +535,8 @@ std::vector<arr> compute_pick_and_place_with_intermediate_pose(
   return sampler.sample(r1, r2, obj, goal, pd1, intermediate_direction, pd2);
 }
 
-RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
-    rai::Configuration C, const std::vector<Robot> &robots,
-    const bool attempt_all_directions = false,
-    const bool allow_repeated_handling = false) {
-  uint num_objects = 0;
-  for (auto f : C.frames) {
-    if (f->name.contains("obj")) {
-      num_objects += 1;
-    }
-  }
-
+std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+get_repeated_pick_directions(const bool attempt_all_directions) {
   std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
       all_directions;
   if (attempt_all_directions) {
@@ -391,6 +552,112 @@ RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
     all_directions = {std::make_tuple(PickDirection::NegZ, PickDirection::PosZ,
                                       PickDirection::NegZ)};
   }
+  return all_directions;
+}
+
+// keyframes of picking object i with r1, placing it at an intermediate pose,
+// and picking it from there with r2. Returns the keyframes of the first and
+// the second part (pick_pick_1 and pick_pick_2), or an empty vector if none
+// could be found.
+std::vector<TaskPoses> compute_repeated_pick_keyframes(
+    RepeatedPickSampler &sampler, const Robot &r1, const Robot &r2,
+    const uint i, const HeldObjects &held_objs,
+    const std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+        &all_directions) {
+  const auto obj = STRING("obj" << i + 1);
+  const auto goal = STRING("goal" << i + 1);
+
+  bool is_held_by_other_robot = false;
+  bool is_held_by_this_robot = false;
+  for (const auto &robot_obj_pair: held_objs){
+    if (robot_obj_pair.second == obj && robot_obj_pair.first != r1){
+      is_held_by_other_robot = true;
+      break;
+    }
+    if (robot_obj_pair.second == obj && robot_obj_pair.first == r1){
+      is_held_by_this_robot = true;
+      break;
+    }
+  }
+
+  if (is_held_by_other_robot){
+    return {};
+  }
+
+  for (const auto &robot_obj_pair: held_objs){
+    if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
+      // if we are planning keyframes for this robot, and the robot is holding something, 
+      // we need to disable the collision for this object
+      sampler.C[robot_obj_pair.second]->setContact(0);
+      break;
+    }
+  }
+
+  const auto obj_quat = sampler.C[obj]->getRelativeQuaternion();
+  const auto goal_quat = sampler.C[goal]->getRelativeQuaternion();
+
+  std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+      reordered_directions;
+  for (const auto &d : all_directions) {
+    if (euclideanDistance(dir_to_vec(std::get<0>(d)),
+                          -get_pos_z_axis_dir(obj_quat)) < 1e-6 ||
+        euclideanDistance(dir_to_vec(std::get<2>(d)),
+                          -get_pos_z_axis_dir(obj_quat)) < 1e-6) {
+      reordered_directions.push_back(d);
+    }
+  }
+
+  for (const auto &dir : all_directions) {
+    if (std::find(reordered_directions.begin(),
+                  reordered_directions.end(),
+                  dir) == reordered_directions.end()) {
+      reordered_directions.push_back(dir);
+    }
+  }
+
+  std::vector<TaskPoses> keyframes;
+  for (const auto &d : reordered_directions) {
+    if (euclideanDistance(dir_to_vec(std::get<0>(d)),
+                          get_pos_z_axis_dir(obj_quat)) < 1e-6 ||
+        euclideanDistance(dir_to_vec(std::get<2>(d)),
+                          get_pos_z_axis_dir(goal_quat)) < 1e-6) {
+      continue;
+    }
+
+    const auto sol = sampler.sample(r1, r2, obj, goal, std::get<0>(d),
+                                    std::get<1>(d), std::get<2>(d), !is_held_by_this_robot);
+
+    if (sol.size() > 0) {
+      keyframes = {{sol[0], sol[1]}, {sol[2], sol[3]}};
+      break;
+    }
+  }
+
+  for (const auto &robot_obj_pair: held_objs){
+    if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
+      // if we are planning keyframes for this robot, and the robot is holding something, 
+      // we need to disable the collision for this object
+      sampler.C[robot_obj_pair.second]->setContact(1);
+      break;
+    }
+  }
+
+  return keyframes;
+}
+
+RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
+    rai::Configuration C, const std::vector<Robot> &robots,
+    const bool attempt_all_directions = false,
+    const bool allow_repeated_handling = false) {
+  uint num_objects = 0;
+  for (auto f : C.frames) {
+    if (f->name.contains("obj")) {
+      num_objects += 1;
+    }
+  }
+
+  const auto all_directions =
+      get_repeated_pick_directions(attempt_all_directions);
 
   delete_unnecessary_frames(C);
   const auto pairs = get_cant_collide_pairs(C);
@@ -400,123 +667,32 @@ RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
 
   RepeatedPickSampler sampler(C);
 
-  std::vector<std::pair<Robot, rai::String>> held_objs;
-  for (const Robot &r : robots) {
-    for (const auto &c : sampler.C[STRING(r.prefix + "pen_tip")]->children) {
-      // std::cout << c->name << std::endl;
-      if (c->name.contains("obj")) {
-        held_objs.push_back(std::make_pair(r, c->name));
-      }
-    }
-  }
+  const HeldObjects held_objs = get_held_objects(sampler.C, robots);
 
   for (const auto &r1 : robots) {
     for (const auto &r2 : robots) {
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(0);
-          break;
-        }
-      }
-
       // if (r1 == r2 && !allow_repeated_handling) {
       //   continue;
       // }
 
       for (uint i = 0; i < num_objects; ++i) {
-        const auto obj = STRING("obj" << i + 1);
-        const auto goal = STRING("goal" << i + 1);
-
-        bool is_held_by_other_robot = false;
-        bool is_held_by_this_robot = false;
-        for (const auto &robot_obj_pair: held_objs){
-          if (robot_obj_pair.second == obj && robot_obj_pair.first != r1){
-            is_held_by_other_robot = true;
-            break;
-          }
-          if (robot_obj_pair.second == obj && robot_obj_pair.first == r1){
-            is_held_by_this_robot = true;
-            break;
-          }
-        }
-
-        if (is_held_by_other_robot){
-          continue;
-        }
-
-        const auto obj_quat = C[obj]->getRelativeQuaternion();
-        const auto goal_quat = C[goal]->getRelativeQuaternion();
-
-        std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
-            reordered_directions;
-        for (const auto &d : all_directions) {
-          if (euclideanDistance(dir_to_vec(std::get<0>(d)),
-                                -get_pos_z_axis_dir(obj_quat)) < 1e-6 ||
-              euclideanDistance(dir_to_vec(std::get<2>(d)),
-                                -get_pos_z_axis_dir(obj_quat)) < 1e-6) {
-            reordered_directions.push_back(d);
-          }
-        }
-
-        for (const auto &dir : all_directions) {
-          if (std::find(reordered_directions.begin(),
-                        reordered_directions.end(),
-                        dir) == reordered_directions.end()) {
-            reordered_directions.push_back(dir);
-          }
-        }
-
-        for (const auto &d : reordered_directions) {
-          // C.watch(true);
-          // std::cout << "looking at  " << to_string(std::get<0>(d)) <<
-          // std::endl; std::cout << "looking at " << to_string(std::get<2>(d))
-          // << std::endl;
-
-          // std::cout << get_pos_z_axis_dir(obj_quat) << std::endl;
-          // std::cout << get_pos_z_axis_dir(goal_quat) << std::endl;
-
-          if (euclideanDistance(dir_to_vec(std::get<0>(d)),
-                                get_pos_z_axis_dir(obj_quat)) < 1e-6 ||
-              euclideanDistance(dir_to_vec(std::get<2>(d)),
-                                get_pos_z_axis_dir(goal_quat)) < 1e-6) {
-            // std::cout << "skipping " << to_string(std::get<0>(d)) <<
-            // std::endl; std::cout << "skipping " << to_string(std::get<2>(d))
-            // << std::endl;
-            continue;
-          }
-
-          const auto sol = sampler.sample(r1, r2, obj, goal, std::get<0>(d),
-                                          std::get<1>(d), std::get<2>(d), !is_held_by_this_robot);
-
-          if (sol.size() > 0) {
-            // std::cout << to_string(std::get<0>(d)) << " " <<
-            // to_string(std::get<1>(d)) << " " << to_string(std::get<2>(d)) <<
-            // std::endl;
-            RobotTaskPair rtp_1;
-            rtp_1.robots = {r1, r2};
-            rtp_1.task = Task{.object = i, .type = PrimitiveType::pick_pick_1};
-            rtpm[rtp_1].push_back({sol[0], sol[1]});
-
-            RobotTaskPair rtp_2;
-            rtp_2.robots = {r1, r2};
-            rtp_2.task = Task{.object = i, .type = PrimitiveType::pick_pick_2};
-            rtpm[rtp_2].push_back({sol[2], sol[3]});
-            break;
-          }
-        }
-      }
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(1);
-          break;
+        const auto keyframes = compute_repeated_pick_keyframes(
+            sampler, r1, r2, i, held_objs, all_directions);
+
+        if (keyframes.size() > 0) {
+          RobotTaskPair rtp_1;
+          rtp_1.robots = {r1, r2};
+          rtp_1.task = Task{.object = i, .type = PrimitiveType::pick_pick_1};
+          rtpm[rtp_1].push_back(keyframes[0]);
+
+          RobotTaskPair rtp_2;
+          rtp_2.robots = {r1, r2};
+          rtp_2.task = Task{.object = i, .type = PrimitiveType::pick_pick_2};
+          rtpm[rtp_2].push_back(keyframes[1]);
         }
       }
     }
   }
 
   return rtpm;
-}
\ No newline at end of file
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "json/json.h"
+
+#include <Kin/kin.h>
+
+#include "common/config.h"
+#include "common/spatial_hash.h"
+#include "common/types.h"
+#include "common/util.h"
+#include "planners/plan.h"
+#include "samplers/reachability.h"
+
+using json = nlohmann::ordered_json;
+
+struct SceneGeneratorSettings {
+  uint num_objects = 5;
+  uint num_obstacles = 0;
+
+  // side lengths of the footprints, and heights
+  double min_object_size = 0.02;
+  double max_object_size = 0.08;
+  double object_height = 0.06;
+
+  double min_obstacle_size = 0.05;
+  double max_obstacle_size = 0.2;
+  double obstacle_height = 0.1;
+
+  // minimum distance of everything to the robot bases, and minimum gap
+  // between two footprints
+  double base_clearance = 0.3;
+  double gap = 0.01;
+
+  // candidates per object, goal or obstacle
+  uint max_attempts = 1000;
+};
+
+// Generates random scenes (objects with goals, and obstacles) for a robot
+// environment, in the format of in/objects and in/obstacles.
+// Everything is placed on the table without collision queries: the
+// footprints that were placed already are kept in a spatial hash, and the
+// robots are only accounted for by a minimum distance to their bases.
+// Object and goal positions are checked for reachability by one of the robots
+// before they are placed.
+// Scenes only depend on their seed, i.e. batches can be generated in parallel.
+class SceneGenerator {
+public:
+  SceneGenerator(rai::Configuration &C, const std::vector<Robot> &_robots,
+                 const SceneGeneratorSettings &_settings)
+      : robots(_robots), settings(_settings) {
+    rai::Frame *table = C["table"];
+    table_pos = table->getPosition();
+    table_rot = table->getRotationMatrix();
+    table_yaw = std::atan2(table_rot(1, 0), table_rot(0, 0));
+
+    if (table->shape && table->getShape().type() == rai::ST_box) {
+      const arr size = table->getShape().size;
+      table_half_x = size(0) / 2;
+      table_half_y = size(1) / 2;
+      table_top = size(2) / 2;
+    }
+
+    for (const auto &r : robots) {
+      rai::Frame *base = C[STRING(r.prefix << "base")];
+      base_pos.push_back(base->getPosition());
+      base_rot.push_back(base->getRotationMatrix());
+      base_pos_on_table.push_back(~table_rot *
+                                  (base->getPosition() - table_pos));
+
+      // load the maps before they are used concurrently
+      if (global_params.use_reachability_maps) {
+        ReachabilityMapRegistry::instance().get(r);
+      }
+    }
+
+    // obstacles that are part of the environment already
+    for (const auto f : C.frames) {
+      if (f->parent != table || !f->shape || f->getShape().cont == 0 ||
+          f->getShape().type() != rai::ST_box || f->name.contains("obj") ||
+          f->name.contains("goal")) {
+        continue;
+      }
+
+      Footprint fp = get_footprint(f);
+      const arr pos = ~table_rot * (arr{fp.x, fp.y, 0.} - table_pos);
+      fp.x = pos(0);
+      fp.y = pos(1);
+      fp.yaw -= table_yaw;
+      static_footprints.push_back(fp);
+    }
+  }
+
+  // generates the scene with the given seed. Returns false if not everything
+  // could be placed.
+  bool generate(const uint seed, json &objects, json &obstacles) const {
+    std::mt19937 gen(seed);
+
+    FootprintHash placed(settings.max_obstacle_size);
+    for (const auto &fp : static_footprints) {
+      placed.insert(fp);
+    }
+
+    obstacles["obstacles"] = json::array();
+    for (uint i = 0; i < settings.num_obstacles; ++i) {
+      Footprint fp;
+      if (!sample_footprint(gen, placed, settings.min_obstacle_size,
+                            settings.max_obstacle_size,
+                            settings.min_obstacle_size,
+                            settings.max_obstacle_size,
+                            settings.obstacle_height, false, fp)) {
+        return false;
+      }
+      placed.insert(fp);
+
+      json obs;
+      obs["shape"] = "box";
+      obs["name"] = "obs_" + std::to_string(i);
+      obs["size"] = {2 * fp.half_x, 2 * fp.half_y, settings.obstacle_height};
+      obs["pos"] = get_position(fp, settings.obstacle_height);
+      obs["quat"] = get_quaternion(fp);
+      obstacles["obstacles"].push_back(obs);
+    }
+
+    objects["objects"] = json::array();
+    for (uint i = 0; i < settings.num_objects; ++i) {
+      Footprint start;
+      if (!sample_footprint(gen, placed, settings.min_object_size,
+                            settings.max_object_size, settings.min_object_size,
+                            settings.max_object_size, settings.object_height,
+                            true, start)) {
+        return false;
+      }
+      placed.insert(start);
+
+      // same size as the object
+      Footprint goal;
+      if (!sample_footprint(gen, placed, 2 * start.half_x, 2 * start.half_x,
+                            2 * start.half_y, 2 * start.half_y,
+                            settings.object_height, true, goal)) {
+        return false;
+      }
+      placed.insert(goal);
+
+      json obj;
+      obj["shape"] = {2 * start.half_x, 2 * start.half_y,
+                      settings.object_height};
+      obj["start_pos"] = get_position(start, settings.object_height);
+      obj["start_quat"] = get_quaternion(start);
+      obj["goal_pos"] = get_position(goal, settings.object_height);
+      obj["goal_quat"] = get_quaternion(goal);
+      objects["objects"].push_back(obj);
+    }
+
+    return true;
+  }
+
+  // generates the scenes seed, seed + 1, ... and writes them to
+  // path/objects/ and path/obstacles/. Returns the number of scenes that were
+  // written.
+  uint generate_batch(const uint num_scenes, const uint seed,
+                      const std::string &path,
+                      const uint num_threads = 0) const {
+    const int res = system(
+        STRING("mkdir -p " << path << "objects/ " << path << "obstacles/").p);
+    (void)res;
+
+    std::atomic<uint> cnt{0};
+    run_parallel(num_scenes, num_threads, [&](const uint i) {
+      json objects;
+      json obstacles;
+      if (!generate(seed + i, objects, obstacles)) {
+        spdlog::info("Could not generate scene {}", seed + i);
+        return;
+      }
+
+      const std::string name = "scene_" + std::to_string(seed + i) + ".json";
+      save_json(objects, path + "objects/" + name);
+      save_json(obstacles, path + "obstacles/" + name);
+      ++cnt;
+    });
+
+    return cnt;
+  }
+
+private:
+  // samples a footprint that does not overlap with the placed ones, close
+  // enough to a robot to be reachable. The footprint is given in the frame of
+  // the table.
+  bool sample_footprint(std::mt19937 &gen, const FootprintHash &placed,
+                        const double min_size_x, const double max_size_x,
+                        const double min_size_y, const double max_size_y,
+                        const double height, const bool check_reachability,
+                        Footprint &fp) const {
+    std::uniform_real_distribution<double> size_x(min_size_x, max_size_x);
+    std::uniform_real_distribution<double> size_y(min_size_y, max_size_y);
+    std::uniform_real_distribution<double> uni(0., 1.);
+    std::uniform_int_distribution<uint> robot(0, robots.size() - 1);
+
+    for (uint i = 0; i < settings.max_attempts; ++i) {
+      // uniformly on the annulus around the base of one of the robots
+      const uint k = robot(gen);
+      const double r_min = settings.base_clearance;
+      const double r_max = get_workspace_from_robot_type(robots[k].type);
+      const double r = std::sqrt(r_min * r_min +
+                                 uni(gen) * (r_max * r_max - r_min * r_min));
+      const double alpha = uni(gen) * 2 * RAI_PI;
+
+      fp.x = base_pos_on_table[k](0) + r * std::cos(alpha);
+      fp.y = base_pos_on_table[k](1) + r * std::sin(alpha);
+      fp.half_x = size_x(gen) / 2;
+      fp.half_y = size_y(gen) / 2;
+      fp.yaw = uni(gen) * 2 * RAI_PI;
+
+      if (!is_on_table(fp) || is_close_to_base(fp) ||
+          placed.collides(fp, settings.gap / 2)) {
+        continue;
+      }
+
+      if (check_reachability && !is_reachable_by_any_robot(fp, height)) {
+        continue;
+      }
+
+      return true;
+    }
+    return false;
+  }
+
+  bool is_on_table(const Footprint &fp) const {
+    if (table_half_x == 0. || table_half_y == 0.) {
+      return true;
+    }
+    return std::abs(fp.x) + fp.get_aabb_half_x() <= table_half_x &&
+           std::abs(fp.y) + fp.get_aabb_half_y() <= table_half_y;
+  }
+
+  bool is_close_to_base(const Footprint &fp) const {
+    for (const arr &p : base_pos_on_table) {
+      if (std::hypot(fp.x - p(0), fp.y - p(1)) < settings.base_clearance) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool is_reachable_by_any_robot(const Footprint &fp,
+                                 const double height) const {
+    // top of the object
+    const arr pos = table_pos + table_rot * arr{fp.x, fp.y, table_top + height};
+    for (uint k = 0; k < robots.size(); ++k) {
+      if (is_reachable(robots[k], base_pos[k], base_rot[k], pos)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // position relative to the table, slightly above its surface
+  std::vector<double> get_position(const Footprint &fp,
+                                   const double height) const {
+    return {fp.x, fp.y, table_top + height / 2 + 0.005};
+  }
+
+  static std::vector<double> get_quaternion(const Footprint &fp) {
+    return {std::cos(fp.yaw / 2), 0., 0., std::sin(fp.yaw / 2)};
+  }
+
+  std::vector<Robot> robots;
+  SceneGeneratorSettings settings;
+
+  arr table_pos;
+  arr table_rot;
+  double table_yaw = 0.;
+  // zero if the table is not a box, i.e. has no extent
+  double table_half_x = 0.;
+  double table_half_y = 0.;
+  double table_top = 0.;
+
+  std::vector<arr> base_pos;
+  std::vector<arr> base_rot;
+  std::vector<arr> base_pos_on_table;
+
+  std::vector<Footprint> static_footprints;
+};
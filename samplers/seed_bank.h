@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "json/json.h"
+
+#include <Core/array.h>
+#include <KOMO/komo.h>
+#include <Kin/kin.h>
+
+#include "common/config.h"
+#include "common/types.h"
+#include "planners/prioritized_planner.h"
+#include "samplers/pick_constraints.h"
+
+using json = nlohmann::ordered_json;
+
+// Keyframes of previously solved keyframe problems, used to warm start the
+// samplers.
+// Problems with the same structure (primitive, robot and end effector types,
+// object size and pick directions) share a key. Within a key, the problems
+// are described by the positions of the object, the goal and the other
+// robots relative to the base of the first robot. Since the joint states are
+// relative to the base as well, a solution can be reused for a different
+// placement of the whole cell.
+class KeyframeSeedBank {
+public:
+  static KeyframeSeedBank &instance() {
+    static KeyframeSeedBank bank;
+    return bank;
+  }
+
+  // keyframes of the closest problem with the same key, or an empty vector if
+  // there is none within max_distance.
+  std::vector<arr> query(const std::string &key, const arr &features,
+                         const double max_distance = 0.1) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = entries.find(key);
+    if (it == entries.end()) {
+      return {};
+    }
+
+    const Entry *best = nullptr;
+    double min_dist = max_distance;
+    for (const auto &e : it->second) {
+      if (e.features.N != features.N) {
+        continue;
+      }
+      const double dist = euclideanDistance(e.features, features);
+      if (dist <= min_dist) {
+        min_dist = dist;
+        best = &e;
+      }
+    }
+
+    if (!best) {
+      return {};
+    }
+    return best->keyframes;
+  }
+
+  // solutions that are very close to one that is already in the bank are not
+  // added again.
+  void add(const std::string &key, const arr &features,
+           const std::vector<arr> &keyframes,
+           const double min_distance = 0.01) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &key_entries = entries[key];
+    for (const auto &e : key_entries) {
+      if (e.features.N == features.N &&
+          euclideanDistance(e.features, features) < min_distance) {
+        return;
+      }
+    }
+    key_entries.push_back({features, keyframes});
+    modified = true;
+  }
+
+  uint size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint n = 0;
+    for (const auto &it : entries) {
+      n += it.second.size();
+    }
+    return n;
+  }
+
+  // merges the entries of the file into the bank. Files are only read once.
+  bool load(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (loaded_path == path) {
+      return true;
+    }
+
+    std::ifstream ifs(path);
+    if (!ifs.good()) {
+      return false;
+    }
+
+    const json jf = json::parse(ifs, nullptr, false);
+    if (jf.is_discarded()) {
+      spdlog::warn("Could not parse seed bank {}", path);
+      return false;
+    }
+
+    uint cnt = 0;
+    for (const auto &item : jf.items()) {
+      auto &key_entries = entries[item.key()];
+      for (const auto &e : item.value()) {
+        Entry entry;
+        entry.features = to_arr(e["features"]);
+        for (const auto &q : e["keyframes"]) {
+          entry.keyframes.push_back(to_arr(q));
+        }
+        key_entries.push_back(entry);
+        ++cnt;
+      }
+    }
+
+    loaded_path = path;
+    spdlog::info("Loaded {} keyframe seeds from {}", cnt, path);
+    return true;
+  }
+
+  // writes the bank if something was added since the last save
+  void save(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!modified) {
+      return;
+    }
+
+    json data;
+    for (const auto &it : entries) {
+      json key_entries = json::array();
+      for (const auto &e : it.second) {
+        json entry;
+        entry["features"] = to_vector(e.features);
+        entry["keyframes"] = json::array();
+        for (const auto &q : e.keyframes) {
+          entry["keyframes"].push_back(to_vector(q));
+        }
+        key_entries.push_back(entry);
+      }
+      data[it.first] = key_entries;
+    }
+
+    std::ofstream ofs(path);
+    if (!ofs.good()) {
+      spdlog::warn("Could not write seed bank to {}", path);
+      return;
+    }
+    ofs << data;
+    modified = false;
+  }
+
+private:
+  struct Entry {
+    arr features;
+    std::vector<arr> keyframes;
+  };
+
+  static std::vector<double> to_vector(const arr &a) {
+    return std::vector<double>(a.p, a.p + a.N);
+  }
+
+  static arr to_arr(const json &j) {
+    const std::vector<double> v = j;
+    arr a(v.size());
+    std::copy(v.begin(), v.end(), a.p);
+    return a;
+  }
+
+  std::map<std::string, std::vector<Entry>> entries;
+  std::string loaded_path;
+  bool modified = false;
+
+  mutable std::mutex mutex;
+};
+
+// Seed of a single keyframe problem: looks up the bank when it is
+// constructed, can initialize the komo problem with the result, and stores
+// new solutions.
+class KeyframeSeed {
+public:
+  KeyframeSeed(rai::Configuration &C, const std::string &primitive,
+               const std::vector<Robot> &_robots, const rai::String &obj,
+               const std::vector<PickDirection> &directions,
+               const std::vector<arr> &positions)
+      : robots(_robots) {
+    if (!global_params.use_seed_bank) {
+      return;
+    }
+
+    std::stringstream ss;
+    ss << primitive;
+    for (const auto &r : robots) {
+      ss << ";" << robot_type_to_string(r.type) << ","
+         << ee_type_to_string(r.ee_type);
+    }
+    for (const auto d : directions) {
+      ss << ";" << int(d);
+    }
+    // sizes in mm
+    ss << ";";
+    for (const double s : C[obj]->getShape().size) {
+      ss << int(std::round(s * 1000)) << ",";
+    }
+    key = ss.str();
+
+    // positions in the frame of the base of the first robot
+    rai::Frame *base = C[STRING(robots[0].prefix << "base")];
+    const arr base_pos = base->getPosition();
+    const arr R = base->getRotationMatrix();
+    for (const auto &p : positions) {
+      features.append(~R * (p - base_pos));
+    }
+
+    keyframes = KeyframeSeedBank::instance().query(key, features);
+    if (keyframes.size() > 0) {
+      spdlog::debug("Found keyframe seed for {}", key);
+    }
+  }
+
+  bool empty() const { return keyframes.size() == 0; }
+
+  // sets the keyframes as initialization of the komo problem, keyframe i is
+  // the joint state of the robots in the time slice i of the problem.
+  // expects the joints of the robots in C to be the active ones.
+  void apply(KOMO &komo, rai::Configuration &C) const {
+    if (empty()) {
+      return;
+    }
+
+    std::vector<uint> ids;
+    uint dim = 0;
+    for (const auto &r : robots) {
+      for (const auto f : get_robot_joints(C, r)) {
+        ids.push_back(f->ID);
+        dim += f->joint->qDim();
+      }
+    }
+    // the keyframes are in the order of the active joints
+    std::sort(ids.begin(), ids.end());
+
+    uintA frame_ids;
+    for (const uint id : ids) {
+      frame_ids.append(id);
+    }
+
+    for (uint i = 0; i < keyframes.size(); ++i) {
+      const uint t = i + komo.k_order;
+      if (keyframes[i].N != dim || t >= komo.timeSlices.d0) {
+        spdlog::warn("Keyframe seed for {} does not match the problem", key);
+        return;
+      }
+      komo.pathConfig.setJointStateSlice(keyframes[i], t, frame_ids);
+    }
+  }
+
+  void store(const std::vector<arr> &solution) const {
+    if (!global_params.use_seed_bank || solution.size() == 0) {
+      return;
+    }
+    KeyframeSeedBank::instance().add(key, features, solution);
+  }
+
+private:
+  std::vector<Robot> robots;
+
+  std::string key;
+  arr features;
+  std::vector<arr> keyframes;
+};
+
+void load_keyframe_seeds() {
+  if (global_params.use_seed_bank) {
+    KeyframeSeedBank::instance().load(global_params.seed_bank_path);
+  }
+}
+
+void save_keyframe_seeds() {
+  if (!global_params.use_seed_bank) {
+    return;
+  }
+
+  const std::string &path = global_params.seed_bank_path;
+  const int res = system(
+      STRING("mkdir -p " << path.substr(0, path.find_last_of('/') + 1)).p);
+  (void)res;
+  KeyframeSeedBank::instance().save(path);
+}
@@ -6,7 +6,7 @@
 #include "sequencing.h"
 
 Plan plan_multiple_arms_simulated_annealing(
-    rai::Configuration C, const RobotTaskPoseMap &rtpm,
+    const rai::Configuration &C, const RobotTaskPoseMap &rtpm,
     const std::unordered_map<Robot, arr> &home_poses) {
   std::time_t t = std::time(nullptr);
   std::tm tm = *std::localtime(&t);
@@ -29,9 +29,13 @@ Plan plan_multiple_arms_simulated_annealing(
   }
   auto seq = generate_random_sequence(robots, num_tasks);
 
+  // shared by all planning and export calls below, so that the configuration
+  // is not copied in every iteration.
+  const ConfigurationHandle C_shared(C);
+
   // plan for it
   const auto plan_result =
-      plan_multiple_arms_given_sequence(C, rtpm, seq, home_poses);
+      plan_multiple_arms_given_sequence(C_shared, rtpm, seq, home_poses);
 
   auto best_plan = plan_result.plan;
   uint best_makespan = get_makespan_from_plan(plan_result.plan);
@@ -46,7 +50,9 @@ Plan plan_multiple_arms_simulated_annealing(
     const auto duration =
         std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time)
             .count();
-    export_plan(C, robots, home_poses, best_plan, seq, buffer.str(), 0, duration);
+    export_plan(C_shared, robots, home_poses,
+                postprocess_plan(C_shared, best_plan, home_poses), seq,
+                buffer.str(), 0, duration);
   }
 
   auto p = [](const double e, const double eprime, const double temperature) {
@@ -82,7 +88,7 @@ Plan plan_multiple_arms_simulated_annealing(
 
     if (p(curr_makespan, lb_makespan, T) > rnd(0)) {
       const auto new_plan_result =
-          plan_multiple_arms_given_sequence(C, rtpm, seq_new, home_poses);
+          plan_multiple_arms_given_sequence(C_shared, rtpm, seq_new, home_poses);
 
       if (new_plan_result.status == PlanStatus::success) {
         const auto end_time = std::chrono::high_resolution_clock::now();
@@ -90,11 +96,13 @@ Plan plan_multiple_arms_simulated_annealing(
                                   end_time - start_time)
                                   .count();
 
-        const Plan new_plan = new_plan_result.plan;
+        const Plan &new_plan = new_plan_result.plan;
         const double makespan = get_makespan_from_plan(new_plan);
 
-        export_plan(C, robots, home_poses, new_plan, seq_new, buffer.str(), i + 1,
-                    duration);
+        export_plan(
+            C_shared, robots, home_poses,
+            postprocess_plan(C_shared, new_plan_result.plan, home_poses),
+            seq_new, buffer.str(), i + 1, duration);
 
         std::cout << "\n\n\nMAKESPAN " << makespan << " best so far "
                   << best_makespan << std::endl;
@@ -109,11 +117,14 @@ Plan plan_multiple_arms_simulated_annealing(
 
         if (makespan < best_makespan) {
           best_makespan = makespan;
-          best_plan = new_plan;
+          best_plan = new_plan_result.plan;
 
           const std::string image_path =
               global_params.output_path + buffer.str() + "/" + std::to_string(i) + "/img/";
-          visualize_plan(C, best_plan, true, image_path);
+          // visualization changes the configuration
+          rai::Configuration C_vis;
+          C_vis.copy(C);
+          visualize_plan(C_vis, best_plan, true, image_path);
         }
       }
     }
@@ -34,8 +34,12 @@ Plan plan_multiple_arms_greedy_random_search(
     }
   }
 
+  // shared by all planning and export calls below, so that the configuration
+  // is not copied in every iteration.
+  const ConfigurationHandle C_shared(C);
+
   OrderedTaskSequence best_seq;
-  Plan best_plan;
+  PlanHandle best_plan;
   double best_makespan = 1e6;
 
   auto start_time = std::chrono::high_resolution_clock::now();
@@ -65,7 +69,7 @@ Plan plan_multiple_arms_greedy_random_search(
       continue;
     }
 
-    Plan plan;
+    PlanHandle plan;
     double prev_makespan = 1e6;
     for (uint j = 0; j < max_inner_iterations; ++j) {
       ++iter;
@@ -105,9 +109,9 @@ Plan plan_multiple_arms_greedy_random_search(
 
       // plan for it
       PlanResult new_plan_result;
-      if (plan.empty()) {
+      if (plan->empty()) {
         new_plan_result = plan_multiple_arms_given_sequence(
-            C, rtpm, new_seq, home_poses, prev_makespan);
+            C_shared, rtpm, new_seq, home_poses, prev_makespan);
       } else {
         // compute index where the new sequence starts
         uint change_in_sequence = 0;
@@ -121,12 +125,12 @@ Plan plan_multiple_arms_greedy_random_search(
         std::cout << "planning only subsequence " << change_in_sequence
                   << std::endl;
         new_plan_result = plan_multiple_arms_given_subsequence_and_prev_plan(
-            C, rtpm, new_seq, change_in_sequence, plan, home_poses,
+            C_shared, rtpm, new_seq, change_in_sequence, plan, home_poses,
             prev_makespan);
       }
 
       if (new_plan_result.status == PlanStatus::success) {
-        const Plan new_plan = new_plan_result.plan;
+        const Plan &new_plan = new_plan_result.plan;
         const double makespan = get_makespan_from_plan(new_plan);
 
         const auto end_time = std::chrono::high_resolution_clock::now();
@@ -136,8 +140,10 @@ Plan plan_multiple_arms_greedy_random_search(
 
         // cache.push_back(std::make_pair(new_seq, new_plan));
 
-        export_plan(C, robots, home_poses, new_plan, new_seq, buffer.str(), iter,
-                    duration);
+        export_plan(
+            C_shared, robots, home_poses,
+            postprocess_plan(C_shared, new_plan_result.plan, home_poses),
+            new_seq, buffer.str(), iter, duration);
 
         std::cout << "\n\n\nMAKESPAN " << makespan << " best so far "
                   << best_makespan << " (" << prev_makespan << ")" << std::endl;
@@ -148,7 +154,7 @@ Plan plan_multiple_arms_greedy_random_search(
 
         if (makespan < prev_makespan) {
           seq = new_seq;
-          plan = new_plan;
+          plan = new_plan_result.plan;
           prev_makespan = makespan;
 
           if (global_params.export_images){
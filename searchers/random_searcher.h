@@ -7,8 +7,10 @@
 
 #include "common/config.h"
 
+// the keyframes are requested from the provider when a sequence needs them,
+// i.e. planning can start before the keyframes of all primitives are known.
 Plan plan_multiple_arms_random_search(
-    rai::Configuration &C, const RobotTaskPoseMap &rtpm,
+    rai::Configuration &C, KeyframeProvider &provider,
     const std::unordered_map<Robot, arr> &home_poses,
     const uint max_attempts = 1000,
     const bool avoid_repeat_evaluations = false) {
@@ -31,10 +33,14 @@ Plan plan_multiple_arms_random_search(
     }
   }
 
+  // shared by all planning and export calls below, so that the configuration
+  // is not copied in every iteration.
+  const ConfigurationHandle C_shared(C);
+
   auto start_time = std::chrono::high_resolution_clock::now();
 
   OrderedTaskSequence best_seq;
-  Plan best_plan;
+  PlanHandle best_plan;
   double best_makespan = 1e6;
 
   std::unordered_set<OrderedTaskSequence> all_sequences;
@@ -47,7 +53,8 @@ Plan plan_multiple_arms_random_search(
     //   continue;
     // }
 
-    const auto seq = generate_random_valid_sequence(robots, num_tasks, rtpm);
+    const auto seq =
+        generate_random_valid_sequence(robots, num_tasks, provider);
 
     if (seq.size() == 0) {
       return Plan();
@@ -73,9 +80,9 @@ Plan plan_multiple_arms_random_search(
 
     // plan for it
     const auto plan_result = plan_multiple_arms_given_sequence(
-        C, rtpm, seq, home_poses, best_makespan);
+        C_shared, provider.get_keyframes(seq), seq, home_poses, best_makespan);
     if (plan_result.status == PlanStatus::success) {
-      const Plan plan = plan_result.plan;
+      const Plan &plan = plan_result.plan;
       const double makespan = get_makespan_from_plan(plan);
 
       spdlog::info("Current MAKESPAN {}, best so far: {}", makespan,
@@ -92,11 +99,13 @@ Plan plan_multiple_arms_random_search(
                                                                 start_time)
               .count();
 
-      export_plan(C, robots, home_poses, plan, seq, buffer.str(), i, duration);
+      export_plan(C_shared, robots, home_poses,
+                  postprocess_plan(C_shared, plan_result.plan, home_poses), seq,
+                  buffer.str(), i, duration);
 
       if (makespan < best_makespan) {
         best_makespan = makespan;
-        best_plan = plan;
+        best_plan = plan_result.plan;
 
         if (global_params.export_images) {
           const std::string image_path = global_params.output_path +
@@ -6,7 +6,7 @@
 
 double estimate_task_duration(const arr &start_pose, const arr &goal_pose,
                               const double max_vel, const double max_acc) {
-  const double max_dist = absMax(goal_pose - start_pose);
+  const double max_dist = abs_max_diff(goal_pose, start_pose);
   const double time_to_accelerate = max_vel / max_acc;
   const double acc_dist = 0.5 * max_vel * max_vel / max_acc * 2;
 
@@ -30,56 +30,62 @@ double compute_lb_for_sequence(const OrderedTaskSequence &seq,
                                const std::unordered_map<Robot, double> start_times = {}) {
   // the lower bound can be computed by finding the minimum time
   // of the current task, and using the precedence constraints as well.
-  std::unordered_map<Robot, double> robot_time = start_times;
-  std::unordered_map<Robot, arr> robot_pos = start_poses;
+  // robot times and positions are kept in tables indexed by the robot id, and
+  // the positions are only pointers into the given poses, i.e. nothing is
+  // copied in the loop.
+  RobotTable<double> robot_time;
+  for (const auto &st : start_times) {
+    robot_time[st.first] = st.second;
+  }
+
+  RobotTable<const arr *> robot_pos;
+  for (const auto &sp : start_poses) {
+    robot_pos[sp.first] = &sp.second;
+  }
+
+  double max_time = 0;
+  robot_time.for_each([&](const double t) { max_time = std::max(max_time, t); });
 
   for (uint i = start_index; i < seq.size(); ++i) {
-    const auto task_tuple = seq[i];
-    const auto robot = task_tuple.robots[0];
+    const auto &task_tuple = seq[i];
+    const auto &robot = task_tuple.robots[0];
     const auto task_index = task_tuple.task.object;
 
     // std::cout << robot << std::endl;
 
-    if (!robot_time.count(robot)) {
-      robot_time[robot] = 0.;
-    }
+    double &time = robot_time[robot];
 
     spdlog::info("Computing duration for {} and task {}", robot.prefix, task_index);
 
     // TODO: fix this - does not work for new primitives
-    const arr start_pose = robot_pos[robot];
-    const arr goal_pose = rtpm.at(task_tuple)[0][0];
-
-    const double max_acc = 0.1;
-
-    const double dt =
-        estimate_task_duration(start_pose, goal_pose, robot.vmax, max_acc);
-    robot_time[robot] += dt;
+    const arr &goal_pose = rtpm.at(task_tuple)[0][0];
+
+    // without a start pose, the travel time is unknown, and not counting it
+    // keeps the bound valid
+    if (robot_pos.count(robot) && robot_pos.at(robot) != nullptr) {
+      const double max_acc = 0.1;
+      const double dt = estimate_task_duration(*robot_pos.at(robot), goal_pose,
+                                               robot.vmax, max_acc);
+      time += dt;
+    } else {
+      spdlog::warn("No start pose for robot {}", robot.prefix);
+    }
 
     // since we know that there is a precendence constraint on the
     // task-completion-order we set the time to the highest current time if it
     // was lower than that
-    for (const auto &rt : robot_time) {
-      if (robot_time[robot] < rt.second) {
-        robot_time[robot] = rt.second;
-      }
+    if (time < max_time) {
+      time = max_time;
     }
+    max_time = time;
 
-    robot_pos[robot] = goal_pose;
-  }
-
-  // extract the maximum time of all the robot times
-  double max = 0;
-  for (const auto &rt : robot_time) {
-    if (max < rt.second) {
-      max = rt.second;
-    }
+    robot_pos[robot] = &goal_pose;
   }
 
-  return max;
+  // the maximum of all the robot times
+  return max_time;
 }
 
-
 bool sequence_is_feasible(const OrderedTaskSequence &seq,
                           const RobotTaskPoseMap &rtpm) {
   for (const auto &s : seq) {
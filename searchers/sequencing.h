@@ -6,6 +6,8 @@
 
 #include "planners/plan.h"
 #include "common/util.h"
+#include "common/joint_kernels.h"
+#include "samplers/keyframe_provider.h"
 
 OrderedTaskSequence generate_random_sequence(const std::vector<Robot> &robots,
                                              const uint num_tasks) {
@@ -117,6 +119,25 @@ generate_single_arm_sequence(const std::vector<Robot> &robots,
   return seq;
 }
 
+// merges the primitives of all objects into one sequence in random order,
+// keeping the order of the primitives of each object.
+OrderedTaskSequence interleave_primitives(
+    std::vector<std::deque<RobotTaskPair>> sequence_of_primitives) {
+  OrderedTaskSequence seq;
+  while(sequence_of_primitives.size() > 0){
+    const uint ind = std::rand() % sequence_of_primitives.size();
+    seq.push_back(sequence_of_primitives[ind].front());
+    sequence_of_primitives[ind].pop_front();
+
+    if (sequence_of_primitives[ind].size() == 0){
+      // delete element from vector
+      sequence_of_primitives.erase(sequence_of_primitives.begin() + ind);
+    }
+  }
+
+  return seq;
+}
+
 // Approach to generate a sequence from the primitives:
 // For all objects, collect available primitives, and choose one
 // Then shuffle the primitives, and add them to the sequence one by one
@@ -165,19 +186,48 @@ generate_random_valid_sequence(const std::vector<Robot> &robots,
     }
   }
 
-  OrderedTaskSequence seq;
-  while(sequence_of_primitives.size() > 0){
-    const uint ind = std::rand() % sequence_of_primitives.size();
-    seq.push_back(sequence_of_primitives[ind].front());
-    sequence_of_primitives[ind].pop_front();
+  return interleave_primitives(sequence_of_primitives);
+}
 
-    if (sequence_of_primitives[ind].size() == 0){
-      // delete element from vector
-      sequence_of_primitives.erase(sequence_of_primitives.begin() + ind);
+// same as above, but only computes the keyframes of the primitives that are
+// considered, until a feasible one is found for each object.
+OrderedTaskSequence
+generate_random_valid_sequence(const std::vector<Robot> &robots,
+                               const uint num_tasks,
+                               KeyframeProvider &provider) {
+  std::vector<std::deque<RobotTaskPair>> sequence_of_primitives;
+  for (uint i=0; i<num_tasks; ++i){
+    spdlog::info("Collecting available robots for obj {}", i+1);
+    std::vector<RobotTaskPair> candidates = provider.get_candidates(i);
+
+    // drawing candidates until a feasible one is found is the same as
+    // drawing from the feasible ones
+    bool found = false;
+    while (candidates.size() > 0) {
+      const uint ind = std::rand() % candidates.size();
+      const RobotTaskPair primitive = candidates[ind];
+      candidates.erase(candidates.begin() + ind);
+
+      if (!provider.is_feasible(primitive)) {
+        continue;
+      }
+
+      sequence_of_primitives.push_back({primitive});
+      if (primitive.task.type == PrimitiveType::pick_pick_1) {
+        sequence_of_primitives.back().push_back(
+            KeyframeProvider::get_second_part(primitive));
+      }
+      found = true;
+      break;
+    }
+
+    if (!found){
+      spdlog::error("No primitive available for obj {}", i+1);
+      return {};
     }
   }
 
-  return seq;
+  return interleave_primitives(sequence_of_primitives);
 }
 
 OrderedTaskSequence
@@ -228,7 +278,10 @@ OrderedTaskSequence generate_alternating_greedy_sequence(
 
   // sample starting_ robot.
   uint r = rand() % robots.size();
-  std::unordered_map<Robot, arr> poses = home_poses;
+  RobotTable<const arr *> poses;
+  for (const auto &hp : home_poses) {
+    poses[hp.first] = &hp.second;
+  }
 
   const uint max_iter = 1000;
 
@@ -248,7 +301,7 @@ OrderedTaskSequence generate_alternating_greedy_sequence(
       // check if a valid pose exists for the object/action pair
       if (rtpm.count(rtp) != 0) {
         // estimate pose-distance
-        const auto dist = absMax(poses[robots[r]] - rtpm.at(rtp)[0][0]);
+        const auto dist = abs_max_diff(*poses.at(robots[r]), rtpm.at(rtp)[0][0]);
         if (dist < min_dist) {
           task_index = t;
           min_dist = dist;
@@ -1,5 +1,25 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include <KOMO/komo.h>
+#include <Kin/featureSymbols.h>
+#include <Kin/kin.h>
+#include <PlanningSubroutines/ConfigurationProblem.h>
+
+#include "common/config.h"
+#include "common/env_util.h"
+#include "common/types.h"
+#include "common/util.h"
+
 arr center(arr pts) { return pts; }
 
 arr scale(arr pts) { return pts; }
@@ -119,7 +139,9 @@ arr cube(const uint n = 200) {
     dot->setContact(0.);
   }
 
-  C.watch(true);
+  if (global_params.allow_display) {
+    C.watch(true);
+  }
 
   pts.reshape(-1, 2);
   return pts;
@@ -319,34 +341,168 @@ arr sampleStiplingConfigurationForRobot(rai::Configuration &C, const arr &point,
   return sampleStipplingConfigurationForRobot(komo, point, prefix);
 }
 
-std::vector<arr> computeStipplingConfigurationsForPoints(const arr &pts,
-                                                rai::Configuration &C,
-                                                const std::string prefix) {
-  std::vector<arr> configurations;
+// order of the points along a greedy nearest neighbour tour, starting with
+// the point that is closest to start.
+std::vector<uint> get_nearest_neighbour_order(const std::vector<arr> &pts,
+                                              const arr &start) {
+  std::vector<uint> order;
+  std::vector<bool> visited(pts.size(), false);
+
+  arr current = start;
+  for (uint k = 0; k < pts.size(); ++k) {
+    uint next = 0;
+    double min_dist = std::numeric_limits<double>::max();
+    for (uint i = 0; i < pts.size(); ++i) {
+      if (visited[i]) {
+        continue;
+      }
+      const double dist = euclideanDistance(pts[i], current);
+      if (dist < min_dist) {
+        min_dist = dist;
+        next = i;
+      }
+    }
 
-  const auto start = std::chrono::high_resolution_clock::now();
+    visited[next] = true;
+    order.push_back(next);
+    current = pts[next];
+  }
+  return order;
+}
+
+// Solves the stippling poses of the robot for a chunk of the targets, and
+// writes them to configurations (empty if no pose was found).
+// The komo problem is set up once, only the target frame is moved between
+// points. Every point is warm started from the closest point of the chunk
+// that was solved already, and falls back to the home pose and random
+// perturbations of it.
+void solveStipplingChunk(rai::Configuration &C, const std::string &prefix,
+                         const std::vector<arr> &targets,
+                         const std::vector<uint> &chunk,
+                         std::vector<arr> &configurations, const uint seed) {
+  if (chunk.size() == 0) {
+    return;
+  }
 
-  // activate agents
   setActive(C, prefix);
 
-  const auto home = C.getJointState();
+  rai::Frame *target = C.addFrame("stippling_target");
+  target->setPosition(targets[chunk[0]]);
+
+  OptOptions options;
+  options.stopIters = 100;
+  options.damping = 1e-3;
 
   KOMO komo;
   komo.verbose = 0;
   komo.setModel(C, true);
+  komo.setDiscreteOpt(1);
+
+  komo.add_collision(true, .01, 1e1);
+  komo.add_jointLimits(true, 0., 1e1);
 
+  komo.addObjective({1.}, FS_positionDiff,
+                    {STRING(prefix << "pen_tip"), "stippling_target"}, OT_eq,
+                    {1e2});
+  komo.addObjective({1.}, FS_vectorZ, {STRING(prefix << "pen")}, OT_sos,
+                    {1e1}, {0., 0., -1.});
+
+  komo.run_prepare(0.);
+  const arr x_home = komo.x;
+
+  ConfigurationProblem cp(C);
+  setActive(cp.C, prefix);
+
+  std::mt19937 gen(seed);
+  std::normal_distribution<double> noise(0., 0.1);
+
+  std::vector<uint> solved;
+  for (const uint i : chunk) {
+    for (uint t = 0; t < komo.timeSlices.d0; ++t) {
+      komo.timeSlices(t, target->ID)->setPosition(targets[i]);
+    }
+
+    std::vector<arr> initializations;
+    if (solved.size() > 0) {
+      uint closest = solved[0];
+      for (const uint k : solved) {
+        if (euclideanDistance(targets[k], targets[i]) <
+            euclideanDistance(targets[closest], targets[i])) {
+          closest = k;
+        }
+      }
+      initializations.push_back(configurations[closest]);
+    }
+    initializations.push_back(x_home);
+    for (uint k = 0; k < 3; ++k) {
+      arr x = x_home;
+      for (uint l = 0; l < x.N; ++l) {
+        x(l) += noise(gen);
+      }
+      initializations.push_back(x);
+    }
+
+    for (const arr &x : initializations) {
+      komo.x = x;
+      komo.pathConfig.setJointState(komo.x);
+      komo.run_prepare(0.);
+      komo.run(options);
+
+      const arr q = komo.getPath()[0]();
+      if (cp.query(q)->isFeasible &&
+          komo.getReport(false).get<double>("ineq") < 1. &&
+          komo.getReport(false).get<double>("eq") < 1.) {
+        configurations[i] = q;
+        solved.push_back(i);
+        break;
+      }
+    }
+
+    if (configurations[i].N == 0) {
+      spdlog::info("Failed to compute stippling pose for pt {}", i);
+    }
+  }
+}
+
+// Computes the stippling poses of the robot for all points. The points are
+// ordered along a nearest neighbour tour, and split into chunks of
+// neighbouring points that are solved in parallel (ik_threads). The chunks
+// do not depend on the number of threads, i.e. neither do the results.
+std::vector<arr> computeStipplingConfigurationsForPoints(
+    const arr &pts, rai::Configuration &C, const std::string prefix,
+    const uint chunk_size = 32) {
+  const auto start = std::chrono::high_resolution_clock::now();
+
+  // activate agents
+  setActive(C, prefix);
+
+  const arr table_pos = C["table"]->getPosition();
+  std::vector<arr> targets;
   for (uint i = 0; i < pts.d0; ++i) {
-    const arr pt = {pts[i](0), pts[i](1), 0.075};
-    const arr q = sampleStipplingConfigurationForRobot(
-        komo, C["table"]->getPosition() + pt, prefix);
-    configurations.push_back(q);
-
-    // C.setJointState(q);
-    //
-    komo.clearObjectives();
-    komo.world.setJointState(home);
+    targets.push_back(table_pos + arr{pts(i, 0), pts(i, 1), 0.075});
   }
-  C.setJointState(home);
+
+  const std::vector<uint> order = get_nearest_neighbour_order(
+      targets, C[STRING(prefix << "base")]->getPosition());
+
+  std::vector<std::vector<uint>> chunks;
+  for (uint i = 0; i < order.size(); i += chunk_size) {
+    chunks.push_back(std::vector<uint>(
+        order.begin() + i,
+        order.begin() + std::min<std::size_t>(i + chunk_size, order.size())));
+  }
+
+  // every chunk gets its own copy of the configuration
+  std::vector<rai::Configuration> chunk_configurations(chunks.size());
+  for (auto &Ccpy : chunk_configurations) {
+    Ccpy.copy(C);
+  }
+
+  std::vector<arr> configurations(pts.d0);
+  run_parallel(chunks.size(), global_params.ik_threads, [&](const uint k) {
+    solveStipplingChunk(chunk_configurations[k], prefix, targets, chunks[k],
+                        configurations, k);
+  });
 
   const auto stop = std::chrono::high_resolution_clock::now();
   const auto duration =
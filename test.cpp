@@ -3,17 +3,25 @@
 
 #include "spdlog/spdlog.h"
 
+#include "samplers/keyframe_cache.h"
 #include "samplers/sampler.h"
 #include <Kin/featureSymbols.h>
 
 #include "searchers/sequencing.h"
 
+#include "common/binary_trajectory.h"
 #include "common/config.h"
 #include "common/env_util.h"
+#include "common/json_stream.h"
+#include "common/spatial_hash.h"
+#include "common/static_sdf.h"
 #include "common/types.h"
+#include "planners/postprocessing.h"
+#include "planners/timed_collision.h"
 #include "tests/test_util.h"
 
 #include <experimental/filesystem>
+#include <sstream>
 
 manip::Parameters global_params;
 
@@ -416,6 +424,75 @@ GTEST_TEST(KEYFRAME_TEST, TripleArmHandoverTest) {
   }
 }
 
+GTEST_TEST(KEYFRAME_TEST, LazyKeyframesMatchPrecomputed) {
+  spdlog::set_level(spdlog::level::off);
+
+  rai::Configuration C;
+  const auto robots = two_robot_configuration(C, true);
+
+  const uint num_objects = 2;
+  shuffled_line(C, num_objects, 0.3, false);
+
+  const auto rtpm = compute_all_pick_and_place_positions(C, robots);
+
+  KeyframeProvider provider(C, robots, true, false, false);
+  for (uint i = 0; i < num_objects; ++i) {
+    for (const auto &rtp : provider.get_candidates(i)) {
+      ASSERT_EQ(provider.is_feasible(rtp), rtpm.count(rtp) > 0);
+    }
+  }
+
+  // the sequence only consists of feasible primitives
+  const auto seq =
+      generate_random_valid_sequence(robots, num_objects, provider);
+  ASSERT_EQ(seq.size(), num_objects);
+  for (const auto &rtp : seq) {
+    ASSERT_TRUE(rtpm.count(rtp) > 0);
+  }
+}
+
+GTEST_TEST(KEYFRAME_TEST, KeyframeCacheReusesUnchangedScene) {
+  spdlog::set_level(spdlog::level::off);
+
+  rai::Configuration C;
+  const auto robots = two_robot_configuration(C, true);
+
+  const uint num_objects = 2;
+  shuffled_line(C, num_objects, 0.3, false);
+
+  const std::string path = "/tmp/keyframe_cache_test.json";
+  std::remove(path.c_str());
+
+  const auto rtpm =
+      compute_keyframes_incrementally(C, robots, path, true, false, false);
+
+  KeyframeScene prev;
+  RobotTaskPoseMap prev_rtpm;
+  ASSERT_TRUE(load_keyframe_cache(path, robots, prev, prev_rtpm));
+  ASSERT_EQ(prev_rtpm.size(), rtpm.size());
+
+  const std::string settings = get_keyframe_settings(true, false, false, false);
+  const KeyframeScene scene = get_keyframe_scene(C, robots, settings);
+  ASSERT_EQ(get_changed_objects(prev, scene).size(), 0);
+
+  // nothing changed, i.e. all primitives are reused
+  KeyframeProvider provider(C, robots, true, false, false);
+  const auto reusable =
+      get_reusable_keyframes(prev, prev_rtpm, scene, robots, provider);
+  ASSERT_EQ(reusable.size(), num_objects * robots.size());
+
+  // moving an object invalidates its primitives
+  C["obj1"]->setPosition(C["obj1"]->getPosition() + arr{0.05, 0., 0.});
+  const KeyframeScene moved = get_keyframe_scene(C, robots, settings);
+  const auto changed = get_changed_objects(prev, moved);
+  ASSERT_EQ(changed.size(), 1);
+  ASSERT_EQ(changed[0], 0);
+  for (const auto &entry :
+       get_reusable_keyframes(prev, prev_rtpm, moved, robots, provider)) {
+    ASSERT_NE(entry.first.task.object, 0);
+  }
+}
+
 GTEST_TEST(PLANNING_TEST, SingleArmTest) {
   bool show = false;
   spdlog::set_level(spdlog::level::off);
@@ -469,6 +546,258 @@ GTEST_TEST(UTIL_TEST, SetAndLinkToPhaseTest) {
   // TODO
 }
 
+GTEST_TEST(UTIL_TEST, BinaryTrajectoryRoundTrip) {
+  const uint num_steps = 50;
+  arr joint_states(num_steps, 6);
+  for (uint i = 0; i < joint_states.N; ++i) {
+    joint_states.elem(i) = std::sin(0.01 * i);
+  }
+
+  std::vector<std::string> actions;
+  for (uint t = 0; t < num_steps; ++t) {
+    actions.push_back(t < 20 ? "pick" : "place");
+  }
+
+  const std::string path = "/tmp/binary_trajectory_test.bin";
+  for (const auto q : {TrajectoryQuantization::none,
+                       TrajectoryQuantization::fixed_point,
+                       TrajectoryQuantization::delta}) {
+    BinaryTrajectoryWriter writer(num_steps, q);
+    writer.add_column("a0_/joint_state", joint_states);
+    writer.add_action_column("a0_/action", actions);
+    ASSERT_TRUE(writer.write(path));
+
+    const arr read = read_binary_trajectory_column(path, "a0_/joint_state");
+    ASSERT_EQ(read.d0, num_steps);
+    ASSERT_EQ(read.d1, 6);
+    for (uint i = 0; i < read.N; ++i) {
+      EXPECT_NEAR(read.elem(i), joint_states.elem(i), 1e-4);
+    }
+
+    const arr codes = read_binary_trajectory_column(path, "a0_/action");
+    const auto dict = read_binary_trajectory_actions(path);
+    ASSERT_EQ(dict.size(), 2);
+    for (uint t = 0; t < num_steps; ++t) {
+      EXPECT_EQ(dict[uint(codes(t, 0))], actions[t]);
+    }
+  }
+}
+
+GTEST_TEST(UTIL_TEST, JsonStreamWriterMatchesTree) {
+  const uint num_steps = 40;
+
+  json data;
+  json all_robot_data;
+  for (uint i = 0; i < 2; ++i) {
+    json robot_data;
+    robot_data["name"] = "a" + std::to_string(i) + "_";
+    for (uint t = 0; t < num_steps; ++t) {
+      json step_data;
+      step_data["joint_state"] = std::vector<double>{0.1 * t, 1. / 3., -2e-7};
+      step_data["action"] = t % 2 == 0 ? "pick" : "place";
+      robot_data["steps"].push_back(step_data);
+    }
+    all_robot_data.push_back(robot_data);
+  }
+  data["robots"] = all_robot_data;
+  data["objs"] = json();
+
+  for (const bool cbor : {false, true}) {
+    std::stringstream expected;
+    if (cbor) {
+      json::to_cbor(data, expected);
+    } else {
+      expected << data;
+    }
+
+    std::stringstream streamed;
+    {
+      JsonStreamWriter writer(streamed, cbor);
+      writer.begin_object(2);
+      writer.key("robots");
+      writer.begin_array(2);
+      for (uint i = 0; i < 2; ++i) {
+        writer.begin_object(2);
+        writer.key("name");
+        writer.value("a" + std::to_string(i) + "_");
+        writer.key("steps");
+        writer.begin_array(num_steps);
+        for (uint t = 0; t < num_steps; ++t) {
+          json step_data;
+          step_data["joint_state"] =
+              std::vector<double>{0.1 * t, 1. / 3., -2e-7};
+          step_data["action"] = t % 2 == 0 ? "pick" : "place";
+          writer.value(step_data);
+        }
+        writer.end_array();
+        writer.end_object();
+      }
+      writer.end_array();
+      writer.key("objs");
+      writer.value(json());
+      writer.end_object();
+    }
+
+    EXPECT_EQ(expected.str(), streamed.str());
+  }
+}
+
+GTEST_TEST(UTIL_TEST, RobotIdsAndTables) {
+  const Robot r1("test_a0_", RobotType::ur5);
+  const Robot r2("test_a1_", RobotType::ur5);
+  const Robot r1_copy("test_a0_", RobotType::ur5);
+
+  EXPECT_EQ(r1.id, r1_copy.id);
+  EXPECT_NE(r1.id, r2.id);
+  EXPECT_EQ(r1, r1_copy);
+  EXPECT_EQ(std::hash<Robot>()(r1), std::hash<Robot>()(r1_copy));
+
+  RobotTable<double> table;
+  EXPECT_FALSE(table.count(r1));
+  table[r2] = 2.;
+  EXPECT_TRUE(table.count(r2));
+  EXPECT_FALSE(table.count(r1));
+  EXPECT_EQ(table.at(r2), 2.);
+
+  EXPECT_THROW(table[Robot()], std::out_of_range);
+}
+
+GTEST_TEST(UTIL_TEST, IncrementalAnimationBackwardQueries) {
+  spdlog::set_level(spdlog::level::off);
+
+  rai::Configuration C;
+  const auto robots = single_robot_configuration(C, true);
+  random_objects(C, 1);
+  setActive(C, robots[0]);
+
+  // two parts that move the same object, the second one starts after the
+  // first one ended
+  rai::Animation A;
+  const arr pose = C["obj1"]->getPose();
+  for (const uint start : {0u, 15u}) {
+    rai::Animation::AnimationPart part;
+    part.start = start;
+    part.frameIDs = uintA{C["obj1"]->ID};
+    part.X.resize(10, 1, 7);
+    for (uint t = 0; t < 10; ++t) {
+      for (uint k = 0; k < 7; ++k) {
+        part.X(t, 0, k) = pose(k);
+      }
+      part.X(t, 0, 1) += 0.01 * (start + t);
+    }
+    A.A.append(part);
+  }
+
+  // the cached static results would skip setting the animation
+  const bool use_temporal_bvh = global_params.use_temporal_bvh;
+  global_params.use_temporal_bvh = false;
+
+  TimedConfigurationProblem TP(C, A);
+  TimedConfigurationProblem TP_ref(C, A);
+  TimedCollisionChecker checker(TP, robots[0]);
+
+  const arr q = robots[0].home_pose.get();
+  for (const double t : {30., 20., 12., 5., 17., 3., 24., 14., 0.}) {
+    EXPECT_EQ(checker.is_feasible(q, t), TP_ref.query(q, t)->isFeasible);
+    EXPECT_LT(maxDiff(TP.C["obj1"]->getPose(), TP_ref.C["obj1"]->getPose()),
+              1e-9)
+        << "at time " << t;
+  }
+
+  global_params.use_temporal_bvh = use_temporal_bvh;
+}
+
+GTEST_TEST(UTIL_TEST, StaticSceneSDFBox) {
+  rai::Configuration C;
+  auto *table = C.addFrame("table");
+  table->setShape(rai::ST_box, {1., 1., 0.1});
+  table->setContact(1);
+  table->setPosition({0., 0., 0.5});
+
+  StaticSceneSDF sdf;
+  sdf.build(get_static_frames(C, {}), {-1., -1., 0.}, {1., 1., 1.}, 0.02);
+  ASSERT_TRUE(sdf.is_valid());
+
+  // inside of the table
+  const double inside[3] = {0.1, -0.2, 0.5};
+  EXPECT_LT(sdf.get_upper_bound(inside), -0.02);
+
+  // above the table, the upper bound has to be at least the true distance
+  const double above[3] = {0., 0., 0.8};
+  EXPECT_GE(sdf.get_upper_bound(above), 0.25 - 1e-6);
+
+  // outside of the grid, nothing is known
+  const double outside[3] = {0., 0., 2.};
+  EXPECT_GT(sdf.get_upper_bound(outside), 1e6);
+}
+
+GTEST_TEST(UTIL_TEST, RetimingCompressesWaits) {
+  spdlog::set_level(spdlog::level::off);
+
+  rai::Configuration C;
+  const auto robots = single_robot_configuration(C, true);
+  const Robot &r = robots[0];
+  const auto home_poses = get_robot_home_poses(robots);
+
+  // move the first joint, wait, and move back, slightly below the velocity
+  // limit
+  const uint num_moving_steps = 10;
+  const uint num_waiting_steps = 30;
+  const uint length = 2 * num_moving_steps + num_waiting_steps + 1;
+
+  arr t(length);
+  arr path(length, home_poses.at(r).N);
+  arr q = home_poses.at(r);
+  for (uint i = 0; i < length; ++i) {
+    if (i > 0 && i <= num_moving_steps) {
+      q(0) += 0.9 * r.vmax;
+    } else if (i > num_moving_steps + num_waiting_steps) {
+      q(0) -= 0.9 * r.vmax;
+    }
+    t(i) = i;
+    path[i] = q;
+  }
+
+  Plan plan;
+  plan[r].push_back(TaskPart(t, path));
+
+  const Plan retimed = retime_plan(C, plan, home_poses);
+  ASSERT_EQ(retimed.count(r), 1);
+
+  // the moving steps can not be compressed, but the waiting steps can
+  const double makespan = get_makespan_from_plan(retimed);
+  EXPECT_LT(makespan, get_makespan_from_plan(plan) - num_waiting_steps / 2);
+  EXPECT_GE(makespan, 2 * 0.9 * num_moving_steps - 1e-6);
+
+  const arr &retimed_path = retimed.at(r)[0].path;
+  EXPECT_LT(maxDiff(retimed_path[0], path[0]), 1e-9);
+  EXPECT_LT(maxDiff(retimed_path[-1], path[-1]), 1e-9);
+}
+
+GTEST_TEST(UTIL_TEST, FootprintHashOverlap) {
+  FootprintHash hash(0.1);
+  hash.insert({0., 0., 0.1, 0.05, 0.});
+  hash.insert({1., 1., 0.05, 0.05, 0.});
+
+  // overlaps with the first one, also across cell borders
+  EXPECT_TRUE(hash.collides({0.15, 0., 0.06, 0.02, 0.}));
+
+  // the bounding boxes overlap in both cases, only the first one overlaps
+  EXPECT_TRUE(hash.collides({-0.15, 0.06, 0.08, 0.02, -RAI_PI / 4}));
+  EXPECT_FALSE(hash.collides({-0.15, 0.06, 0.08, 0.02, RAI_PI / 4}));
+
+  // the rotated square only overlaps the first one with its corner
+  EXPECT_TRUE(hash.collides({0.15, 0., 0.04, 0.04, RAI_PI / 4}));
+  EXPECT_FALSE(hash.collides({0.16, 0., 0.04, 0.04, 0.}));
+
+  // margin
+  EXPECT_FALSE(hash.collides({0., 0.08, 0.05, 0.02, 0.}));
+  EXPECT_TRUE(hash.collides({0., 0.08, 0.05, 0.02, 0.}, 0.01));
+
+  EXPECT_FALSE(hash.collides({0.5, 0.5, 0.1, 0.1, 0.}));
+  EXPECT_FALSE(hash.collides({-1., -1., 0.05, 0.05, 0.}));
+}
+
 extern "C" int backtrace(void **buffer, int size) {
     return 0; // Prevent stack trace generation
 }
@@ -480,4 +809,4 @@ int main( int argc, char** argv )
     freopen("/dev/null", "w", stderr); // Redirects stderr to /dev/null (Linux/Unix systems)
 
     return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}
@@ -4,6 +4,7 @@
 
 #include "../samplers/sampler.h"
 #include "common/env_util.h"
+#include "common/spatial_hash.h"
 #include "common/types.h"
 
 #include "test_util.h" 
@@ -25,7 +26,9 @@ void benchmark_single_arm_pick_and_place_success_rate(
 
   const arr base_pos = C["a0_base"]->getPosition();
 
-  // add obstacles
+  // add obstacles. Candidates that overlap with an obstacle that was placed
+  // already are rejected without setting up a collision query.
+  FootprintHash obstacles;
   const uint num_obstacles = 5;
   for (uint j = 0; j < num_obstacles; ++j) {
     double width = rnd.uni(0.05, 0.2);
@@ -49,11 +52,16 @@ void benchmark_single_arm_pick_and_place_success_rate(
       obj->setRelativePosition({base_pos(0) + x, base_pos(1) + y, 0.07});
       // obj->setRelativeQuaternion(base_quat);
 
+      if (obstacles.collides(get_footprint(obj))) {
+        continue;
+      }
+
       // check if something is in collision
       ConfigurationProblem cp(C);
       cp.activeOnly = false;
       const auto res = cp.query({}, false);
       if (res->isFeasible) {
+        obstacles.insert(get_footprint(obj));
         break;
       }
     }
@@ -92,6 +100,10 @@ void benchmark_single_arm_pick_and_place_success_rate(
       obj->setPosition({base_pos(0) + x, base_pos(1) + y, 0.61});
       obj->setRelativeQuaternion({cos(alpha / 2), 0, 0, sin(alpha / 2)});
 
+      if (obstacles.collides(get_footprint(obj))) {
+        continue;
+      }
+
       // check if something is in collision
       ConfigurationProblem cp(C);
       const auto res = cp.query({}, false);
@@ -120,6 +132,11 @@ void benchmark_single_arm_pick_and_place_success_rate(
 
       // goal->setColor({col(0), col(1), col(2), 0.5});
 
+      if (obstacles.collides(get_footprint(goal)) ||
+          footprints_overlap(get_footprint(goal), get_footprint(obj))) {
+        continue;
+      }
+
       // check if something is in collision
       ConfigurationProblem cp(C);
       const auto res = cp.query({}, false);